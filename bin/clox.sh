@@ -19,6 +19,10 @@ CLOX_DEFS["optdoti"]=DOT_INVOKE_OPT
 CLOX_DEFS["opttabf"]=TABLE_AND_FOLD_OPT
 CLOX_DEFS["optsupi"]=SUPER_INVOKE_OPT
 CLOX_DEFS["optnanb"]=NAN_BOXING_OPT
+CLOX_DEFS["nocache"]=CLOX_NO_CACHE
+CLOX_DEFS["nosimd"]=CLOX_NO_SIMD
+CLOX_DEFS["opstat"]=CLOX_OP_STATS
+CLOX_DEFS["alloc"]=CLOX_ALLOC_STATS
 
 function _clox_valid_macro() {
   [ -z "$1" ] && return 1
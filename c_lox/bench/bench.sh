@@ -0,0 +1,102 @@
+#!/usr/bin/env bash
+# Builds clox once per option variant and times every benchmark in
+# bench/lox, the report is a TSV compared against bench/baseline.tsv.
+#
+#   bench/bench.sh             # report, exits 1 on any regression
+#   bench/bench.sh --baseline  # report and store it as the baseline
+#
+# BENCH_RUNS (5) timed runs follow one warm-up run, the median is
+# compared. Medians slower than the baseline by more than
+# BENCH_THRESHOLD percent (10) are flagged REGRESSION, output that
+# differs from the base variant is flagged WRONG.
+
+cd "$(dirname "$0")/.." || exit 2
+
+CC=${CC:-gcc -std=c2x -O3 -pthread}
+RUNS=${BENCH_RUNS:-5}
+THRESHOLD=${BENCH_THRESHOLD:-10}
+BUILD=bench/build
+BASELINE=bench/baseline.tsv
+REPORT=bench/report.tsv
+
+# Named after the bin/clox.sh macros, caching is off so that only
+# the VM is measured.
+VARIANTS=(
+  "base:"
+  "optnanb:-DNAN_BOXING_OPT"
+  "opttabf:-DTABLE_AND_FOLD_OPT"
+  "optdoti:-DDOT_INVOKE_OPT"
+  "optsupi:-DSUPER_INVOKE_OPT"
+  "optall:-DCLOX_ALL_OPT"
+)
+[ -n "$BENCH_VARIANTS" ] && read -ra VARIANTS <<< "$BENCH_VARIANTS"
+
+now_ns() { date +%s%N; }
+
+# Prints the median and minimum of the arguments.
+median_min() {
+  printf '%s\n' "$@" | sort -n | awk '
+    { v[NR] = $1 }
+    END { m = NR % 2 ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2; print m, v[1] }'
+}
+
+baseline_of() {
+  [ -f "$BASELINE" ] && awk -F'\t' -v v="$1" -v b="$2" \
+    '$1 == v && $2 == b { print $3 }' "$BASELINE"
+}
+
+mkdir -p "$BUILD"
+for variant in "${VARIANTS[@]}"; do
+  name=${variant%%:*}
+  echo "building $name" >&2
+  $CC ${variant#*:} -DCLOX_NO_CACHE -o "$BUILD/clox-$name" -Iinclude main.c \
+    2> "$BUILD/clox-$name.log" || { cat "$BUILD/clox-$name.log" >&2; exit 2; }
+done
+
+declare -A expected
+status_all=0
+wrong=0
+printf 'variant\tbenchmark\tmedian_ms\tmin_ms\tbaseline_ms\tchange_pct\tstatus\n' > "$REPORT"
+for variant in "${VARIANTS[@]}"; do
+  name=${variant%%:*}
+  for file in bench/lox/*.lox; do
+    bench=$(basename "$file" .lox)
+    output=$("$BUILD/clox-$name" "$file" 2>&1)
+    [ -z "${expected[$bench]+set}" ] && expected[$bench]=$output
+    times=()
+    for ((run = 0; run < RUNS; ++run)); do
+      start=$(now_ns)
+      "$BUILD/clox-$name" "$file" > /dev/null 2>&1
+      times+=($(( ($(now_ns) - start) / 1000 )))
+    done
+    read -r median min <<< "$(median_min "${times[@]}")"
+    base=$(baseline_of "$name" "$bench")
+    read -r median_ms min_ms change status <<< "$(awk -v m="$median" -v n="$min" \
+      -v b="$base" -v t="$THRESHOLD" 'BEGIN {
+        m /= 1000; n /= 1000
+        if ( b == "" ) { c = "-"; s = "new" }
+        else {
+          p = (m - b) * 100 / b
+          c = sprintf("%+.1f", p)
+          s = p > t ? "REGRESSION" : p < -t ? "faster" : "ok"
+        }
+        printf "%.1f %.1f %s %s\n", m, n, c, s
+      }')"
+    [ "$output" != "${expected[$bench]}" ] && status=WRONG && wrong=1
+    [ "$status" = REGRESSION ] || [ "$status" = WRONG ] && status_all=1
+    printf '%s\t%s\t%s\t%s\t%s\t%s\t%s\n' "$name" "$bench" "$median_ms" "$min_ms" \
+      "${base:--}" "$change" "$status" | tee -a "$REPORT"
+  done
+done
+
+if [ "$1" = --baseline ]; then
+  # Timings of a broken variant are no reference.
+  if [ $wrong = 1 ]; then
+    echo "not storing $BASELINE, some output is WRONG" >&2
+    exit 1
+  fi
+  awk -F'\t' 'NR > 1 { print $1 "\t" $2 "\t" $3 }' "$REPORT" > "$BASELINE"
+  echo "stored $BASELINE" >&2
+  exit 0
+fi
+exit $status_all
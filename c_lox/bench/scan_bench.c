@@ -0,0 +1,64 @@
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
+#include <lox/scanner.h>
+
+// Scanner throughput over a generated source, build with
+// and without -DCLOX_NO_SIMD to compare the two paths.
+//   usage: scan_bench [megabytes] [repetitions]
+
+const char* fragments[] = {
+  "var config_entry_name = \"some configuration value\";\n",
+  "    if (counter_value >= 1024) return lookup(table, 3.14159);\n",
+  "fun generated_function_name(first, second, third) {\n",
+  "        while (index < limit) index = index + 1;\n",
+  "  // a comment that the scanner has to skip over\n",
+  "class GeneratedClass < BaseClass { init() { this.field = nil; } }\n",
+  "\n\n                                                    \n",
+  "print \"a longer string literal spanning\nmore than a single line\";\n",
+};
+
+char* generate_source(size_t size) {
+  char* source = (char*)malloc(size + 1);
+  if ( source == NULL ) exit(74);
+  size_t count = sizeof(fragments) / sizeof(*fragments), length = 0;
+  for ( size_t idx = 0; ; idx = (idx * 7 + 3) % count ) {
+    size_t fragment = strlen(fragments[idx]);
+    if ( length + fragment > size ) break;
+    memcpy(source + length, fragments[idx], fragment);
+    length += fragment;
+  }
+  source[length] = '\0';
+  return source;
+}
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+  size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+  int repetitions = argc > 2 ? atoi(argv[2]) : 5;
+  char* source = generate_source(megabytes << 20);
+  size_t length = strlen(source);
+  double best = 0;
+  long tokens = 0;
+  for ( int rep = 0; rep < repetitions; ++rep ) {
+    double start = now();
+    tokens = 0;
+    scanner_init(source);
+    while ( scan().type != TOKEN_EOF ) tokens++;
+    double elapsed = now() - start;
+    if ( rep == 0 || elapsed < best ) best = elapsed;
+  }
+#ifdef CLOX_SCAN_SIMD
+  const char* mode = "simd";
+#else
+  const char* mode = "scalar";
+#endif // CLOX_SCAN_SIMD
+  printf("scan[%s]: %zu bytes, %ld tokens, %d lines, best %.3fs, %.1f MB/s\n",
+    mode, length, tokens, scanner.line, best, length / best / (1 << 20));
+  free(source);
+  return 0;
+}
@@ -5,5 +5,6 @@
 #include "chunk.h"
 #include "debug.h"
 #include "vm.h"
+#include "embed.h"
 
 #endif //_CLOX_ALL_H
@@ -0,0 +1,186 @@
+#ifndef _CLOX_ALLOCSTATS_H
+#define _CLOX_ALLOCSTATS_H
+
+#include "common.h"
+#include "object.h"
+
+CLOX_BEG_DECLS
+
+#ifdef CLOX_ALLOC_STATS
+
+// Allocation site profiling for CLOX_ALLOC_STATS builds. Every byte
+// reallocate hands out is charged to the function and line of the
+// running frame ("<vm>" outside of frames: compiling, natives set
+// up by the host). Objects remember their site, so collections can
+// tell which sites produce garbage and which produce survivors.
+// vm_delete prints the ALLOC_STATS_TOP sites with the most bytes:
+//
+//   site        bytes  allocs objects survived  freed  live  top type
+//   make:4   12400000  310000  310000      120 309800    80  INSTANCE 100%
+//
+// survived counts objects that lived through at least one collection.
+// Functions owning a site stay alive until the report.
+
+#ifndef ALLOC_STATS_TOP
+# define ALLOC_STATS_TOP 20
+#endif // ALLOC_STATS_TOP
+#define ALLOC_STATS_TYPES 32 // Above the number of object types.
+
+typedef struct {
+  ObjectFunction* function; // NULL for allocations outside frames.
+  int line;
+  uint64_t bytes;
+  uint64_t allocations;
+  uint64_t objects;
+  uint64_t survived;
+  uint64_t freed;
+  uint64_t types[ALLOC_STATS_TYPES];
+} AllocSite;
+
+struct AllocStats {
+  AllocSite* sites; // Indices are stored in objects, never moved.
+  int count;
+  int capacity;
+  int* index; // Open addressing over sites, -1 for free slots.
+  int index_capacity;
+  uint64_t collections;
+};
+
+uint32_t alloc_stats_hash(ObjectFunction* function, int line) {
+  return (uint32_t)((((uintptr_t)function >> 4) ^ (uint64_t)line * 40503u) * 2654435761u);
+}
+
+int* alloc_stats_slot(AllocStats* stats, ObjectFunction* function, int line) {
+  uint32_t mask = stats->index_capacity - 1;
+  uint32_t slot = alloc_stats_hash(function, line) & mask;
+  for ( ;; slot = (slot + 1) & mask ) {
+    int index = stats->index[slot];
+    if ( index < 0 ) return &stats->index[slot];
+    if ( stats->sites[index].function == function && stats->sites[index].line == line )
+      return &stats->index[slot];
+  }
+}
+
+int alloc_stats_site(AllocStats* stats, ObjectFunction* function, int line) {
+  if ( stats->count + 1 > stats->index_capacity / 2 ) {
+    int capacity = stats->index_capacity ? stats->index_capacity * 2 : 256;
+    free(stats->index);
+    stats->index = (int*)malloc(sizeof(int) * capacity);
+    if ( stats->index == NULL ) exit(80);
+    for ( int i = 0; i < capacity; ++i ) stats->index[i] = -1;
+    stats->index_capacity = capacity;
+    for ( int i = 0; i < stats->count; ++i )
+      *alloc_stats_slot(stats, stats->sites[i].function, stats->sites[i].line) = i;
+  }
+  int* slot = alloc_stats_slot(stats, function, line);
+  if ( *slot >= 0 ) return *slot;
+  if ( stats->count == stats->capacity ) {
+    stats->capacity = GROW_CAPACITY(stats->capacity);
+    stats->sites = (AllocSite*)realloc(stats->sites, sizeof(AllocSite) * stats->capacity);
+    if ( stats->sites == NULL ) exit(80);
+  }
+  stats->sites[stats->count] = (AllocSite){ .function = function, .line = line };
+  return *slot = stats->count++;
+}
+
+// Site of the running frame.
+int alloc_stats_current() {
+  if ( vm->alloc_stats == NULL ) {
+    vm->alloc_stats = (AllocStats*)calloc(1, sizeof(AllocStats));
+    if ( vm->alloc_stats == NULL ) exit(80);
+  }
+  if ( vm->frame_count == 0 ) return alloc_stats_site(vm->alloc_stats, NULL, 0);
+  CallFrame* frame = &vm->frames[vm->frame_count - 1];
+  ObjectFunction* function = frame->closure->function;
+  int offset = (int)(frame->ip - function->chunk.code);
+  return alloc_stats_site(vm->alloc_stats, function,
+    offset > 0 ? function->chunk.lines[offset - 1] : 0);
+}
+
+void alloc_stats_bytes(size_t bytes) {
+  int index = alloc_stats_current();
+  AllocSite* site = &vm->alloc_stats->sites[index];
+  site->bytes += bytes;
+  ++site->allocations;
+}
+
+void alloc_stats_object(Object* object) {
+  object->alloc_site = alloc_stats_current();
+  object->survived = false;
+  AllocSite* site = &vm->alloc_stats->sites[object->alloc_site];
+  ++site->objects;
+  if ( object->type < ALLOC_STATS_TYPES ) ++site->types[object->type];
+}
+
+// Called by gc_sweep for every object it looks at.
+void alloc_stats_sweep(Object* object, bool freed) {
+  AllocSite* site = &vm->alloc_stats->sites[object->alloc_site];
+  if ( freed ) ++site->freed;
+  else if ( !object->survived ) {
+    object->survived = true;
+    ++site->survived;
+  }
+}
+
+void gc_mark_alloc_stats() {
+  if ( vm->alloc_stats == NULL ) return;
+  // Heap snapshots mark roots too, see heap.h.
+  if ( vm->gc_collection_in_progress ) ++vm->alloc_stats->collections;
+  for ( int i = 0; i < vm->alloc_stats->count; ++i )
+    gc_mark_object((Object*)vm->alloc_stats->sites[i].function);
+}
+
+int alloc_stats_compare(const void* a, const void* b) {
+  uint64_t x = (*(AllocSite* const*)a)->bytes, y = (*(AllocSite* const*)b)->bytes;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void alloc_stats_report(AllocStats* stats) {
+  AllocSite** sorted = (AllocSite**)malloc(sizeof(AllocSite*) * (stats->count + 1));
+  if ( sorted == NULL ) exit(80);
+  uint64_t bytes = 0;
+  for ( int i = 0; i < stats->count; ++i ) {
+    sorted[i] = &stats->sites[i];
+    bytes += stats->sites[i].bytes;
+  }
+  qsort(sorted, stats->count, sizeof(AllocSite*), alloc_stats_compare);
+  fprintf(stderr, "Allocations: %llu bytes from %d sites over %llu collections.\n",
+    (unsigned long long)bytes, stats->count, (unsigned long long)stats->collections);
+  fprintf(stderr, "%-24s %14s %10s %10s %10s %10s %10s  %s\n", "site", "bytes",
+    "allocs", "objects", "survived", "freed", "live", "top type");
+  for ( int i = 0; i < stats->count && i < ALLOC_STATS_TOP; ++i ) {
+    AllocSite* site = sorted[i];
+    char label[64];
+    if ( site->function == NULL ) snprintf(label, sizeof(label), "<vm>");
+    else snprintf(label, sizeof(label), "%s:%d", site->function->name != NULL ?
+      site->function->name->chars : "script", site->line);
+    int top = 0;
+    for ( int type = 1; type < ALLOC_STATS_TYPES; ++type )
+      if ( site->types[type] > site->types[top] ) top = type;
+    fprintf(stderr, "%-24s %14llu %10llu %10llu %10llu %10llu %10llu", label,
+      (unsigned long long)site->bytes, (unsigned long long)site->allocations,
+      (unsigned long long)site->objects, (unsigned long long)site->survived,
+      (unsigned long long)site->freed, (unsigned long long)(site->objects - site->freed));
+    if ( site->objects )
+      fprintf(stderr, "  %s %.0f%%", strobjtype(top) + 7, site->types[top] * 100.0 / site->objects);
+    fputc('\n', stderr);
+  }
+  free(sorted);
+}
+
+// Called by vm_delete while the functions are still alive.
+void alloc_stats_delete() {
+  AllocStats* stats = vm->alloc_stats;
+  if ( stats == NULL ) return;
+  vm->alloc_stats = NULL;
+  alloc_stats_report(stats);
+  free(stats->sites);
+  free(stats->index);
+  free(stats);
+}
+
+#endif // CLOX_ALLOC_STATS
+
+CLOX_END_DECLS
+
+#endif //_CLOX_ALLOCSTATS_H
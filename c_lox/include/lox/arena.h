@@ -0,0 +1,83 @@
+#ifndef _CLOX_ARENA_H
+#define _CLOX_ARENA_H
+
+#include "common.h"
+
+CLOX_BEG_DECLS
+
+// Bump allocator for short lived state, everything is released
+// at once by arena_delete. Memory comes from malloc directly so
+// it is neither counted nor collected by the GC.
+
+#ifndef ARENA_BLOCK_SIZE
+# define ARENA_BLOCK_SIZE 1024 * 16
+#endif // ARENA_BLOCK_SIZE
+
+#define ARENA_ALIGN(size) \
+  (((size) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+
+#define ARENA_ALLOCATE(arena, Type, Size) \
+  ((Type*)arena_alloc(arena, sizeof(Type) * (Size)))
+
+#define ARENA_GROW_ARRAY(arena, Type, begptr, oldcap, capacity) \
+  ((Type*)arena_grow(arena, begptr, sizeof(Type) * (oldcap), sizeof(Type) * (capacity)))
+
+typedef struct ArenaBlock {
+  struct ArenaBlock* next;
+  size_t capacity;
+  size_t used;
+  max_align_t data[];
+} ArenaBlock;
+
+typedef struct {
+  ArenaBlock* blocks;
+} Arena;
+
+void arena_init(Arena* arena) {
+  arena->blocks = NULL;
+}
+
+void arena_delete(Arena* arena) {
+  ArenaBlock* block;
+  while ( arena->blocks != NULL ) {
+    block = arena->blocks;
+    arena->blocks = block->next;
+    free(block);
+  }
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+  size = ARENA_ALIGN(size);
+  ArenaBlock* block = arena->blocks;
+  if ( block == NULL || block->capacity - block->used < size ) {
+    size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + capacity);
+    if ( block == NULL ) exit(80);
+    block->capacity = capacity;
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+  void* result = (char*)block->data + block->used;
+  block->used += size;
+  return result;
+}
+
+// Extends the most recent allocation in place when it fits,
+// otherwise copies it, the old space is reclaimed with the arena.
+void* arena_grow(Arena* arena, void* ptr, size_t osize, size_t nsize) {
+  ArenaBlock* block = arena->blocks;
+  if ( ptr != NULL && block != NULL &&
+    (char*)ptr + ARENA_ALIGN(osize) == (char*)block->data + block->used &&
+    (char*)ptr + ARENA_ALIGN(nsize) <= (char*)block->data + block->capacity ) {
+    block->used += ARENA_ALIGN(nsize) - ARENA_ALIGN(osize);
+    return ptr;
+  }
+  void* result = arena_alloc(arena, nsize);
+  if ( osize ) memcpy(result, ptr, osize);
+  return result;
+}
+
+CLOX_END_DECLS
+
+#endif //_CLOX_ARENA_H
@@ -0,0 +1,377 @@
+#ifndef _CLOX_CACHE_H
+#define _CLOX_CACHE_H
+
+#include "common.h"
+#include "object.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+CLOX_BEG_DECLS
+
+// Compiled scripts are cached next to their source as '<path>c'
+// (fib.lox -> fib.loxc). The image is mmap'd on later runs and
+// chunk code and line tables point straight into the mapping.
+//
+// Layout (native endianness, ints are 4 byte aligned):
+//   header:   "LOXC" version:u32 options:u64 source_hash:u64 source_length:u64
+//   function: arity:i32 upvalue_count:i32 name_length:i32 name[pad4]
+//             code_count:i32 lines:i32[code_count] code:u8[code_count][pad4]
+//             constant_count:i32 constant*
+//   constant: tag:u8 then i32 (CONST_INT), f64 (CONST_NUMBER),
+//             i32 length + bytes (CONST_STRING) or a nested function.
+
+#define CLOX_CACHE_MAGIC "LOXC"
+#define CLOX_CACHE_VERSION 3
+#define CLOX_CACHE_SUFFIX 'c'
+
+// Compile options that change the emitted bytecode, an
+// image is only reused by a build with the same options.
+#ifdef DOT_INVOKE_OPT
+# define _CACHE_OPT_DOT_INVOKE 1
+#else
+# define _CACHE_OPT_DOT_INVOKE 0
+#endif // DOT_INVOKE_OPT
+#ifdef SUPER_INVOKE_OPT
+# define _CACHE_OPT_SUPER_INVOKE 2
+#else
+# define _CACHE_OPT_SUPER_INVOKE 0
+#endif // SUPER_INVOKE_OPT
+#ifdef NAN_BOXING_OPT
+# define _CACHE_OPT_NAN_BOXING 4
+#else
+# define _CACHE_OPT_NAN_BOXING 0
+#endif // NAN_BOXING_OPT
+#define CLOX_CACHE_OPTIONS \
+  (_CACHE_OPT_DOT_INVOKE | _CACHE_OPT_SUPER_INVOKE | _CACHE_OPT_NAN_BOXING)
+
+typedef enum {
+  CONST_NUMBER,
+  CONST_STRING,
+  CONST_FUNCTION,
+  CONST_INT,
+} ConstantTag;
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint64_t options;
+  uint64_t source_hash;
+  uint64_t source_length;
+} CacheHeader;
+
+typedef struct {
+  const uint8_t* start;
+  const uint8_t* current;
+  const uint8_t* end;
+} CacheReader;
+
+// Images are either mmap'd files or malloc'd copies of
+// isolate messages carrying functions, see isolate.h.
+typedef struct CacheImage {
+  struct CacheImage* next;
+  void* base;
+  size_t size;
+  bool mapped;
+} CacheImage;
+
+uint64_t cache_source_hash(const char* source, size_t length) {
+  uint64_t hash = 14'695'981'039'346'656'037u;
+  for ( size_t idx = 0; idx < length; ++idx ) {
+    hash ^= (uint8_t)source[idx];
+    hash *= 1'099'511'628'211u;
+  }
+  return hash;
+}
+
+char* cache_path(const char* path) {
+  size_t length = strlen(path);
+  char* result = (char*)malloc(length + 2);
+  if ( result == NULL ) return NULL;
+  memcpy(result, path, length);
+  result[length] = CLOX_CACHE_SUFFIX;
+  result[length + 1] = '\0';
+  return result;
+}
+
+// ---- Writing ----
+
+// Images are assembled in memory, isolate.h reuses the
+// same writers to pass functions between VMs.
+typedef struct {
+  uint8_t* bytes;
+  size_t count;
+  size_t capacity;
+} ByteBuffer;
+
+void buffer_init(ByteBuffer* buffer) {
+  buffer->bytes = NULL;
+  buffer->count = 0;
+  buffer->capacity = 0;
+}
+
+void buffer_delete(ByteBuffer* buffer) {
+  free(buffer->bytes);
+  buffer_init(buffer);
+}
+
+void buffer_write(ByteBuffer* buffer, const void* data, size_t size) {
+  if ( buffer->capacity - buffer->count < size ) {
+    size_t capacity = buffer->capacity < 256 ? 256 : buffer->capacity * 2;
+    while ( capacity - buffer->count < size ) capacity *= 2;
+    buffer->bytes = (uint8_t*)realloc(buffer->bytes, capacity);
+    if ( buffer->bytes == NULL ) exit(80);
+    buffer->capacity = capacity;
+  }
+  memcpy(buffer->bytes + buffer->count, data, size);
+  buffer->count += size;
+}
+
+void cache_write_pad(ByteBuffer* buffer) {
+  static const uint8_t zeros[4] = { 0 };
+  if ( buffer->count % 4 ) buffer_write(buffer, zeros, 4 - buffer->count % 4);
+}
+
+void cache_write_i32(ByteBuffer* buffer, int32_t value) {
+  buffer_write(buffer, &value, sizeof(value));
+}
+
+void cache_write_tag(ByteBuffer* buffer, uint8_t tag) {
+  buffer_write(buffer, &tag, 1);
+}
+
+// False when a constant has no tag, the buffer is unusable then.
+bool cache_write_function(ByteBuffer* buffer, ObjectFunction* function) {
+  cache_write_i32(buffer, function->arity);
+  cache_write_i32(buffer, function->upvalue_count);
+  if ( function->name == NULL ) cache_write_i32(buffer, -1);
+  else {
+    cache_write_i32(buffer, function->name->length);
+    buffer_write(buffer, function->name->chars, function->name->length);
+    cache_write_pad(buffer);
+  }
+  Chunk* chunk = &function->chunk;
+  cache_write_i32(buffer, chunk->count);
+  buffer_write(buffer, chunk->lines, sizeof(int) * chunk->count);
+  buffer_write(buffer, chunk->code, chunk->count);
+  cache_write_pad(buffer);
+  cache_write_i32(buffer, chunk->constants.count);
+  for ( int i = 0; i < chunk->constants.count; ++i ) {
+    Value constant = chunk->constants.values[i];
+#ifdef NAN_BOXING_OPT
+    if ( IS_INT(constant) ) {
+      cache_write_tag(buffer, CONST_INT);
+      cache_write_i32(buffer, AS_INT(constant));
+      continue;
+    }
+#endif // NAN_BOXING_OPT
+    if ( IS_NUMBER(constant) ) {
+      double number = AS_NUMBER(constant);
+      cache_write_tag(buffer, CONST_NUMBER);
+      buffer_write(buffer, &number, sizeof(number));
+    } else if ( IS_STRING(constant) ) {
+      ObjectString* string = AS_STRING(constant);
+      cache_write_tag(buffer, CONST_STRING);
+      cache_write_i32(buffer, string->length);
+      buffer_write(buffer, string->chars, string->length);
+    } else if ( IS_FUNCTION(constant) ) {
+      cache_write_tag(buffer, CONST_FUNCTION);
+      cache_write_pad(buffer);
+      if ( !cache_write_function(buffer, AS_FUNCTION(constant)) ) return false;
+    } else return false;
+  }
+  return true;
+}
+
+// Best effort: a missing or read-only directory just means no cache,
+// so does a constant the image has no tag for.
+// The temporary name is unique per writer, isolates may store the
+// same script concurrently.
+void cache_store(const char* path, const char* source, size_t length,
+  ObjectFunction* function) {
+#ifndef CLOX_NO_CACHE
+  char* target = cache_path(path);
+  if ( target == NULL ) return;
+  ByteBuffer buffer;
+  buffer_init(&buffer);
+  size_t temp_length = strlen(target) + 48;
+  char* temp = (char*)malloc(temp_length);
+  if ( temp == NULL ) { free(target); return; }
+  snprintf(temp, temp_length, "%s.%d.%p.tmp", target, (int)getpid(), (void*)&buffer);
+  CacheHeader header;
+  memcpy(header.magic, CLOX_CACHE_MAGIC, 4);
+  header.version = CLOX_CACHE_VERSION;
+  header.options = CLOX_CACHE_OPTIONS;
+  header.source_length = length;
+  header.source_hash = cache_source_hash(source, length);
+  buffer_write(&buffer, &header, sizeof(header));
+  FILE* file = cache_write_function(&buffer, function) ? fopen(temp, "wb") : NULL;
+  if ( file != NULL ) {
+    bool failed = fwrite(buffer.bytes, 1, buffer.count, file) != buffer.count;
+    if ( fclose(file) || failed ) remove(temp);
+    else rename(temp, target);
+  }
+  buffer_delete(&buffer);
+  free(temp);
+  free(target);
+#endif // CLOX_NO_CACHE
+}
+
+// ---- Loading ----
+
+bool cache_read(CacheReader* reader, void* out, size_t size) {
+  if ( (size_t)(reader->end - reader->current) < size ) return false;
+  memcpy(out, reader->current, size);
+  reader->current += size;
+  return true;
+}
+
+bool cache_read_pad(CacheReader* reader) {
+  size_t offset = reader->current - reader->start;
+  if ( offset % 4 == 0 ) return true;
+  if ( (size_t)(reader->end - reader->current) < 4 - offset % 4 ) return false;
+  reader->current += 4 - offset % 4;
+  return true;
+}
+
+const uint8_t* cache_borrow(CacheReader* reader, size_t size) {
+  if ( (size_t)(reader->end - reader->current) < size ) return NULL;
+  const uint8_t* result = reader->current;
+  reader->current += size;
+  return result;
+}
+
+// The function being filled is kept on the vm stack so
+// allocations made while loading cannot collect it.
+ObjectFunction* cache_read_function(CacheReader* reader) {
+  int32_t arity, upvalue_count, name_length, count, constant_count;
+  const uint8_t* lines, * code;
+  if ( !cache_read(reader, &arity, sizeof(arity)) ||
+    !cache_read(reader, &upvalue_count, sizeof(upvalue_count)) ||
+    !cache_read(reader, &name_length, sizeof(name_length)) )
+    return NULL;
+  ObjectFunction* function = new_function();
+  stack_push(OBJECT_VAL(function));
+  function->arity = arity;
+  function->upvalue_count = upvalue_count;
+  if ( name_length >= 0 ) {
+    const uint8_t* name = cache_borrow(reader, name_length);
+    if ( name == NULL || !cache_read_pad(reader) ) goto failed;
+    function->name = copy_string((const char*)name, name_length);
+  }
+  if ( !cache_read(reader, &count, sizeof(count)) || count < 0 ) goto failed;
+  lines = cache_borrow(reader, sizeof(int) * (size_t)count);
+  code = cache_borrow(reader, (size_t)count);
+  if ( lines == NULL || code == NULL || !cache_read_pad(reader) ) goto failed;
+  // capacity stays 0: the chunk borrows from the image, see chunk_delete.
+  function->chunk.lines = (int*)lines;
+  function->chunk.code = (uint8_t*)code;
+  function->chunk.count = count;
+  if ( !cache_read(reader, &constant_count, sizeof(constant_count)) ) goto failed;
+  for ( int32_t i = 0; i < constant_count; ++i ) {
+    uint8_t tag;
+    if ( !cache_read(reader, &tag, 1) ) goto failed;
+    switch ( tag ) {
+    case CONST_INT: {
+      int32_t number;
+      if ( !cache_read(reader, &number, sizeof(number)) ) goto failed;
+#ifdef NAN_BOXING_OPT
+      chunk_cappend(&function->chunk, INT_VAL(number));
+#else
+      chunk_cappend(&function->chunk, NUMBER_VAL((double)number));
+#endif // NAN_BOXING_OPT
+      break;
+    }
+    case CONST_NUMBER: {
+      double number;
+      if ( !cache_read(reader, &number, sizeof(number)) ) goto failed;
+      chunk_cappend(&function->chunk, NUMBER_VAL(number));
+      break;
+    }
+    case CONST_STRING: {
+      int32_t length;
+      if ( !cache_read(reader, &length, sizeof(length)) || length < 0 ) goto failed;
+      const uint8_t* chars = cache_borrow(reader, length);
+      if ( chars == NULL ) goto failed;
+      chunk_cappend(&function->chunk,
+        OBJECT_VAL(copy_string((const char*)chars, length)));
+      break;
+    }
+    case CONST_FUNCTION: {
+      if ( !cache_read_pad(reader) ) goto failed;
+      ObjectFunction* inner = cache_read_function(reader);
+      if ( inner == NULL ) goto failed;
+      chunk_cappend(&function->chunk, OBJECT_VAL(inner));
+      break;
+    }
+    default: goto failed;
+    }
+  }
+  stack_pop();
+  return function;
+failed:
+  stack_pop();
+  return NULL;
+}
+
+void cache_image_adopt(CacheImage** images, void* base, size_t size, bool mapped) {
+  CacheImage* image = (CacheImage*)malloc(sizeof(CacheImage));
+  if ( image == NULL ) exit(80);
+  *image = (CacheImage){ *images, base, size, mapped };
+  *images = image;
+}
+
+// Successful loads are pushed on images, the mapping has to
+// outlive every chunk borrowing from it, see vm_delete.
+ObjectFunction* cache_load(CacheImage** images,
+  const char* path, const char* source, size_t length) {
+#ifdef CLOX_NO_CACHE
+  return NULL;
+#else
+  char* target = cache_path(path);
+  if ( target == NULL ) return NULL;
+  int fd = open(target, O_RDONLY);
+  free(target);
+  if ( fd < 0 ) return NULL;
+  struct stat info;
+  if ( fstat(fd, &info) || (size_t)info.st_size < sizeof(CacheHeader) ) {
+    close(fd);
+    return NULL;
+  }
+  void* base = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if ( base == MAP_FAILED ) return NULL;
+  CacheReader reader = { base, base, (const uint8_t*)base + info.st_size };
+  CacheHeader header;
+  cache_read(&reader, &header, sizeof(header));
+  ObjectFunction* function = NULL;
+  if ( !memcmp(header.magic, CLOX_CACHE_MAGIC, 4) &&
+    header.version == CLOX_CACHE_VERSION &&
+    header.options == CLOX_CACHE_OPTIONS &&
+    header.source_length == length &&
+    header.source_hash == cache_source_hash(source, length) )
+    function = cache_read_function(&reader);
+  if ( function == NULL ) {
+    munmap(base, info.st_size);
+    return NULL;
+  }
+  cache_image_adopt(images, base, info.st_size, true);
+  return function;
+#endif // CLOX_NO_CACHE
+}
+
+void cache_images_delete(CacheImage** images) {
+  CacheImage* image;
+  while ( *images != NULL ) {
+    image = *images;
+    *images = image->next;
+    if ( image->mapped ) munmap(image->base, image->size);
+    else free(image->base);
+    free(image);
+  }
+}
+
+CLOX_END_DECLS
+
+#endif //_CLOX_CACHE_H
@@ -8,6 +8,9 @@
 CLOX_BEG_DECLS
 
 typedef enum {
+  OP_GET_METHOD_LOCAL,
+  OP_SET_METHOD_LOCAL,
+  OP_METHOD_CALLEE,
   OP_CLOSE_UPVALUE,
   OP_JUMP_IF_FALSE,
   OP_DEFINE_GLOBAL,
@@ -16,12 +19,18 @@ typedef enum {
   OP_GET_PROPERTY,
   OP_SET_UPVALUE,
   OP_GET_UPVALUE,
+  OP_CALL_METHOD,
   OP_SET_GLOBAL,
   OP_GET_GLOBAL,
+  OP_GET_METHOD,
+  OP_BUILD_LIST,
   OP_GET_SUPER,
   OP_GET_LOCAL,
   OP_SET_LOCAL,
+  OP_GET_INDEX,
+  OP_SET_INDEX,
   OP_CONSTANT,
+  OP_FOR_ITER,
   OP_SUBTRACT,
   OP_MULTIPLY,
   OP_INHERIT,
@@ -51,6 +60,9 @@ typedef enum {
 
 const char* inst_print(uint8_t byte) {
   switch ( byte ) {
+    INSTCS(_GET_METHOD_LOCAL);
+    INSTCS(_SET_METHOD_LOCAL);
+    INSTCS(_METHOD_CALLEE);
     INSTCS(_CLOSE_UPVALUE);
     INSTCS(_JUMP_IF_FALSE);
     INSTCS(_DEFINE_GLOBAL);
@@ -59,12 +71,18 @@ const char* inst_print(uint8_t byte) {
     INSTCS(_GET_PROPERTY);
     INSTCS(_SET_UPVALUE);
     INSTCS(_GET_UPVALUE);
+    INSTCS(_CALL_METHOD);
     INSTCS(_SET_GLOBAL);
     INSTCS(_GET_GLOBAL);
+    INSTCS(_GET_METHOD);
+    INSTCS(_BUILD_LIST);
     INSTCS(_GET_SUPER);
     INSTCS(_GET_LOCAL);
     INSTCS(_SET_LOCAL);
+    INSTCS(_GET_INDEX);
+    INSTCS(_SET_INDEX);
     INSTCS(_CONSTANT);
+    INSTCS(_FOR_ITER);
     INSTCS(_SUBTRACT);
     INSTCS(_MULTIPLY);
     INSTCS(_INHERIT);
@@ -123,8 +141,12 @@ void chunk_append(Chunk* chunk, uint8_t byte, int line) {
 }
 
 void chunk_delete(Chunk* chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  // Chunks loaded from a .loxc image borrow code and
+  // lines from the mapping and have no capacity.
+  if ( chunk->capacity ) {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  }
   value_delete(&chunk->constants);
 }
 
@@ -1,6 +1,12 @@
 #ifndef _CLOX_COMMON_H
 #define _CLOX_COMMON_H
 
+// POSIX clocks (clock_gettime), the build is strict C otherwise.
+// Only effective when lox headers come before system ones.
+#ifndef _POSIX_C_SOURCE
+# define _POSIX_C_SOURCE 200809L
+#endif // _POSIX_C_SOURCE
+
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,13 +35,19 @@
 # define GC_NEXT_INIT 1024 * 5
 #endif // GC_NEXT_INIT
 
-#ifdef CLOX_ALL_OPT
+// Method calls compile to OP_INVOKE and OP_SUPER_INVOKE, which bind
+// no method object, neither do calls through a local holding a method
+// (see method_local). CLOX_NO_INVOKE keeps the get and call.
+#ifndef CLOX_NO_INVOKE
 # ifndef SUPER_INVOKE_OPT
 #  define SUPER_INVOKE_OPT
 # endif // SUPER_INVOKE_OPT
 # ifndef DOT_INVOKE_OPT
 #  define DOT_INVOKE_OPT
 # endif // DOT_INVOKE_OPT
+#endif // CLOX_NO_INVOKE
+
+#ifdef CLOX_ALL_OPT
 # ifndef TABLE_AND_FOLD_OPT
 #  define TABLE_AND_FOLD_OPT
 # endif // TABLE_AND_FOLD_OPT
@@ -47,8 +59,7 @@
 // #define CLOX_GC_STRESS
 // #define NAN_BOXING_OPT
 // #define TABLE_AND_FOLD_OPT
-// #define DOT_INVOKE_OPT
-// #define SUPER_INVOKE_OPT
+// #define CLOX_NO_INVOKE
 // #define CLOX_ALL_OPT
 // #define CLOX_GC_LOG
 // #define CLOX_NOGC
@@ -59,5 +70,9 @@
 // #define CLOX_SCAN_TRACE
 // #define CLOX_ODEL_TRACE
 // #define CLOX_DRY_RUN
+// #define CLOX_NO_CACHE
+// #define CLOX_NO_SIMD
+// #define CLOX_OP_STATS
+// #define CLOX_ALLOC_STATS
 
 #endif //_CLOX_COMMON_H
@@ -5,6 +5,7 @@
 #include "scanner.h"
 #include "chunk.h"
 #include "object.h"
+#include "arena.h"
 
 CLOX_BEG_DECLS
 
@@ -18,7 +19,7 @@ typedef enum {
   PREC_TERM,       // + -
   PREC_FACTOR,     // * /
   PREC_UNARY,      // - !
-  PREC_CALL,       // . ()
+  PREC_CALL,       // . () []
   PREC_PRIMARY
 } Precedence;
 
@@ -41,6 +42,7 @@ typedef struct {
   Token name;
   int depth;
   bool is_captured;
+  bool method; // The slot below holds a receiver, see method_local.
 } Local;
 
 typedef enum {
@@ -57,14 +59,21 @@ typedef struct {
 
 typedef struct Compiler Compiler;
 
+// locals, upvalues and the function's code, lines and constants
+// live in compile_arena until compiler_delete moves the chunk
+// into exactly sized heap arrays.
 struct Compiler {
   Compiler* enclosing;
   ObjectFunction* function;
   FunctionType type;
-  Local locals[UINT8_COUNT];
+  Local* locals;
+  int local_capacity;
   int local_count;
   int scope_depth;
-  Upvalue upvalues[UINT8_COUNT];
+  Upvalue* upvalues;
+  int upvalue_capacity;
+  int property_end; // Code count right after the last OP_GET_PROPERTY.
+  int method_sets; // Assignments to method locals compiled so far.
 };
 
 typedef struct ClassCompiler {
@@ -73,14 +82,24 @@ typedef struct ClassCompiler {
   bool has_superclass;
 } ClassCompiler;
 
-Parser parser;
-Compiler* current = NULL;
-ClassCompiler* current_class = NULL;
+// Per thread like the scanner, see scanner.h.
+_Thread_local Parser parser;
+_Thread_local Compiler* current = NULL;
+_Thread_local ClassCompiler* current_class = NULL;
+_Thread_local Arena compile_arena;
+
+void add_local(Token);
 
 void comp_init(Compiler* comp, FunctionType type) {
   comp->function = new_function();
+  comp->locals = NULL;
+  comp->local_capacity = 0;
   comp->local_count = 0;
+  comp->upvalues = NULL;
+  comp->upvalue_capacity = 0;
   comp->scope_depth = 0;
+  comp->property_end = -1;
+  comp->method_sets = 0;
   comp->type = type;
   comp->enclosing = current;
   current = comp;
@@ -88,19 +107,14 @@ void comp_init(Compiler* comp, FunctionType type) {
     current->function->name = copy_string(
       parser.previous.start, parser.previous.length
     );
-  Local* local = &current->locals[current->local_count++];
-  local->is_captured = false;
-  local->depth = 0;
-  if ( type == TYPE_FUNCTION ) {
-    local->name.start = "";
-    local->name.length = 0;
-  } else {
-    local->name.start = "this";
-    local->name.length = 4;
-  }
+  Token name = { .start = "this", .length = 4 };
+  if ( type == TYPE_FUNCTION ) name = (Token){ .start = "", .length = 0 };
+  add_local(name);
+  current->locals[0].depth = 0;
 }
 
 void stmt_var();
+void var_initializer(uint8_t);
 void expr_or(bool);
 void literal(bool);
 void expression();
@@ -108,6 +122,8 @@ void expr_dot(bool);
 void expr_and(bool);
 void patch_jump(int);
 void expr_call(bool);
+void expr_list(bool);
+void expr_index(bool);
 void compiler_sync();
 void expr_unary(bool);
 void stmt_statement();
@@ -129,6 +145,7 @@ bool compiler_check(TokenType);
 bool compiler_match(TokenType);
 void named_variable(Token, bool);
 void emit_bytes(uint8_t, uint8_t);
+Chunk* current_chunk();
 ObjectFunction* compiler_delete();
 Token synthetic_token(const char*);
 uint8_t identifier_constant(Token*);
@@ -142,6 +159,8 @@ ParserRule tkprec_rules[] = {
   TKPREC_RULE(_RIGHT_PAREN,      NULL,               NULL,           _NONE),
   TKPREC_RULE(_LEFT_BRACE,       NULL,               NULL,           _NONE),
   TKPREC_RULE(_RIGHT_BRACE,      NULL,               NULL,           _NONE),
+  TKPREC_RULE(_LEFT_BRACKET,     expr_list,          expr_index,     _CALL),
+  TKPREC_RULE(_RIGHT_BRACKET,    NULL,               NULL,           _NONE),
   TKPREC_RULE(_COMMA,            NULL,               NULL,           _NONE),
   TKPREC_RULE(_DOT,              NULL,               expr_dot,       _CALL),
   TKPREC_RULE(_MINUS,            expr_unary,         expr_binary,    _TERM),
@@ -220,6 +239,7 @@ void expr_and(bool) {
   emit_byte(OP_POP);
   parse_precedence(PREC_AND);
   patch_jump(jump_end);
+  current->property_end = -1; // Not all paths end with the property.
 }
 
 void expr_or(bool) {
@@ -229,6 +249,7 @@ void expr_or(bool) {
   emit_byte(OP_POP);
   parse_precedence(PREC_OR);
   patch_jump(jump_end);
+  current->property_end = -1;
 }
 
 void expr_dot(bool can_assign) {
@@ -245,7 +266,10 @@ void expr_dot(bool can_assign) {
     emit_byte(arg_count);
   }
 #endif // DOT_INVOKE_OPT
-  else emit_bytes(OP_GET_PROPERTY, property);
+  else {
+    emit_bytes(OP_GET_PROPERTY, property);
+    current->property_end = current_chunk()->count;
+  }
 }
 
 void expr_super(bool can_assign) {
@@ -316,7 +340,16 @@ void compiler_consume(TokenType type, const char* message) {
 Chunk* current_chunk() { return &current->function->chunk; }
 
 void emit_byte(uint8_t byte) {
-  chunk_append(current_chunk(), byte, parser.previous.line);
+  Chunk* chunk = current_chunk();
+  if ( chunk->capacity < chunk->count + 1 ) {
+    int capacity = GROW_CAPACITY(chunk->capacity);
+    chunk->code = ARENA_GROW_ARRAY(&compile_arena, uint8_t, chunk->code, chunk->capacity, capacity);
+    chunk->lines = ARENA_GROW_ARRAY(&compile_arena, int, chunk->lines, chunk->capacity, capacity);
+    chunk->capacity = capacity;
+  }
+  chunk->lines[chunk->count] = parser.previous.line;
+  chunk->code[chunk->count] = byte;
+  chunk->count++;
 }
 
 void emit_bytes(uint8_t b1, uint8_t b2) {
@@ -331,7 +364,14 @@ void emit_return() {
 }
 
 uint8_t make_constant(Value constant) {
-  int location = chunk_cappend(current_chunk(), constant);
+  ValueArray* constants = &current_chunk()->constants;
+  if ( constants->capacity < constants->count + 1 ) {
+    int capacity = GROW_CAPACITY(constants->capacity);
+    constants->values = ARENA_GROW_ARRAY(&compile_arena, Value, constants->values, constants->capacity, capacity);
+    constants->capacity = capacity;
+  }
+  int location = constants->count;
+  constants->values[constants->count++] = constant;
   if ( location <= UINT8_MAX ) return (uint8_t)location;
   error("Too many constants in one chunk.");
   return 0;
@@ -356,8 +396,27 @@ void literal(bool) {
   }
 }
 
+// Sources need not be terminated (mapped files, stream chunks), the
+// token is copied before strtod reads it.
+double number_token(Token* token) {
+  char local[64];
+  char* digits = token->length < (int)sizeof(local) ? local : (char*)malloc(token->length + 1);
+  if ( digits == NULL ) exit(80);
+  memcpy(digits, token->start, token->length);
+  digits[token->length] = '\0';
+  double number = strtod(digits, NULL);
+  if ( digits != local ) free(digits);
+  return number;
+}
+
 void expr_number(bool) {
-  double constant = strtod(parser.previous.start, NULL);
+  double constant = number_token(&parser.previous);
+#ifdef NAN_BOXING_OPT
+  if ( is_int_number(constant) ) {
+    emit_constant(INT_VAL(constant));
+    return;
+  }
+#endif // NAN_BOXING_OPT
   emit_constant(NUMBER_VAL(constant));
 }
 
@@ -389,6 +448,11 @@ int add_upvalue(Compiler* compiler, uint8_t index, bool is_local) {
     error("Too many closure variables in function.");
     return 0;
   }
+  if ( compiler->upvalue_capacity < upvalue_count + 1 ) {
+    int capacity = GROW_CAPACITY(compiler->upvalue_capacity);
+    compiler->upvalues = ARENA_GROW_ARRAY(&compile_arena, Upvalue, compiler->upvalues, compiler->upvalue_capacity, capacity);
+    compiler->upvalue_capacity = capacity;
+  }
   compiler->upvalues[upvalue_count].is_local = is_local;
   compiler->upvalues[upvalue_count].index = index;
   return compiler->function->upvalue_count++;
@@ -404,6 +468,31 @@ int resolve_upvalue(Compiler* compiler, Token* name) {
   return -1;
 }
 
+#ifdef DOT_INVOKE_OPT
+// Calls through a method local put its receiver in the callee slot
+// and call the method unbound. Reading it as a value binds it once,
+// the bound method stays in its slot.
+void method_variable(uint8_t slot, bool can_assign) {
+  if ( can_assign && compiler_match(TOKEN_EQUAL) ) {
+    expression();
+    emit_bytes(OP_SET_METHOD_LOCAL, slot);
+    ++current->method_sets;
+  } else if ( compiler_match(TOKEN_LEFT_PAREN) ) {
+    int callee = current_chunk()->count, sets = current->method_sets;
+    emit_bytes(OP_METHOD_CALLEE, slot);
+    uint8_t arg_count = argument_list();
+    if ( sets == current->method_sets ) {
+      emit_bytes(OP_CALL_METHOD, slot);
+      emit_byte(arg_count);
+    } else {
+      // The arguments assign the local, the callee is bound before them.
+      current_chunk()->code[callee] = OP_GET_METHOD_LOCAL;
+      emit_bytes(OP_CALL, arg_count);
+    }
+  } else emit_bytes(OP_GET_METHOD_LOCAL, slot);
+}
+#endif // DOT_INVOKE_OPT
+
 void named_variable(Token name, bool can_assign) {
   // printf("Find: ");
   // token_print(&name);
@@ -412,6 +501,12 @@ void named_variable(Token name, bool can_assign) {
   uint8_t set_op, get_op;
   if ( (arg = resolve_local(current, &name)) != -1 ) {
     // printf("LOCAL\n");
+#ifdef DOT_INVOKE_OPT
+    if ( current->locals[arg].method ) {
+      method_variable((uint8_t)arg, can_assign);
+      return;
+    }
+#endif // DOT_INVOKE_OPT
     set_op = OP_SET_LOCAL;
     get_op = OP_GET_LOCAL;
   } else if ( (arg = resolve_upvalue(current, &name)) != -1 ) {
@@ -449,6 +544,25 @@ void expr_call(bool can_assign) {
   emit_bytes(OP_CALL, arg_count);
 }
 
+void expr_list(bool) {
+  uint8_t item_count = 0;
+  if ( !compiler_check(TOKEN_RIGHT_BRACKET) ) do {
+    expression(); if ( item_count++ == 255 )
+      error("Can't have more than 255 items in a list literal.");
+  } while ( compiler_match(TOKEN_COMMA) );
+  compiler_consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list items.");
+  emit_bytes(OP_BUILD_LIST, item_count);
+}
+
+void expr_index(bool can_assign) {
+  expression();
+  compiler_consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+  if ( can_assign && compiler_match(TOKEN_EQUAL) ) {
+    expression();
+    emit_byte(OP_SET_INDEX);
+  } else emit_byte(OP_GET_INDEX);
+}
+
 void expr_grouping(bool) {
   expression();
   compiler_consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
@@ -511,8 +625,14 @@ void add_local(Token name) {
     error("Too many local variables in scope.");
     return;
   }
+  if ( current->local_capacity < current->local_count + 1 ) {
+    int capacity = GROW_CAPACITY(current->local_capacity);
+    current->locals = ARENA_GROW_ARRAY(&compile_arena, Local, current->locals, current->local_capacity, capacity);
+    current->local_capacity = capacity;
+  }
   Local* local = current->locals + (current->local_count++);
   local->is_captured = false;
+  local->method = false;
   local->name = name;
   local->depth = -1;
 }
@@ -649,12 +769,50 @@ void stmt_while() {
   emit_byte(OP_POP);
 }
 
+// for (var name in list) body, the list and the next index live
+// in hidden locals OP_FOR_ITER advances. `in` is only special here.
+bool compiler_check_in() {
+  return compiler_check(TOKEN_IDENTIFIER) && parser.current.length == 2
+    && !memcmp(parser.current.start, "in", 2);
+}
+
+void stmt_for_in(Token name) {
+  compiler_advance();
+  expression();
+  compiler_consume(TOKEN_RIGHT_PAREN, "Expect ')' after for-in list.");
+  uint8_t slot = (uint8_t)current->local_count;
+  add_local(synthetic_token("for list"));
+  mark_initialized();
+  emit_constant(int_value(0));
+  add_local(synthetic_token("for index"));
+  mark_initialized();
+  int loop_start = current_chunk()->count;
+  emit_bytes(OP_FOR_ITER, slot);
+  emit_bytes(0xff, 0xff);
+  int jump_exit = current_chunk()->count - 2;
+  scope_begin();
+  add_local(name);
+  mark_initialized();
+  stmt_statement();
+  scope_end();
+  emit_loop(loop_start);
+  patch_jump(jump_exit);
+}
+
 void stmt_for() {
   scope_begin();
   compiler_consume(TOKEN_LEFT_PAREN, "Expect '(' after keyword for.");
   if ( compiler_match(TOKEN_SEMICOLON) );
-  else if ( compiler_match(TOKEN_VAR) ) stmt_var();
-  else stmt_expression();
+  else if ( compiler_match(TOKEN_VAR) ) {
+    compiler_consume(TOKEN_IDENTIFIER, "Expect variable name.");
+    if ( compiler_check_in() ) {
+      stmt_for_in(parser.previous);
+      scope_end();
+      return;
+    }
+    declare_variable();
+    var_initializer(0);
+  } else stmt_expression();
   int loop_start = current_chunk()->count;
   int jump_exit = -1;
   if ( !compiler_match(TOKEN_SEMICOLON) ) {
@@ -706,14 +864,39 @@ void stmt_statement() {
   else                                         stmt_expression();
 }
 
-void stmt_var() {
-  uint8_t global = parse_variable("Expect variable name.");
-  if ( compiler_match(TOKEN_EQUAL) ) expression();
-  else emit_byte(OP_NIL);
+#ifdef DOT_INVOKE_OPT
+// var m = x.name; in a scope keeps x in a hidden local below m and
+// leaves the method in m unbound, see method_variable. A field is
+// stored in m as usual, with nil below it.
+void method_local() {
+  current_chunk()->code[current->property_end - 2] = OP_GET_METHOD;
+  Local* local = current->locals + current->local_count - 1;
+  Token name = local->name;
+  local->name = synthetic_token("method receiver");
+  local->depth = current->scope_depth;
+  add_local(name);
+  current->locals[current->local_count - 1].method = true;
+}
+#endif // DOT_INVOKE_OPT
+
+void var_initializer(uint8_t global) {
+  if ( compiler_match(TOKEN_EQUAL) ) {
+    int start = current_chunk()->count;
+    expression();
+#ifdef DOT_INVOKE_OPT
+    if ( current->scope_depth > 0 && current->property_end > start
+      && current->property_end == current_chunk()->count )
+      method_local();
+#endif // DOT_INVOKE_OPT
+  } else emit_byte(OP_NIL);
   consume_eos();
   define_variable(global);
 }
 
+void stmt_var() {
+  var_initializer(parse_variable("Expect variable name."));
+}
+
 void consume_function(FunctionType type) {
   Compiler compiler;
   comp_init(&compiler, type);
@@ -736,6 +919,18 @@ void consume_function(FunctionType type) {
   scope_end();
 
   ObjectFunction* function = compiler_delete();
+#ifdef DOT_INVOKE_OPT
+  // Closures see method locals as plain values, they are bound for
+  // good before the capture. The local stays a method local, the
+  // capture may sit on a path that does not run.
+  for ( int i = 0; i < function->upvalue_count; ++i ) {
+    uint8_t index = compiler.upvalues[i].index;
+    if ( !compiler.upvalues[i].is_local || !current->locals[index].method ) continue;
+    emit_bytes(OP_GET_METHOD_LOCAL, index);
+    emit_bytes(OP_SET_METHOD_LOCAL, index);
+    emit_byte(OP_POP);
+  }
+#endif // DOT_INVOKE_OPT
   emit_bytes(OP_CLOSURE, make_constant(OBJECT_VAL(function)));
   for ( int i = 0; i < function->upvalue_count; ++i )
     emit_bytes(compiler.upvalues[i].is_local ? 1 : 0, compiler.upvalues[i].index);
@@ -814,27 +1009,66 @@ void compiler_init() {
   parser.had_error = false;
 }
 
+// Moves an arena backed chunk into exactly sized heap arrays.
+void chunk_seal(Chunk* chunk) {
+  uint8_t* code = ALLOCATE(uint8_t, chunk->count);
+  int* lines = ALLOCATE(int, chunk->count);
+  memcpy(code, chunk->code, chunk->count);
+  memcpy(lines, chunk->lines, sizeof(int) * chunk->count);
+  chunk->code = code;
+  chunk->lines = lines;
+  chunk->capacity = chunk->count;
+  ValueArray* constants = &chunk->constants;
+  Value* values = ALLOCATE(Value, constants->count);
+  if ( constants->count )
+    memcpy(values, constants->values, sizeof(Value) * constants->count);
+  constants->values = values;
+  constants->capacity = constants->count;
+}
+
 ObjectFunction* compiler_delete() {
   emit_return();
   ObjectFunction* function = current->function;
+  chunk_seal(&function->chunk);
   current = current->enclosing;
   return function;
 }
 
-ObjectFunction* compile(const char* source) {
+// Compiles whatever the scanner was initialized with. The GC is
+// paused throughout, half built chunks point into compile_arena.
+ObjectFunction* compile_scanner() {
   // puts("----------------- 'COMPILER_START' ---------------");
   Compiler compiler;
+  gc_pause();
+  arena_init(&compile_arena);
   compiler_init();
   comp_init(&compiler, TYPE_SCRIPT);
-  scanner_init(source);
   compiler_advance();
   while ( !compiler_match(TOKEN_EOF) ) stmt_declaration();
   compiler_consume(TOKEN_EOF, "Expect end of expression.");
   ObjectFunction* function = compiler_delete();
+  scanner_delete();
+  arena_delete(&compile_arena);
+  gc_resume();
   // puts("----------------- 'COMPILER_END' -----------------");
   return parser.had_error ? NULL : function;
 }
 
+ObjectFunction* compile(const char* source) {
+  scanner_init(source);
+  return compile_scanner();
+}
+
+ObjectFunction* compile_buffer(const char* source, size_t length) {
+  scanner_init_buffer(source, length);
+  return compile_scanner();
+}
+
+ObjectFunction* compile_stream(int stream) {
+  scanner_init_stream(stream);
+  return compile_scanner();
+}
+
 void gc_mark_object(Object*);
 
 void gc_mark_compiler_roots() {
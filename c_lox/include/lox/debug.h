@@ -11,7 +11,9 @@ int byte_instruction(Chunk*, int);
 int simple_instruction(Chunk*, int);
 int constant_instruction(Chunk*, int);
 int invoke_instruction(Chunk*, int);
+int call_method_instruction(Chunk*, int);
 int jump_instruction(Chunk*, int, int);
+int for_iter_instruction(Chunk*, int);
 int disassemble_instruction(Chunk*, int);
 void disassemble_chunk(Chunk*, const char*);
 
@@ -34,6 +36,14 @@ int disassemble_instruction(Chunk* chunk, int offset) {
   case OP_GET_LOCAL:     return byte_instruction(chunk, offset);
   case OP_SET_UPVALUE:   return byte_instruction(chunk, offset);
   case OP_GET_UPVALUE:   return byte_instruction(chunk, offset);
+  case OP_BUILD_LIST:    return byte_instruction(chunk, offset);
+  case OP_METHOD_CALLEE: return byte_instruction(chunk, offset);
+  case OP_CALL_METHOD:   return call_method_instruction(chunk, offset);
+  case OP_GET_METHOD_LOCAL: return byte_instruction(chunk, offset);
+  case OP_SET_METHOD_LOCAL: return byte_instruction(chunk, offset);
+  case OP_FOR_ITER:      return for_iter_instruction(chunk, offset);
+  case OP_GET_INDEX:     return simple_instruction(chunk, offset);
+  case OP_SET_INDEX:     return simple_instruction(chunk, offset);
   case OP_ADD:           return simple_instruction(chunk, offset);
   case OP_NIL:           return simple_instruction(chunk, offset);
   case OP_NOT:           return simple_instruction(chunk, offset);
@@ -64,6 +74,7 @@ int disassemble_instruction(Chunk* chunk, int offset) {
   case OP_GET_GLOBAL:    return constant_instruction(chunk, offset);
   case OP_SET_PROPERTY:  return constant_instruction(chunk, offset);
   case OP_GET_PROPERTY:  return constant_instruction(chunk, offset);
+  case OP_GET_METHOD:    return constant_instruction(chunk, offset);
   case OP_DEFINE_GLOBAL: return constant_instruction(chunk, offset);
   case OP_CLOSURE: {
     uint8_t constant = chunk->code[++offset];
@@ -111,6 +122,15 @@ int jump_instruction(Chunk* chunk, int sign, int offset) {
   return offset + 3;
 }
 
+// Slot of the hidden list local, then a jump out of the loop.
+int for_iter_instruction(Chunk* chunk, int offset) {
+  const char* name = inst_print(chunk->code[offset]);
+  uint8_t slot = chunk->code[offset + 1];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8) | (chunk->code[offset + 3]);
+  printf("%-16s %4d -> %d\n", name, slot, offset + 4 + jump);
+  return offset + 4;
+}
+
 int invoke_instruction(Chunk* chunk, int offset) {
   const char* name = inst_print(chunk->code[offset]);
   uint8_t constant = chunk->code[++offset];
@@ -121,6 +141,15 @@ int invoke_instruction(Chunk* chunk, int offset) {
   return ++offset;
 }
 
+// Slot of the method local, then the argument count.
+int call_method_instruction(Chunk* chunk, int offset) {
+  const char* name = inst_print(chunk->code[offset]);
+  uint8_t slot = chunk->code[++offset];
+  uint8_t arg_count = chunk->code[++offset];
+  printf("%-16s %4d (%d args)\n", name, slot, arg_count);
+  return ++offset;
+}
+
 CLOX_END_DECLS
 
 #endif //_CLOX_DEBUG_H
@@ -0,0 +1,186 @@
+#ifndef _CLOX_DTOA_H
+#define _CLOX_DTOA_H
+
+#include "common.h"
+
+CLOX_BEG_DECLS
+
+// Shortest digits reading back as the same double, see number_format.
+// Grisu3 (Loitsch, "Printing Floating-Point Numbers Quickly and
+// Accurately with Integers", 2010) finds them with 64-bit integer
+// arithmetic for all but about 0.5% of doubles. It knows when it
+// cannot be sure, those go through snprintf and strtod instead.
+
+// f * 2^e
+typedef struct {
+  uint64_t f;
+  int e;
+} DiyFp;
+
+DiyFp diy_fp_multiply(DiyFp x, DiyFp y) {
+  uint64_t a = x.f >> 32, b = x.f & 0xffffffffu, c = y.f >> 32, d = y.f & 0xffffffffu;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  // Rounded, the lower half is dropped.
+  uint64_t middle = (bd >> 32) + (ad & 0xffffffffu) + (bc & 0xffffffffu) + (1u << 31);
+  return (DiyFp){ ac + (ad >> 32) + (bc >> 32) + (middle >> 32), x.e + y.e + 64 };
+}
+
+DiyFp diy_fp_normalize(DiyFp x) {
+  int shift = __builtin_clzll(x.f);
+  return (DiyFp){ x.f << shift, x.e - shift };
+}
+
+// 10^-348, 10^-340, ..., 10^340 rounded to 64 bits.
+#define DTOA_POWERS 87
+const uint64_t dtoa_powers_f[DTOA_POWERS] = {
+  0xfa8fd5a0081c0288u, 0xbaaee17fa23ebf76u, 0x8b16fb203055ac76u, 0xcf42894a5dce35eau,
+  0x9a6bb0aa55653b2du, 0xe61acf033d1a45dfu, 0xab70fe17c79ac6cau, 0xff77b1fcbebcdc4fu,
+  0xbe5691ef416bd60cu, 0x8dd01fad907ffc3cu, 0xd3515c2831559a83u, 0x9d71ac8fada6c9b5u,
+  0xea9c227723ee8bcbu, 0xaecc49914078536du, 0x823c12795db6ce57u, 0xc21094364dfb5637u,
+  0x9096ea6f3848984fu, 0xd77485cb25823ac7u, 0xa086cfcd97bf97f4u, 0xef340a98172aace5u,
+  0xb23867fb2a35b28eu, 0x84c8d4dfd2c63f3bu, 0xc5dd44271ad3cdbau, 0x936b9fcebb25c996u,
+  0xdbac6c247d62a584u, 0xa3ab66580d5fdaf6u, 0xf3e2f893dec3f126u, 0xb5b5ada8aaff80b8u,
+  0x87625f056c7c4a8bu, 0xc9bcff6034c13053u, 0x964e858c91ba2655u, 0xdff9772470297ebdu,
+  0xa6dfbd9fb8e5b88fu, 0xf8a95fcf88747d94u, 0xb94470938fa89bcfu, 0x8a08f0f8bf0f156bu,
+  0xcdb02555653131b6u, 0x993fe2c6d07b7facu, 0xe45c10c42a2b3b06u, 0xaa242499697392d3u,
+  0xfd87b5f28300ca0eu, 0xbce5086492111aebu, 0x8cbccc096f5088ccu, 0xd1b71758e219652cu,
+  0x9c40000000000000u, 0xe8d4a51000000000u, 0xad78ebc5ac620000u, 0x813f3978f8940984u,
+  0xc097ce7bc90715b3u, 0x8f7e32ce7bea5c70u, 0xd5d238a4abe98068u, 0x9f4f2726179a2245u,
+  0xed63a231d4c4fb27u, 0xb0de65388cc8ada8u, 0x83c7088e1aab65dbu, 0xc45d1df942711d9au,
+  0x924d692ca61be758u, 0xda01ee641a708deau, 0xa26da3999aef774au, 0xf209787bb47d6b85u,
+  0xb454e4a179dd1877u, 0x865b86925b9bc5c2u, 0xc83553c5c8965d3du, 0x952ab45cfa97a0b3u,
+  0xde469fbd99a05fe3u, 0xa59bc234db398c25u, 0xf6c69a72a3989f5cu, 0xb7dcbf5354e9beceu,
+  0x88fcf317f22241e2u, 0xcc20ce9bd35c78a5u, 0x98165af37b2153dfu, 0xe2a0b5dc971f303au,
+  0xa8d9d1535ce3b396u, 0xfb9b7cd9a4a7443cu, 0xbb764c4ca7a44410u, 0x8bab8eefb6409c1au,
+  0xd01fef10a657842cu, 0x9b10a4e5e9913129u, 0xe7109bfba19c0c9du, 0xac2820d9623bf429u,
+  0x80444b5e7aa7cf85u, 0xbf21e44003acdd2du, 0x8e679c2f5e44ff8fu, 0xd433179d9c8cb841u,
+  0x9e19db92b4e31ba9u, 0xeb96bf6ebadf77d9u, 0xaf87023b9bf0ee6bu
+};
+const int16_t dtoa_powers_e[DTOA_POWERS] = {
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+  -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+  -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+  -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+  56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+  375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+  694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+  1013, 1039, 1066
+};
+
+// The cached 10^k, k is returned, taking the binary exponent e of a
+// normalized DiyFp to between -60 and -32: the integral part of the
+// product fits 32 bits and ten times the fraction does not overflow.
+int dtoa_cached_power(int e, DiyFp* power) {
+  double estimate = (-60 - e - 1) * 0.30102999566398114;
+  int k = (int)estimate;
+  if ( k < estimate ) ++k;
+  int index = (348 + k - 1) / 8 + 1;
+  *power = (DiyFp){ dtoa_powers_f[index], dtoa_powers_e[index] };
+  return -348 + 8 * index;
+}
+
+// Moves the last digit towards w while that stays inside the safe
+// interval, false when the closest digits cannot be told apart.
+bool dtoa_round_weed(char* digits, int length, uint64_t distance_too_high_w,
+  uint64_t unsafe_interval, uint64_t rest, uint64_t ten_kappa, uint64_t unit) {
+  uint64_t small_distance = distance_too_high_w - unit;
+  uint64_t big_distance = distance_too_high_w + unit;
+  while ( rest < small_distance && unsafe_interval - rest >= ten_kappa &&
+    (rest + ten_kappa < small_distance ||
+      small_distance - rest >= rest + ten_kappa - small_distance) ) {
+    --digits[length - 1];
+    rest += ten_kappa;
+  }
+  if ( rest < big_distance && unsafe_interval - rest >= ten_kappa &&
+    (rest + ten_kappa < big_distance ||
+      big_distance - rest > rest + ten_kappa - big_distance) )
+    return false;
+  return 2 * unit <= rest && rest <= unsafe_interval - 4 * unit;
+}
+
+// Digits of the shortest number between low and high, scaled
+// boundaries of w. They are worth 10^kappa each.
+bool dtoa_digit_gen(DiyFp low, DiyFp w, DiyFp high, char* digits, int* length, int* kappa) {
+  static const uint32_t tens[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+  };
+  uint64_t unit = 1;
+  // Multiplying may be off by one unit either way.
+  DiyFp too_low = { low.f - unit, low.e }, too_high = { high.f + unit, high.e };
+  uint64_t unsafe_interval = too_high.f - too_low.f;
+  int shift = -w.e;
+  uint64_t one = (uint64_t)1 << shift;
+  uint32_t integrals = (uint32_t)(too_high.f >> shift);
+  uint64_t fractionals = too_high.f & (one - 1);
+  int count = 0;
+  while ( count < 9 && tens[count + 1] <= integrals ) ++count;
+  uint32_t divisor = tens[count];
+  *kappa = count + 1;
+  *length = 0;
+  while ( *kappa > 0 ) {
+    digits[(*length)++] = (char)('0' + integrals / divisor);
+    integrals %= divisor;
+    --*kappa;
+    uint64_t rest = ((uint64_t)integrals << shift) + fractionals;
+    if ( rest < unsafe_interval )
+      return dtoa_round_weed(digits, *length, too_high.f - w.f, unsafe_interval,
+        rest, (uint64_t)divisor << shift, unit);
+    divisor /= 10;
+  }
+  for ( ;;) {
+    fractionals *= 10;
+    unit *= 10;
+    unsafe_interval *= 10;
+    digits[(*length)++] = (char)('0' + (fractionals >> shift));
+    fractionals &= one - 1;
+    --*kappa;
+    if ( fractionals < unsafe_interval )
+      return dtoa_round_weed(digits, *length, (too_high.f - w.f) * unit,
+        unsafe_interval, fractionals, one, unit);
+  }
+}
+
+// number = digits * 10^exponent for a positive finite number, at most
+// 17 digits. False when Grisu3 gives up.
+bool dtoa_grisu3(double number, char* digits, int* length, int* exponent) {
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  uint64_t fraction = bits & 0xfffffffffffffu;
+  int biased = (int)(bits >> 52);
+  DiyFp w = biased ? (DiyFp){ fraction | (uint64_t)1 << 52, biased - 1075 }
+    : (DiyFp){ fraction, -1074 };
+  // Halfway to the neighbours, the one below is closer at powers of two.
+  DiyFp high = diy_fp_normalize((DiyFp){ (w.f << 1) + 1, w.e - 1 });
+  DiyFp low = fraction == 0 && biased > 1 ? (DiyFp){ (w.f << 2) - 1, w.e - 2 }
+    : (DiyFp){ (w.f << 1) - 1, w.e - 1 };
+  low = (DiyFp){ low.f << (low.e - high.e), high.e };
+  w = diy_fp_normalize(w);
+  DiyFp power;
+  int decimal = dtoa_cached_power(w.e, &power);
+  int kappa;
+  bool exact = dtoa_digit_gen(diy_fp_multiply(low, power), diy_fp_multiply(w, power),
+    diy_fp_multiply(high, power), digits, length, &kappa);
+  *exponent = kappa - decimal;
+  return exact;
+}
+
+// Fewest "%.*e" digits strtod reads back as number.
+int dtoa_fallback(double number, char* digits, int* exponent) {
+  char buffer[32];
+  for ( int precision = 0;; ++precision ) {
+    snprintf(buffer, sizeof(buffer), "%.*e", precision, number);
+    if ( precision == 16 || strtod(buffer, NULL) == number ) break;
+  }
+  int length = 0;
+  char* c = buffer;
+  for ( ; *c != 'e'; ++c )
+    if ( *c != '.' ) digits[length++] = *c;
+  *exponent = atoi(c + 1) - (length - 1);
+  return length;
+}
+
+#undef DTOA_POWERS
+
+CLOX_END_DECLS
+
+#endif //_CLOX_DTOA_H
@@ -0,0 +1,126 @@
+#ifndef _CLOX_EMBED_H
+#define _CLOX_EMBED_H
+
+#include "common.h"
+#include "vm.h"
+
+CLOX_BEG_DECLS
+
+// Embedding API: load a script once, then call its functions from C
+// without going through the compiler again.
+//
+//   Vm lox;
+//   vm_init(&lox);
+//   interpret(&lox, "fun score(a, b) { return a * 2 + b; }");
+//   CallHandle score = vm_function(&lox, "score");
+//   Value result, args[] = { NUMBER_VAL(20), NUMBER_VAL(2) };
+//   if ( vm_call(&lox, score, args, 2, &result) == INTERPRET_OKAY )
+//     printf("%g\n", AS_NUMBER(result)); // 42
+//   vm_release(&lox, score);
+//   vm_delete(&lox);
+//
+// Arguments that allocate (strings) are pushed one at a time so the
+// collector sees them: vm_prepare(handle), vm_push or vm_push_string
+// per argument, then vm_invoke. Results stay valid until the next
+// call into the VM. None of these may be used from inside a native.
+//
+// Slots of vm->handles come in pairs: the pinned closure, nil once
+// released, and the slot's generation, counting its releases. A
+// handle released twice or used after its release no longer matches
+// the generation and is ignored.
+
+typedef struct {
+  ObjectClosure* closure; // NULL when the lookup failed.
+  int slot; // Pins the closure in vm->handles.
+  double generation;
+} CallHandle;
+
+// Looks up a global function, the handle keeps it alive even if the
+// global is reassigned later.
+CallHandle vm_function(Vm* instance, const char* name) {
+  vm = instance;
+  CallHandle handle = { NULL, -1, 0 };
+  ObjectString* key = table_find_string(&vm->strings, name, strlen(name),
+    hash_string(name, strlen(name)));
+  Value value;
+  if ( key == NULL || !table_get(&vm->globals, key, &value) || !IS_CLOSURE(value) )
+    return handle;
+  handle.closure = AS_CLOSURE(value);
+  for ( int i = 0; i < vm->handles.count; i += 2 )
+    if ( IS_NIL(vm->handles.values[i]) ) {
+      vm->handles.values[i] = value;
+      handle.slot = i;
+      handle.generation = AS_NUMBER(vm->handles.values[i + 1]);
+      return handle;
+    }
+  handle.slot = vm->handles.count;
+  value_append(&vm->handles, value);
+  value_append(&vm->handles, NUMBER_VAL(0));
+  return handle;
+}
+
+// Whether handle still pins its closure.
+bool vm_handle_live(Vm* instance, CallHandle handle) {
+  return handle.closure != NULL && handle.slot >= 0 && handle.slot < instance->handles.count
+    && AS_NUMBER(instance->handles.values[handle.slot + 1]) == handle.generation
+    && !IS_NIL(instance->handles.values[handle.slot]);
+}
+
+void vm_release(Vm* instance, CallHandle handle) {
+  if ( !vm_handle_live(instance, handle) ) return;
+  instance->handles.values[handle.slot] = NIL_VAL;
+  instance->handles.values[handle.slot + 1] = NUMBER_VAL(handle.generation + 1);
+}
+
+int vm_arity(CallHandle handle) {
+  return handle.closure == NULL ? -1 : handle.closure->function->arity;
+}
+
+// False for failed or released handles, nothing is pushed then.
+bool vm_prepare(Vm* instance, CallHandle handle) {
+  vm = instance;
+  if ( !vm_handle_live(instance, handle) ) return false;
+  stack_push(OBJECT_VAL(handle.closure));
+  return true;
+}
+
+void vm_push(Vm* instance, Value value) {
+  vm = instance;
+  stack_push(value);
+}
+
+void vm_push_string(Vm* instance, const char* chars, int length) {
+  vm = instance;
+  stack_push(OBJECT_VAL(copy_string(chars, length)));
+}
+
+// Runs the prepared call, arity mismatches and errors in the
+// function are reported as runtime errors.
+InterpretResult vm_invoke(Vm* instance, int arg_count, Value* result) {
+  vm = instance;
+  if ( !call_function(AS_CLOSURE(stack_peek(arg_count)), arg_count) )
+    return INTERPRET_RUNTIME_ERROR;
+  InterpretResult status = run();
+  output_flush();
+  if ( status != INTERPRET_OKAY ) return status;
+  *result = stack_pop();
+  return INTERPRET_OKAY;
+}
+
+InterpretResult vm_call(Vm* instance, CallHandle handle,
+  const Value* args, int arg_count, Value* result) {
+  if ( !vm_prepare(instance, handle) ) return INTERPRET_RUNTIME_ERROR;
+  for ( int i = 0; i < arg_count; ++i ) stack_push(args[i]);
+  return vm_invoke(instance, arg_count, result);
+}
+
+// Natives defined with an arity are checked by the VM before the
+// call, like Lox functions.
+void vm_define_native(Vm* instance, const char* name, NativeFn function, int arity) {
+  vm = instance;
+  define_native_arity(name, function, arity);
+}
+
+CLOX_END_DECLS
+
+#endif //_CLOX_EMBED_H
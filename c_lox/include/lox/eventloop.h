@@ -0,0 +1,531 @@
+#ifndef _CLOX_EVENTLOOP_H
+#define _CLOX_EVENTLOOP_H
+
+#include "common.h"
+#include "object.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+CLOX_BEG_DECLS
+
+// Tasks are fibers scheduled by a per VM epoll loop. I/O natives
+// called from a task try the operation right away and, when it would
+// block, park the task until its fd is ready, run_tasks keeps the
+// other tasks going meanwhile and returns once all of them finished.
+//
+//   fun echo(client) { fd_write(client, fd_read(client)); fd_close(client); }
+//   fun serve(listener) {
+//     for (;;) task(echo, accept(listener)); // One task per client.
+//   }
+//   fun tick() { for (;;) { sleep(0.5); print "tick"; } }
+//   task(serve, unix_listen("/tmp/echo.sock"));
+//   task(tick);
+//   run_tasks();
+//
+// Outside of tasks the same natives simply block. I/O failures are
+// reported as nil (false for fd_close), fd_read also returns nil at
+// end of file. Sockets are local only: unix paths or loopback ports.
+
+#define LOOP_READ_SIZE 65536
+#define LOOP_EVENTS 64
+
+typedef enum {
+  WAIT_NONE,
+  WAIT_READ,
+  WAIT_WRITE,
+  WAIT_ACCEPT,
+  WAIT_CONNECT,
+} WaitKind;
+
+// An operation parked on an fd, the loop retries it once ready.
+typedef struct {
+  ObjectFiber* fiber;
+  WaitKind kind;
+  int size;
+  int written;
+  Value data;
+} FdWait;
+
+typedef struct {
+  ObjectFiber* fiber;
+  Value value;
+} ReadyTask;
+
+typedef struct {
+  ObjectFiber* fiber;
+  double deadline;
+} Timer;
+
+struct EventLoop {
+  int epoll_fd;
+  ReadyTask* ready; // Ring buffer.
+  int ready_head;
+  int ready_count;
+  int ready_capacity;
+  Timer* timers; // Min heap on deadline.
+  int timer_count;
+  int timer_capacity;
+  FdWait* waits; // Indexed by fd.
+  int wait_count;
+  int wait_capacity;
+  ObjectFiber* waiter; // Inside run_tasks.
+};
+
+double loop_now() {
+  return clock_nanoseconds() / 1e9;
+}
+
+Value fd_value(int fd) {
+#ifdef NAN_BOXING_OPT
+  return INT_VAL(fd);
+#else
+  return NUMBER_VAL((double)fd);
+#endif // NAN_BOXING_OPT
+}
+
+bool is_fd_value(Value value) {
+  return IS_NUMBER(value) && AS_NUMBER(value) >= 0 && AS_NUMBER(value) <= INT_MAX
+    && AS_NUMBER(value) == (int)AS_NUMBER(value);
+}
+
+EventLoop* event_loop() {
+  if ( vm->event_loop != NULL ) return vm->event_loop;
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if ( epoll_fd < 0 ) return NULL;
+  EventLoop* loop = (EventLoop*)malloc(sizeof(EventLoop));
+  if ( loop == NULL ) exit(80);
+  *loop = (EventLoop){ .epoll_fd = epoll_fd };
+  return vm->event_loop = loop;
+}
+
+void event_loop_delete(EventLoop* loop) {
+  if ( loop == NULL ) return;
+  close(loop->epoll_fd);
+  free(loop->ready);
+  free(loop->timers);
+  free(loop->waits);
+  free(loop);
+}
+
+// Drops every task, a runtime error unwound all of them.
+void loop_reset() {
+  EventLoop* loop = vm->event_loop;
+  if ( loop == NULL ) return;
+  for ( int fd = 0; fd < loop->wait_capacity; ++fd )
+    if ( loop->waits[fd].fiber != NULL ) {
+      epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+      loop->waits[fd] = (FdWait){ .kind = WAIT_NONE, .data = NIL_VAL };
+    }
+  loop->ready_count = loop->timer_count = loop->wait_count = 0;
+  loop->waiter = NULL;
+}
+
+void gc_mark_event_loop() {
+  EventLoop* loop = vm->event_loop;
+  if ( loop == NULL ) return;
+  for ( int i = 0; i < loop->ready_count; ++i ) {
+    ReadyTask* task = &loop->ready[(loop->ready_head + i) % loop->ready_capacity];
+    gc_mark_object((Object*)task->fiber);
+    gc_mark_value(task->value);
+  }
+  for ( int i = 0; i < loop->timer_count; ++i )
+    gc_mark_object((Object*)loop->timers[i].fiber);
+  for ( int fd = 0; fd < loop->wait_capacity; ++fd )
+    if ( loop->waits[fd].fiber != NULL ) {
+      gc_mark_object((Object*)loop->waits[fd].fiber);
+      gc_mark_value(loop->waits[fd].data);
+    }
+  gc_mark_object((Object*)loop->waiter);
+}
+
+void loop_ready(EventLoop* loop, ObjectFiber* fiber, Value value) {
+  if ( loop->ready_count == loop->ready_capacity ) {
+    int capacity = GROW_CAPACITY(loop->ready_capacity);
+    ReadyTask* ready = (ReadyTask*)malloc(sizeof(ReadyTask) * capacity);
+    if ( ready == NULL ) exit(80);
+    for ( int i = 0; i < loop->ready_count; ++i )
+      ready[i] = loop->ready[(loop->ready_head + i) % loop->ready_capacity];
+    free(loop->ready);
+    loop->ready = ready;
+    loop->ready_head = 0;
+    loop->ready_capacity = capacity;
+  }
+  int tail = (loop->ready_head + loop->ready_count++) % loop->ready_capacity;
+  loop->ready[tail] = (ReadyTask){ fiber, value };
+}
+
+void loop_timer_push(EventLoop* loop, ObjectFiber* fiber, double deadline) {
+  if ( loop->timer_count == loop->timer_capacity ) {
+    loop->timer_capacity = GROW_CAPACITY(loop->timer_capacity);
+    loop->timers = (Timer*)realloc(loop->timers, sizeof(Timer) * loop->timer_capacity);
+    if ( loop->timers == NULL ) exit(80);
+  }
+  int child = loop->timer_count++;
+  while ( child > 0 ) {
+    int parent = (child - 1) / 2;
+    if ( loop->timers[parent].deadline <= deadline ) break;
+    loop->timers[child] = loop->timers[parent];
+    child = parent;
+  }
+  loop->timers[child] = (Timer){ fiber, deadline };
+}
+
+ObjectFiber* loop_timer_pop(EventLoop* loop) {
+  ObjectFiber* fiber = loop->timers[0].fiber;
+  Timer last = loop->timers[--loop->timer_count];
+  int parent = 0;
+  for ( ;; ) {
+    int child = parent * 2 + 1;
+    if ( child >= loop->timer_count ) break;
+    if ( child + 1 < loop->timer_count
+      && loop->timers[child + 1].deadline < loop->timers[child].deadline ) ++child;
+    if ( last.deadline <= loop->timers[child].deadline ) break;
+    loop->timers[parent] = loop->timers[child];
+    parent = child;
+  }
+  loop->timers[parent] = last;
+  return fiber;
+}
+
+// Tasks run until they finish or park, fibers they resume
+// park along with them. Calls made by natives cannot park,
+// they block like code outside tasks, see call_nested.
+bool in_task() {
+  if ( vm->run_base ) return false;
+  ObjectFiber* fiber = vm->fiber;
+  while ( fiber->caller != NULL ) fiber = fiber->caller;
+  return fiber->task;
+}
+
+bool fd_would_block() {
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+// Runs the operation without blocking, false means it would block.
+bool fd_attempt(FdWait* wait, int fd, Value* result) {
+  switch ( wait->kind ) {
+  case WAIT_READ: {
+    char* buffer = (char*)malloc(wait->size);
+    if ( buffer == NULL ) exit(80);
+    ssize_t count = read(fd, buffer, wait->size);
+    if ( count < 0 && fd_would_block() ) {
+      free(buffer);
+      return false;
+    }
+    *result = count > 0 ? OBJECT_VAL(copy_string(buffer, (int)count)) : NIL_VAL;
+    free(buffer);
+    return true;
+  }
+  case WAIT_WRITE: {
+    ObjectString* string = AS_STRING(wait->data);
+    while ( wait->written < string->length ) {
+      ssize_t count = write(fd, string->chars + wait->written,
+        string->length - wait->written);
+      if ( count < 0 ) {
+        if ( fd_would_block() ) return false;
+        break;
+      }
+      wait->written += (int)count;
+    }
+    *result = wait->written == string->length ? fd_value(wait->written) : NIL_VAL;
+    return true;
+  }
+  case WAIT_ACCEPT: {
+    int client = accept(fd, NULL, NULL);
+    if ( client < 0 && fd_would_block() ) return false;
+    if ( client >= 0 ) fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+    *result = client >= 0 ? fd_value(client) : NIL_VAL;
+    return true;
+  }
+  case WAIT_CONNECT: {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if ( getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error ) {
+      close(fd);
+      *result = NIL_VAL;
+    } else *result = fd_value(fd);
+    return true;
+  }
+  default: return true;
+  }
+}
+
+short fd_poll_events(WaitKind kind) {
+  return kind == WAIT_READ || kind == WAIT_ACCEPT ? POLLIN : POLLOUT;
+}
+
+// Parks the current fiber on the fd, false if it cannot be watched.
+bool loop_watch(EventLoop* loop, int fd, FdWait* wait) {
+  if ( fd >= loop->wait_capacity ) {
+    int capacity = loop->wait_capacity < 8 ? 8 : loop->wait_capacity;
+    while ( capacity <= fd ) capacity *= 2;
+    loop->waits = (FdWait*)realloc(loop->waits, sizeof(FdWait) * capacity);
+    if ( loop->waits == NULL ) exit(80);
+    for ( int i = loop->wait_capacity; i < capacity; ++i )
+      loop->waits[i] = (FdWait){ .kind = WAIT_NONE, .data = NIL_VAL };
+    loop->wait_capacity = capacity;
+  }
+  if ( loop->waits[fd].fiber != NULL ) return false;
+  struct epoll_event event = {
+    .events = fd_poll_events(wait->kind) == POLLIN ? EPOLLIN : EPOLLOUT,
+    .data.fd = fd,
+  };
+  if ( epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0 ) return false;
+  wait->fiber = vm->fiber;
+  loop->waits[fd] = *wait;
+  ++loop->wait_count;
+  return true;
+}
+
+// Retries the operation parked on a ready fd and queues its fiber
+// with the result once it completes.
+void loop_complete(EventLoop* loop, int fd) {
+  FdWait* wait = &loop->waits[fd];
+  if ( wait->fiber == NULL ) return;
+  Value result;
+  if ( !fd_attempt(wait, fd, &result) ) return;
+  ObjectFiber* fiber = wait->fiber;
+  *wait = (FdWait){ .kind = WAIT_NONE, .data = NIL_VAL };
+  --loop->wait_count;
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  loop_ready(loop, fiber, result);
+}
+
+// Blocks until an fd is ready or the next timer is due.
+void loop_poll(EventLoop* loop) {
+  int timeout = -1;
+  if ( loop->timer_count ) {
+    double wait = loop->timers[0].deadline - loop_now();
+    timeout = wait <= 0 ? 0 : wait >= INT_MAX / 1000 ? INT_MAX : (int)(wait * 1000) + 1;
+  }
+  struct epoll_event events[LOOP_EVENTS];
+  int count = epoll_wait(loop->epoll_fd, events, LOOP_EVENTS, timeout);
+  if ( heap_requested | interrupt_requested ) vm_safepoint();
+  for ( int i = 0; i < count; ++i ) loop_complete(loop, events[i].data.fd);
+  double now = loop_now();
+  while ( loop->timer_count && loop->timers[0].deadline <= now )
+    loop_ready(loop, loop_timer_pop(loop), NIL_VAL);
+}
+
+// Switches to the next ready task, waiting for one if needed, or
+// back to run_tasks once nothing is left to wait for.
+void loop_switch_next() {
+  EventLoop* loop = vm->event_loop;
+  while ( loop->ready_count == 0 ) {
+    if ( loop->timer_count == 0 && loop->wait_count == 0 ) {
+      ObjectFiber* waiter = loop->waiter;
+      loop->waiter = NULL;
+      fiber_load(waiter);
+      waiter->state = FIBER_RUNNING;
+      stack_push(NIL_VAL);
+      return;
+    }
+    loop_poll(loop);
+  }
+  ReadyTask next = loop->ready[loop->ready_head];
+  loop->ready_head = (loop->ready_head + 1) % loop->ready_capacity;
+  --loop->ready_count;
+  fiber_enter(next.fiber, next.value);
+}
+
+// Pops the native's call and parks the current fiber, whoever
+// queued it pushes its result once it is switched back to.
+Value loop_suspend(int arg_count) {
+  vm->stack_top -= arg_count + 1;
+  vm->fiber->state = FIBER_WAITING;
+  fiber_save(vm->fiber);
+  loop_switch_next();
+  return ERROR_VAL(fiber_switched);
+}
+
+Value loop_yield(int arg_count) {
+  loop_ready(vm->event_loop, vm->fiber, NIL_VAL);
+  return loop_suspend(arg_count);
+}
+
+Value loop_sleep(double seconds) {
+  loop_timer_push(vm->event_loop, vm->fiber, loop_now() + seconds);
+  return loop_suspend(1);
+}
+
+// Parks a task on the fd, anything else blocks on it. Regular files
+// cannot be watched by epoll but never block for long either.
+Value fd_wait(int arg_count, int fd, FdWait* wait) {
+  Value result;
+  if ( fd_attempt(wait, fd, &result) ) return result;
+  if ( in_task() ) {
+    if ( loop_watch(vm->event_loop, fd, wait) ) return loop_suspend(arg_count);
+    if ( errno != EPERM ) return ERROR_VAL("Another task is waiting on this fd.");
+  }
+  struct pollfd poller = { .fd = fd, .events = fd_poll_events(wait->kind) };
+  do poll(&poller, 1, -1);
+  while ( !fd_attempt(wait, fd, &result) );
+  return result;
+}
+
+int fd_socket(int domain) {
+  return socket(domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+}
+
+bool unix_address(struct sockaddr_un* address, Value path) {
+  *address = (struct sockaddr_un){ .sun_family = AF_UNIX };
+  if ( AS_STRING(path)->length >= (int)sizeof(address->sun_path) ) return false;
+  memcpy(address->sun_path, AS_CSTRING(path), AS_STRING(path)->length);
+  return true;
+}
+
+struct sockaddr_in loopback_address(int port) {
+  struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port) };
+  inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+  return address;
+}
+
+Value fd_listen(int fd, struct sockaddr* address, socklen_t length) {
+  if ( fd < 0 ) return NIL_VAL;
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if ( bind(fd, address, length) < 0 || listen(fd, SOMAXCONN) < 0 ) {
+    close(fd);
+    return NIL_VAL;
+  }
+  return fd_value(fd);
+}
+
+Value fd_connect(int arg_count, int fd, struct sockaddr* address, socklen_t length) {
+  if ( fd < 0 ) return NIL_VAL;
+  if ( connect(fd, address, length) == 0 ) return fd_value(fd);
+  // EAGAIN from a Unix socket is a full backlog, not a pending connect.
+  if ( errno != EINPROGRESS ) {
+    close(fd);
+    return NIL_VAL;
+  }
+  FdWait wait = { .kind = WAIT_CONNECT, .data = NIL_VAL };
+  // Connecting reports through SO_ERROR, it has to wait first.
+  if ( in_task() ) {
+    if ( loop_watch(vm->event_loop, fd, &wait) ) return loop_suspend(arg_count);
+    return ERROR_VAL("Another task is waiting on this fd.");
+  }
+  struct pollfd poller = { .fd = fd, .events = POLLOUT };
+  while ( poll(&poller, 1, -1) < 0 && errno == EINTR );
+  Value result;
+  fd_attempt(&wait, fd, &result);
+  return result;
+}
+
+// ---- Natives ----
+
+Value task_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count < 1 || arg_count > 2 || !IS_CLOSURE(*args)
+    || UNWRAP_CLOSURE(*args)->arity > 1 )
+    return ERROR_VAL("Expected a function taking at most one argument and its argument.");
+  EventLoop* loop = event_loop();
+  if ( loop == NULL ) return ERROR_VAL("Could not create the event loop.");
+  ObjectFiber* fiber = new_fiber(AS_CLOSURE(*args));
+  fiber->task = true;
+  loop_ready(loop, fiber, arg_count == 2 ? args[1] : NIL_VAL);
+  return OBJECT_VAL(fiber);
+}
+
+Value run_tasks_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 0 ) return ERROR_VAL("Did not expect any arguments.");
+  if ( in_task() ) return ERROR_VAL("Cannot run tasks from a task.");
+  if ( vm->run_base ) return ERROR_VAL("Cannot switch fibers inside a native call.");
+  EventLoop* loop = vm->event_loop;
+  if ( loop == NULL || loop->ready_count + loop->timer_count + loop->wait_count == 0 )
+    return NIL_VAL;
+  loop->waiter = vm->fiber;
+  return loop_suspend(0);
+}
+
+Value fd_read_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count < 1 || arg_count > 2 || !is_fd_value(*args)
+    || (arg_count == 2 && (!is_fd_value(args[1]) || AS_NUMBER(args[1]) == 0)) )
+    return ERROR_VAL("Expected an fd and an optional positive size.");
+  FdWait wait = {
+    .kind = WAIT_READ,
+    .size = arg_count == 2 ? (int)AS_NUMBER(args[1]) : LOOP_READ_SIZE,
+    .data = NIL_VAL,
+  };
+  return fd_wait(arg_count, (int)AS_NUMBER(*args), &wait);
+}
+
+// Returns the length of the string once all of it is written.
+Value fd_write_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 2 || !is_fd_value(*args) || !IS_STRING(args[1]) )
+    return ERROR_VAL("Expected an fd and a string.");
+  FdWait wait = { .kind = WAIT_WRITE, .data = args[1] };
+  if ( AS_NUMBER(*args) == STDOUT_FILENO ) output_flush();
+  return fd_wait(arg_count, (int)AS_NUMBER(*args), &wait);
+}
+
+Value fd_close_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 || !is_fd_value(*args) ) return ERROR_VAL("Expected an fd.");
+  int fd = (int)AS_NUMBER(*args);
+  EventLoop* loop = vm->event_loop;
+  if ( loop != NULL && fd < loop->wait_capacity && loop->waits[fd].fiber != NULL )
+    return ERROR_VAL("Cannot close an fd a task is waiting on.");
+  return BOOL_VAL(close(fd) == 0);
+}
+
+Value accept_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 || !is_fd_value(*args) )
+    return ERROR_VAL("Expected a listening fd.");
+  FdWait wait = { .kind = WAIT_ACCEPT, .data = NIL_VAL };
+  return fd_wait(arg_count, (int)AS_NUMBER(*args), &wait);
+}
+
+Value unix_listen_native(Vm* vm, int arg_count, Value* args) {
+  struct sockaddr_un address;
+  if ( arg_count != 1 || !IS_STRING(*args) )
+    return ERROR_VAL("Expected a socket path.");
+  if ( !unix_address(&address, *args) ) return ERROR_VAL("Socket path is too long.");
+  unlink(address.sun_path);
+  return fd_listen(fd_socket(AF_UNIX), (struct sockaddr*)&address, sizeof(address));
+}
+
+Value unix_connect_native(Vm* vm, int arg_count, Value* args) {
+  struct sockaddr_un address;
+  if ( arg_count != 1 || !IS_STRING(*args) )
+    return ERROR_VAL("Expected a socket path.");
+  if ( !unix_address(&address, *args) ) return ERROR_VAL("Socket path is too long.");
+  return fd_connect(arg_count, fd_socket(AF_UNIX), (struct sockaddr*)&address, sizeof(address));
+}
+
+Value tcp_listen_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 || !is_fd_value(*args) || AS_NUMBER(*args) > 65535 )
+    return ERROR_VAL("Expected a port number.");
+  struct sockaddr_in address = loopback_address((int)AS_NUMBER(*args));
+  return fd_listen(fd_socket(AF_INET), (struct sockaddr*)&address, sizeof(address));
+}
+
+Value tcp_connect_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 || !is_fd_value(*args) || AS_NUMBER(*args) > 65535 )
+    return ERROR_VAL("Expected a port number.");
+  struct sockaddr_in address = loopback_address((int)AS_NUMBER(*args));
+  return fd_connect(arg_count, fd_socket(AF_INET), (struct sockaddr*)&address, sizeof(address));
+}
+
+void setup_event_loop_native() {
+  define_native("task", task_native);
+  define_native("run_tasks", run_tasks_native);
+  define_native("fd_read", fd_read_native);
+  define_native("fd_write", fd_write_native);
+  define_native("fd_close", fd_close_native);
+  define_native("accept", accept_native);
+  define_native("unix_listen", unix_listen_native);
+  define_native("unix_connect", unix_connect_native);
+  define_native("tcp_listen", tcp_listen_native);
+  define_native("tcp_connect", tcp_connect_native);
+}
+
+CLOX_END_DECLS
+
+#endif //_CLOX_EVENTLOOP_H
@@ -0,0 +1,438 @@
+#ifndef _CLOX_F64ARRAY_H
+#define _CLOX_F64ARRAY_H
+
+#include "common.h"
+#include "object.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(CLOX_NO_SIMD)
+# define CLOX_F64_SIMD
+# include <immintrin.h>
+#endif
+
+CLOX_BEG_DECLS
+
+// Float64 arrays: fixed length arrays of unboxed doubles.
+//
+//   var a = f64_array([1, 2, 3, 4]);
+//   var b = f64_array(4, 0.5);         // four halves
+//   print f64_dot(f64_mul(a, 2), b);   // 20
+//
+// Indexing, length() and for-in work as on lists, stores must be
+// numbers. The bulk natives run SSE2 kernels, or AVX2 and FMA ones
+// when the CPU has them, picked once per process. CLOX_NO_SIMD builds
+// stay scalar and $CLOX_F64_KERNELS (scalar, sse2) caps the choice.
+// Vector kernels add in a different order than a loop would, so
+// sums, dot products and prefix sums may differ from one in the last
+// bits. f64_min and f64_max return the first nan if there is one.
+
+typedef enum {
+  F64_ADD,
+  F64_SUB,
+  F64_MUL,
+  F64_DIV
+} F64Op;
+
+typedef struct {
+  const char* name;
+  // out = a op b, b is NULL for the scalar operand.
+  void (*map)(F64Op, double* out, const double* a, const double* b, double scalar, int count);
+  double (*dot)(const double*, const double*, int);
+  double (*sum)(const double*, int);
+  double (*extreme)(const double*, int, bool max); // count > 0
+  void (*scan)(double* out, const double* a, int count);
+} F64Kernels;
+
+ObjectF64Array* new_f64_array(int count) {
+  double* values = ALLOCATE(double, count);
+  ObjectF64Array* array = ALLOCATE_OBJECT(ObjectF64Array, OBJ_F64_ARRAY);
+  array->values = values;
+  array->count = count;
+  return array;
+}
+
+double f64_apply(F64Op op, double a, double b) {
+  switch ( op ) {
+  case F64_ADD: return a + b;
+  case F64_SUB: return a - b;
+  case F64_MUL: return a * b;
+  default: return a / b;
+  }
+}
+
+void f64_map_scalar(F64Op op, double* out, const double* a, const double* b, double scalar, int count) {
+  for ( int i = 0; i < count; ++i )
+    out[i] = f64_apply(op, a[i], b != NULL ? b[i] : scalar);
+}
+
+double f64_dot_scalar(const double* a, const double* b, int count) {
+  double sum = 0;
+  for ( int i = 0; i < count; ++i ) sum += a[i] * b[i];
+  return sum;
+}
+
+double f64_sum_scalar(const double* a, int count) {
+  double sum = 0;
+  for ( int i = 0; i < count; ++i ) sum += a[i];
+  return sum;
+}
+
+// The smallest or largest of result and the items, nan if any is.
+double f64_extreme_from(double result, const double* a, int count, bool max) {
+  for ( int i = 0; i < count; ++i ) {
+    if ( a[i] != a[i] ) return a[i];
+    if ( max ? a[i] > result : a[i] < result ) result = a[i];
+  }
+  return result;
+}
+
+double f64_extreme_scalar(const double* a, int count, bool max) {
+  return f64_extreme_from(a[0], a, count, max);
+}
+
+void f64_scan_scalar(double* out, const double* a, int count) {
+  double sum = 0;
+  for ( int i = 0; i < count; ++i ) out[i] = sum += a[i];
+}
+
+const F64Kernels f64_kernels_scalar = {
+  "scalar", f64_map_scalar, f64_dot_scalar, f64_sum_scalar,
+  f64_extreme_scalar, f64_scan_scalar
+};
+
+#ifdef CLOX_F64_SIMD
+
+// Vector loops for map, the tail is left to the scalar kernel.
+#define F64_MAP_LOOP(Vec, width, load, store, set1, op)              \
+  if ( b != NULL ) for ( ; i + width <= count; i += width )          \
+    store(out + i, op(load(a + i), load(b + i)));                    \
+  else {                                                             \
+    Vec s = set1(scalar);                                            \
+    for ( ; i + width <= count; i += width )                         \
+      store(out + i, op(load(a + i), s));                            \
+  }
+
+void f64_map_sse2(F64Op op, double* out, const double* a, const double* b, double scalar, int count) {
+  int i = 0;
+  switch ( op ) {
+  case F64_ADD: F64_MAP_LOOP(__m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_add_pd); break;
+  case F64_SUB: F64_MAP_LOOP(__m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_sub_pd); break;
+  case F64_MUL: F64_MAP_LOOP(__m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_mul_pd); break;
+  case F64_DIV: F64_MAP_LOOP(__m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_div_pd); break;
+  }
+  f64_map_scalar(op, out + i, a + i, b != NULL ? b + i : NULL, scalar, count - i);
+}
+
+double f64_sse2_total(__m128d sum) {
+  return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+}
+
+double f64_dot_sse2(const double* a, const double* b, int count) {
+  __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+  int i = 0;
+  for ( ; i + 4 <= count; i += 4 ) {
+    s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+  }
+  return f64_sse2_total(_mm_add_pd(s0, s1)) + f64_dot_scalar(a + i, b + i, count - i);
+}
+
+double f64_sum_sse2(const double* a, int count) {
+  __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+  int i = 0;
+  for ( ; i + 4 <= count; i += 4 ) {
+    s0 = _mm_add_pd(s0, _mm_loadu_pd(a + i));
+    s1 = _mm_add_pd(s1, _mm_loadu_pd(a + i + 2));
+  }
+  return f64_sse2_total(_mm_add_pd(s0, s1)) + f64_sum_scalar(a + i, count - i);
+}
+
+double f64_extreme_sse2(const double* a, int count, bool max) {
+  __m128d result = _mm_set1_pd(a[0]), nan = _mm_setzero_pd();
+  int i = 0;
+  for ( ; i + 2 <= count; i += 2 ) {
+    __m128d v = _mm_loadu_pd(a + i);
+    nan = _mm_or_pd(nan, _mm_cmpunord_pd(v, v));
+    result = max ? _mm_max_pd(result, v) : _mm_min_pd(result, v);
+  }
+  if ( _mm_movemask_pd(nan) ) return f64_extreme_scalar(a, count, max);
+  double lanes[2];
+  _mm_storeu_pd(lanes, result);
+  return f64_extreme_from(f64_extreme_scalar(lanes, 2, max), a + i, count - i, max);
+}
+
+// Two items at a time: [x0, x0 + x1] plus the running total.
+void f64_scan_sse2(double* out, const double* a, int count) {
+  __m128d carry = _mm_setzero_pd();
+  int i = 0;
+  for ( ; i + 2 <= count; i += 2 ) {
+    __m128d x = _mm_loadu_pd(a + i);
+    x = _mm_add_pd(x, _mm_castsi128_pd(_mm_slli_si128(_mm_castpd_si128(x), 8)));
+    x = _mm_add_pd(x, carry);
+    _mm_storeu_pd(out + i, x);
+    carry = _mm_unpackhi_pd(x, x);
+  }
+  double sum = _mm_cvtsd_f64(carry);
+  for ( ; i < count; ++i ) out[i] = sum += a[i];
+}
+
+const F64Kernels f64_kernels_sse2 = {
+  "sse2", f64_map_sse2, f64_dot_sse2, f64_sum_sse2,
+  f64_extreme_sse2, f64_scan_sse2
+};
+
+#define F64_AVX2 __attribute__((target("avx2,fma")))
+
+F64_AVX2 void f64_map_avx2(F64Op op, double* out, const double* a, const double* b, double scalar, int count) {
+  int i = 0;
+  switch ( op ) {
+  case F64_ADD: F64_MAP_LOOP(__m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, _mm256_add_pd); break;
+  case F64_SUB: F64_MAP_LOOP(__m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, _mm256_sub_pd); break;
+  case F64_MUL: F64_MAP_LOOP(__m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, _mm256_mul_pd); break;
+  case F64_DIV: F64_MAP_LOOP(__m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, _mm256_div_pd); break;
+  }
+  f64_map_scalar(op, out + i, a + i, b != NULL ? b + i : NULL, scalar, count - i);
+}
+
+F64_AVX2 double f64_avx2_total(__m256d sum) {
+  __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+}
+
+F64_AVX2 double f64_dot_avx2(const double* a, const double* b, int count) {
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  int i = 0;
+  for ( ; i + 8 <= count; i += 8 ) {
+    s0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), s0);
+    s1 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4), s1);
+  }
+  return f64_avx2_total(_mm256_add_pd(s0, s1)) + f64_dot_scalar(a + i, b + i, count - i);
+}
+
+F64_AVX2 double f64_sum_avx2(const double* a, int count) {
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  int i = 0;
+  for ( ; i + 8 <= count; i += 8 ) {
+    s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+    s1 = _mm256_add_pd(s1, _mm256_loadu_pd(a + i + 4));
+  }
+  return f64_avx2_total(_mm256_add_pd(s0, s1)) + f64_sum_scalar(a + i, count - i);
+}
+
+F64_AVX2 double f64_extreme_avx2(const double* a, int count, bool max) {
+  __m256d result = _mm256_set1_pd(a[0]), nan = _mm256_setzero_pd();
+  int i = 0;
+  for ( ; i + 4 <= count; i += 4 ) {
+    __m256d v = _mm256_loadu_pd(a + i);
+    nan = _mm256_or_pd(nan, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+    result = max ? _mm256_max_pd(result, v) : _mm256_min_pd(result, v);
+  }
+  if ( _mm256_movemask_pd(nan) ) return f64_extreme_scalar(a, count, max);
+  double lanes[4];
+  _mm256_storeu_pd(lanes, result);
+  return f64_extreme_from(f64_extreme_scalar(lanes, 4, max), a + i, count - i, max);
+}
+
+// Four items at a time: shift in one item then two, so lane k holds
+// x0 + ... + xk, then add the running total.
+F64_AVX2 void f64_scan_avx2(double* out, const double* a, int count) {
+  __m256d carry = _mm256_setzero_pd(), zero = _mm256_setzero_pd();
+  int i = 0;
+  for ( ; i + 4 <= count; i += 4 ) {
+    __m256d x = _mm256_loadu_pd(a + i);
+    x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x1));
+    x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x3));
+    x = _mm256_add_pd(x, carry);
+    _mm256_storeu_pd(out + i, x);
+    carry = _mm256_permute4x64_pd(x, _MM_SHUFFLE(3, 3, 3, 3));
+  }
+  double sum = _mm256_cvtsd_f64(carry);
+  for ( ; i < count; ++i ) out[i] = sum += a[i];
+}
+
+#undef F64_AVX2
+#undef F64_MAP_LOOP
+
+const F64Kernels f64_kernels_avx2 = {
+  "avx2", f64_map_avx2, f64_dot_avx2, f64_sum_avx2,
+  f64_extreme_avx2, f64_scan_avx2
+};
+
+#endif // CLOX_F64_SIMD
+
+const F64Kernels* f64_kernels = &f64_kernels_scalar;
+pthread_once_t f64_kernels_once = PTHREAD_ONCE_INIT;
+
+void f64_kernels_select() {
+#ifdef CLOX_F64_SIMD
+  const char* cap = getenv("CLOX_F64_KERNELS");
+  if ( cap != NULL && !strcmp(cap, "scalar") ) return;
+  f64_kernels = &f64_kernels_sse2;
+  if ( cap != NULL && !strcmp(cap, "sse2") ) return;
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") )
+    f64_kernels = &f64_kernels_avx2;
+#endif // CLOX_F64_SIMD
+}
+
+const F64Kernels* f64_dispatch() {
+  pthread_once(&f64_kernels_once, f64_kernels_select);
+  return f64_kernels;
+}
+
+// Radix sort over keys that order like the doubles: the sign bit is
+// flipped on positives and every bit on negatives. Negative nans end
+// up first and positive ones last.
+#define F64_SORT_BITS 11
+#define F64_SORT_PASSES 6 // ceil(64 / F64_SORT_BITS)
+#define F64_SORT_DIGIT(key, pass) (((key) >> ((pass) * F64_SORT_BITS)) & ((1 << F64_SORT_BITS) - 1))
+
+uint64_t f64_sort_key(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits >> 63 ? ~bits : bits | (1ull << 63);
+}
+
+double f64_sort_value(uint64_t key) {
+  uint64_t bits = key >> 63 ? key & ~(1ull << 63) : ~key;
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+void f64_sort(double* values, int count) {
+  if ( count < 2 ) return;
+  uint64_t* keys = (uint64_t*)malloc(sizeof(uint64_t) * count * 2);
+  uint32_t (*counts)[1 << F64_SORT_BITS] = calloc(F64_SORT_PASSES, sizeof(*counts));
+  if ( keys == NULL || counts == NULL ) exit(80);
+  uint64_t* from = keys, * to = keys + count;
+  for ( int i = 0; i < count; ++i ) {
+    from[i] = f64_sort_key(values[i]);
+    for ( int pass = 0; pass < F64_SORT_PASSES; ++pass )
+      ++counts[pass][F64_SORT_DIGIT(from[i], pass)];
+  }
+  for ( int pass = 0; pass < F64_SORT_PASSES; ++pass ) {
+    uint32_t* digits = counts[pass];
+    // Every key has the same digit, nothing moves.
+    if ( digits[F64_SORT_DIGIT(from[0], pass)] == (uint32_t)count ) continue;
+    uint32_t offset = 0;
+    for ( int digit = 0; digit < 1 << F64_SORT_BITS; ++digit ) {
+      uint32_t size = digits[digit];
+      digits[digit] = offset;
+      offset += size;
+    }
+    for ( int i = 0; i < count; ++i )
+      to[digits[F64_SORT_DIGIT(from[i], pass)]++] = from[i];
+    uint64_t* swap = from; from = to; to = swap;
+  }
+  for ( int i = 0; i < count; ++i ) values[i] = f64_sort_value(from[i]);
+  free(counts);
+  free(keys);
+}
+
+#undef F64_SORT_DIGIT
+#undef F64_SORT_PASSES
+#undef F64_SORT_BITS
+
+// f64_array(count, fill = 0), f64_array(list) or f64_array(array).
+Value f64_array_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count == 1 && IS_LIST(*args) ) {
+    ObjectList* list = AS_LIST(*args);
+    for ( int i = 0; i < list->count; ++i )
+      if ( !IS_NUMBER(list->items[i]) ) return ERROR_VAL("Expected a list of numbers.");
+    ObjectF64Array* array = new_f64_array(list->count);
+    for ( int i = 0; i < list->count; ++i ) array->values[i] = AS_NUMBER(list->items[i]);
+    return OBJECT_VAL(array);
+  }
+  if ( arg_count == 1 && IS_F64_ARRAY(*args) ) {
+    ObjectF64Array* source = AS_F64_ARRAY(*args);
+    ObjectF64Array* array = new_f64_array(source->count);
+    if ( array->count ) memcpy(array->values, source->values, sizeof(double) * array->count);
+    return OBJECT_VAL(array);
+  }
+  if ( arg_count < 1 || arg_count > 2 || !IS_NUMBER(args[0])
+    || (arg_count == 2 && !IS_NUMBER(args[1])) )
+    return ERROR_VAL("Expected a length and an optional fill, or a list.");
+  double length = AS_NUMBER(args[0]);
+  if ( !(length >= 0 && length <= INT32_MAX) || length != (int)length )
+    return ERROR_VAL("Length must be a positive integer.");
+  double fill = arg_count == 2 ? AS_NUMBER(args[1]) : 0;
+  ObjectF64Array* array = new_f64_array((int)length);
+  for ( int i = 0; i < array->count; ++i ) array->values[i] = fill;
+  return OBJECT_VAL(array);
+}
+
+Value f64_map(Value* args, int arg_count, F64Op op) {
+  if ( arg_count != 2 || !IS_F64_ARRAY(args[0]) || !(IS_F64_ARRAY(args[1]) || IS_NUMBER(args[1])) )
+    return ERROR_VAL("Expected an array and an array or a number.");
+  ObjectF64Array* a = AS_F64_ARRAY(args[0]);
+  if ( IS_F64_ARRAY(args[1]) && AS_F64_ARRAY(args[1])->count != a->count )
+    return ERROR_VAL("Arrays must have the same length.");
+  ObjectF64Array* result = new_f64_array(a->count);
+  const double* b = IS_F64_ARRAY(args[1]) ? AS_F64_ARRAY(args[1])->values : NULL;
+  f64_dispatch()->map(op, result->values, a->values, b,
+    b == NULL ? AS_NUMBER(args[1]) : 0, a->count);
+  return OBJECT_VAL(result);
+}
+
+Value f64_add_native(Vm* vm, int arg_count, Value* args) { return f64_map(args, arg_count, F64_ADD); }
+Value f64_sub_native(Vm* vm, int arg_count, Value* args) { return f64_map(args, arg_count, F64_SUB); }
+Value f64_mul_native(Vm* vm, int arg_count, Value* args) { return f64_map(args, arg_count, F64_MUL); }
+Value f64_div_native(Vm* vm, int arg_count, Value* args) { return f64_map(args, arg_count, F64_DIV); }
+
+Value f64_dot_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 2 || !IS_F64_ARRAY(args[0]) || !IS_F64_ARRAY(args[1]) )
+    return ERROR_VAL("Expected two arrays.");
+  ObjectF64Array* a = AS_F64_ARRAY(args[0]), * b = AS_F64_ARRAY(args[1]);
+  if ( a->count != b->count ) return ERROR_VAL("Arrays must have the same length.");
+  return NUMBER_VAL(f64_dispatch()->dot(a->values, b->values, a->count));
+}
+
+Value f64_sum_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 || !IS_F64_ARRAY(*args) ) return ERROR_VAL("Expected an array.");
+  ObjectF64Array* a = AS_F64_ARRAY(*args);
+  return NUMBER_VAL(f64_dispatch()->sum(a->values, a->count));
+}
+
+Value f64_extreme(Value* args, int arg_count, bool max) {
+  if ( arg_count != 1 || !IS_F64_ARRAY(*args) ) return ERROR_VAL("Expected an array.");
+  ObjectF64Array* a = AS_F64_ARRAY(*args);
+  if ( a->count == 0 ) return ERROR_VAL("Array is empty.");
+  return NUMBER_VAL(f64_dispatch()->extreme(a->values, a->count, max));
+}
+
+Value f64_min_native(Vm* vm, int arg_count, Value* args) { return f64_extreme(args, arg_count, false); }
+Value f64_max_native(Vm* vm, int arg_count, Value* args) { return f64_extreme(args, arg_count, true); }
+
+// A new array of the running totals.
+Value f64_prefix_sum_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 || !IS_F64_ARRAY(*args) ) return ERROR_VAL("Expected an array.");
+  ObjectF64Array* result = new_f64_array(AS_F64_ARRAY(*args)->count);
+  f64_dispatch()->scan(result->values, AS_F64_ARRAY(*args)->values, result->count);
+  return OBJECT_VAL(result);
+}
+
+// Sorts in place, returns the array.
+Value f64_sort_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 || !IS_F64_ARRAY(*args) ) return ERROR_VAL("Expected an array.");
+  f64_sort(AS_F64_ARRAY(*args)->values, AS_F64_ARRAY(*args)->count);
+  return *args;
+}
+
+void setup_f64_array_native() {
+  define_native("f64_array", f64_array_native);
+  define_native("f64_add", f64_add_native);
+  define_native("f64_sub", f64_sub_native);
+  define_native("f64_mul", f64_mul_native);
+  define_native("f64_div", f64_div_native);
+  define_native("f64_dot", f64_dot_native);
+  define_native("f64_sum", f64_sum_native);
+  define_native("f64_min", f64_min_native);
+  define_native("f64_max", f64_max_native);
+  define_native("f64_prefix_sum", f64_prefix_sum_native);
+  define_native("f64_sort", f64_sort_native);
+}
+
+CLOX_END_DECLS
+
+#endif //_CLOX_F64ARRAY_H
@@ -0,0 +1,217 @@
+#ifndef _CLOX_FIBER_H
+#define _CLOX_FIBER_H
+
+#include "common.h"
+#include "object.h"
+
+CLOX_BEG_DECLS
+
+// Fibers are coroutines with value and frame stacks of their own.
+// resume and yield swap the vm registers over to another fiber and
+// run() carries on there, the C stack is never involved so a parked
+// fiber costs no more than its stacks.
+//
+//   fun count(limit) {
+//     for (var i = 0; i < limit; i = i + 1) yield(i);
+//     return "done";
+//   }
+//   var counter = fiber(count);
+//   print resume(counter, 2); // 0, the first resume passes the argument
+//   print resume(counter);    // 1
+//   print resume(counter);    // done, fiber_done(counter) is now true
+//
+// resume(fiber, value) returns what the fiber yields or returns next
+// and yield(value) returns the value passed to the following resume.
+
+#define FIBER_FRAMES_INIT 4
+#define FIBER_STACK_INIT (UINT8_COUNT * 2)
+
+void fiber_save(ObjectFiber* fiber) {
+  fiber->frame_count = vm->frame_count;
+  fiber->stack_top = vm->stack_top;
+  fiber->open_upvalues = vm->open_upvalues;
+}
+
+void fiber_load(ObjectFiber* fiber) {
+  vm->fiber = fiber;
+  vm->frames = fiber->frames;
+  vm->frame_count = fiber->frame_count;
+  vm->stack = fiber->stack;
+  vm->stack_top = fiber->stack_top;
+  vm->open_upvalues = fiber->open_upvalues;
+  vm->frame_capacity = fiber->frame_capacity;
+  vm->stack_limit = fiber->stack + fiber->stack_capacity - UINT8_COUNT;
+}
+
+ObjectFiber* new_main_fiber() {
+  ObjectFiber* fiber = ALLOCATE_OBJECT(ObjectFiber, OBJ_FIBER);
+  fiber->state = FIBER_RUNNING;
+  fiber->frames = vm->main_frames;
+  fiber->frame_capacity = FRAMES_MAX;
+  fiber->stack = vm->main_stack;
+  fiber->stack_capacity = STACK_MAX;
+  fiber->caller = NULL;
+  fiber->task = false;
+  fiber_save(fiber);
+  return fiber;
+}
+
+// The closure waits in slot 0 for the first resume.
+ObjectFiber* new_fiber(ObjectClosure* closure) {
+  CallFrame* frames = ALLOCATE(CallFrame, FIBER_FRAMES_INIT);
+  Value* stack = ALLOCATE(Value, FIBER_STACK_INIT);
+  ObjectFiber* fiber = ALLOCATE_OBJECT(ObjectFiber, OBJ_FIBER);
+  fiber->state = FIBER_NEW;
+  fiber->frames = frames;
+  fiber->frame_count = 0;
+  fiber->frame_capacity = FIBER_FRAMES_INIT;
+  fiber->stack = stack;
+  fiber->stack_top = stack;
+  fiber->stack_capacity = FIBER_STACK_INIT;
+  fiber->open_upvalues = NULL;
+  fiber->caller = NULL;
+  fiber->task = false;
+  *fiber->stack_top++ = OBJECT_VAL(closure);
+  return fiber;
+}
+
+void fiber_delete(ObjectFiber* fiber) {
+  if ( fiber->frames == vm->main_frames ) return;
+  FREE_ARRAY(CallFrame, fiber->frames, fiber->frame_capacity);
+  FREE_ARRAY(Value, fiber->stack, fiber->stack_capacity);
+}
+
+// The main fiber starts at the limits and never grows.
+bool fiber_grow_frames() {
+  ObjectFiber* fiber = vm->fiber;
+  if ( fiber->frame_capacity >= FRAMES_MAX ) return false;
+  int capacity = fiber->frame_capacity * 2;
+  if ( capacity > FRAMES_MAX ) capacity = FRAMES_MAX;
+  vm->frames = fiber->frames =
+    GROW_ARRAY(CallFrame, fiber->frames, fiber->frame_capacity, capacity);
+  vm->frame_capacity = fiber->frame_capacity = capacity;
+  return true;
+}
+
+// Frame slots and open upvalues point into the stack, they are
+// moved over to the new one before the old one is released.
+void fiber_grow_stack() {
+  ObjectFiber* fiber = vm->fiber;
+  if ( fiber->stack_capacity >= STACK_MAX ) return;
+  int capacity = fiber->stack_capacity * 2;
+  if ( capacity > STACK_MAX ) capacity = STACK_MAX;
+  Value* stack = ALLOCATE(Value, capacity);
+  Value* old = vm->stack;
+  memcpy(stack, old, sizeof(Value) * (vm->stack_top - old));
+  for ( int i = 0; i < vm->frame_count; ++i )
+    vm->frames[i].slots = stack + (vm->frames[i].slots - old);
+  for ( ObjectUpvalue* upv = vm->open_upvalues; upv != NULL; upv = upv->next )
+    upv->location = stack + (upv->location - old);
+  vm->stack_top = stack + (vm->stack_top - old);
+  vm->stack = fiber->stack = stack;
+  FREE_ARRAY(Value, old, fiber->stack_capacity);
+  fiber->stack_capacity = capacity;
+  vm->stack_limit = stack + capacity - UINT8_COUNT;
+}
+
+// Switches to fiber and hands it value, the argument of a new
+// fiber or the result of the call it is parked in otherwise.
+void fiber_enter(ObjectFiber* fiber, Value value) {
+  fiber_load(fiber);
+  if ( fiber->state == FIBER_NEW ) {
+    ObjectClosure* closure = AS_CLOSURE(vm->stack[0]);
+    if ( closure->function->arity ) stack_push(value);
+    call_function(closure, closure->function->arity);
+  } else stack_push(value);
+  fiber->state = FIBER_RUNNING;
+}
+
+// Switches back to the resumer, which receives value.
+void fiber_return_to_caller(Value value) {
+  ObjectFiber* fiber = vm->fiber;
+  ObjectFiber* caller = fiber->caller;
+  fiber->caller = NULL;
+  fiber_save(fiber);
+  fiber_load(caller);
+  stack_push(value);
+}
+
+// The fiber's outermost function returned, its stacks are released
+// right away since nothing can run on them again. Tasks have no
+// caller, the event loop picks what runs next.
+void fiber_finish(Value result) {
+  ObjectFiber* fiber = vm->fiber;
+  fiber->state = FIBER_DONE;
+  if ( fiber->task ) loop_switch_next();
+  else fiber_return_to_caller(result);
+  // Freeing may collect the fiber itself, detach the stacks first.
+  CallFrame* frames = fiber->frames;
+  Value* stack = fiber->stack;
+  int frame_capacity = fiber->frame_capacity;
+  int stack_capacity = fiber->stack_capacity;
+  fiber->frames = NULL;
+  fiber->stack = fiber->stack_top = NULL;
+  fiber->frame_count = fiber->frame_capacity = 0;
+  fiber->stack_capacity = 0;
+  fiber->open_upvalues = NULL;
+  FREE_ARRAY(CallFrame, frames, frame_capacity);
+  FREE_ARRAY(Value, stack, stack_capacity);
+}
+
+// ---- Natives ----
+
+Value fiber_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 || !IS_CLOSURE(*args) || UNWRAP_CLOSURE(*args)->arity > 1 )
+    return ERROR_VAL("Expected a function taking at most one argument.");
+  return OBJECT_VAL(new_fiber(AS_CLOSURE(*args)));
+}
+
+// The natives below pop their own call and push the result onto
+// the stack of the fiber they switch to.
+Value resume_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count < 1 || arg_count > 2 || !IS_FIBER(*args) )
+    return ERROR_VAL("Expected a fiber and an optional value.");
+  ObjectFiber* fiber = AS_FIBER(*args);
+  if ( fiber->task ) return ERROR_VAL("Tasks are run by run_tasks.");
+  if ( vm->run_base ) return ERROR_VAL("Cannot switch fibers inside a native call.");
+  if ( fiber->state == FIBER_RUNNING || fiber->state == FIBER_WAITING )
+    return ERROR_VAL("Cannot resume a running fiber.");
+  if ( fiber->state == FIBER_DONE )
+    return ERROR_VAL("Cannot resume a finished fiber.");
+  Value value = arg_count == 2 ? args[1] : NIL_VAL;
+  vm->stack_top -= arg_count + 1;
+  fiber->caller = vm->fiber;
+  fiber_save(vm->fiber);
+  fiber_enter(fiber, value);
+  return ERROR_VAL(fiber_switched);
+}
+
+Value yield_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count > 1 ) return ERROR_VAL("Expected an optional value.");
+  if ( vm->fiber == vm->main_fiber )
+    return ERROR_VAL("Cannot yield from the main fiber.");
+  if ( vm->run_base ) return ERROR_VAL("Cannot switch fibers inside a native call.");
+  if ( vm->fiber->task ) return loop_yield(arg_count);
+  Value value = arg_count ? *args : NIL_VAL;
+  vm->stack_top -= arg_count + 1;
+  vm->fiber->state = FIBER_SUSPENDED;
+  fiber_return_to_caller(value);
+  return ERROR_VAL(fiber_switched);
+}
+
+Value fiber_done_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 || !IS_FIBER(*args) )
+    return ERROR_VAL("Expected a fiber.");
+  return BOOL_VAL(AS_FIBER(*args)->state == FIBER_DONE);
+}
+
+void setup_fiber_native() {
+  define_native("fiber", fiber_native);
+  define_native("resume", resume_native);
+  define_native("yield", yield_native);
+  define_native("fiber_done", fiber_done_native);
+}
+
+CLOX_END_DECLS
+
+#endif //_CLOX_FIBER_H
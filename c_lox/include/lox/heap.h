@@ -0,0 +1,701 @@
+#ifndef _CLOX_HEAP_H
+#define _CLOX_HEAP_H
+
+#include "common.h"
+#include "object.h"
+#include <signal.h>
+
+CLOX_BEG_DECLS
+
+// Heap census and object graph snapshots, for finding out what keeps
+// memory alive. The graph is built with the collector's own tracing:
+// whatever gc_mark_roots grays is a root, whatever gc_blacken_object
+// grays is a reference, so it follows exactly what a collection would.
+// Every object in vm->objects is a node, the ones not reachable are
+// garbage the next collection will free.
+//
+// Retained sizes come from the dominator tree: an object retains what
+// would be freed with it, the census charges each group (instances by
+// class, other objects by type) only for its outermost members.
+//
+//   heap_census()         census to stderr, returns reachable objects.
+//   heap_snapshot(path)   census plus every object with its size,
+//                         retained size, references and the shortest
+//                         path from a root, to path.
+//
+// kill -USR1 on a VM set up with heap_watch prints the census at the
+// next loop iteration or event loop wakeup, and writes a snapshot to
+// $CLOX_HEAP_SNAPSHOT when set.
+
+#define HEAP_TYPES 32 // Above the number of object types.
+#define HEAP_CENSUS_TOP 40
+#define HEAP_PATH_STEPS 8 // Longer paths only show the root and the last steps.
+
+typedef struct {
+  ObjectType type;
+  ObjectClass* klass; // Instances are grouped by class.
+  uint64_t count;
+  uint64_t bytes;
+  uint64_t reachable;
+  uint64_t retained;
+} HeapGroup;
+
+// Node 0 stands for the roots, node i is objects[i].
+typedef struct {
+  Object** objects;
+  int count;
+  Object** keys; // Open addressing from objects to nodes.
+  int* key_nodes;
+  int key_capacity;
+  int* edge_start; // References of node i: edges[edge_start[i] .. edge_start[i + 1]).
+  int* edges;
+  int edge_count;
+  int edge_capacity;
+  ObjectString** root_names; // Global holding the object, if any.
+  size_t* size;
+  uint64_t* retained;
+  int* number; // Depth first preorder number, -1 for unreachable nodes.
+  int* order; // Reachable nodes by number, the roots first.
+  int* tree_parent; // Parent in the depth first tree.
+  int reachable;
+  int* idom; // Immediate dominator.
+  int* parent; // Previous step of the shortest path from the roots.
+  int* depth; // Steps on that path.
+  int* first; // Its first step, the object a root refers to.
+  int* group;
+  HeapGroup* groups;
+  int group_count;
+} HeapGraph;
+
+Vm* heap_vm = NULL; // Dumped on SIGUSR1, see heap_watch.
+
+void* heap_alloc(size_t size) {
+  void* memory = malloc(size ? size : 1);
+  if ( memory == NULL ) exit(80);
+  return memory;
+}
+
+size_t heap_table_size(Table* table) {
+  if ( table->entries == NULL ) return 0;
+#ifdef TABLE_AND_FOLD_OPT
+  return sizeof(Entry) * (table->capacity + 1);
+#else
+  return sizeof(Entry) * table->capacity;
+#endif
+}
+
+// Bytes owned by the object alone, as freed by object_delete.
+size_t heap_object_size(Object* object) {
+  switch ( object->type ) {
+  case OBJ_STRING:
+    // Views own no chars.
+    if ( ((ObjectString*)object)->owner != NULL ) return sizeof(ObjectString);
+    return sizeof(ObjectString) + ((ObjectString*)object)->length + 1;
+  case OBJ_FUNCTION: {
+    Chunk* chunk = &((ObjectFunction*)object)->chunk;
+    return sizeof(ObjectFunction) + chunk->capacity * (sizeof(uint8_t) + sizeof(int))
+      + chunk->constants.capacity * sizeof(Value);
+  }
+  case OBJ_CLOSURE:
+    return sizeof(ObjectClosure) + ((ObjectClosure*)object)->upvalue_count * sizeof(ObjectUpvalue*);
+  case OBJ_CLASS: return sizeof(ObjectClass) + heap_table_size(&((ObjectClass*)object)->methods);
+  case OBJ_INSTANCE: return sizeof(ObjectInstance) + heap_table_size(&((ObjectInstance*)object)->fields);
+  case OBJ_FIBER: {
+    ObjectFiber* fiber = (ObjectFiber*)object;
+    if ( fiber->frames == vm->main_frames ) return sizeof(ObjectFiber);
+    return sizeof(ObjectFiber) + fiber->frame_capacity * sizeof(CallFrame)
+      + fiber->stack_capacity * sizeof(Value);
+  }
+  case OBJ_LIST: return sizeof(ObjectList) + ((ObjectList*)object)->capacity * sizeof(Value);
+  case OBJ_F64_ARRAY: return sizeof(ObjectF64Array) + ((ObjectF64Array*)object)->count * sizeof(double);
+  case OBJ_MAP: return sizeof(ObjectMap) + ((ObjectMap*)object)->capacity * sizeof(MapEntry);
+  case OBJ_READER: return sizeof(ObjectReader); // Mappings are not heap.
+  case OBJ_BOUND_METHOD: return sizeof(ObjectBoundMethod);
+  case OBJ_NATIVE: return sizeof(ObjectNative);
+  case OBJ_UPVALUE: return sizeof(ObjectUpvalue);
+  case OBJ_CHANNEL:
+  case OBJ_ISOLATE: return sizeof(ObjectHandle);
+  default: return sizeof(Object);
+  }
+}
+
+int heap_key_slot(HeapGraph* graph, Object* object) {
+  uint32_t mask = graph->key_capacity - 1;
+  uint32_t index = (uint32_t)(((uintptr_t)object >> 4) * 2654435761u) & mask;
+  while ( graph->keys[index] != NULL && graph->keys[index] != object )
+    index = (index + 1) & mask;
+  return index;
+}
+
+// Node of an object, 0 for objects outside vm->objects.
+int heap_node(HeapGraph* graph, Object* object) {
+  return graph->key_nodes[heap_key_slot(graph, object)];
+}
+
+void heap_edge(HeapGraph* graph, int node) {
+  if ( graph->edge_count == graph->edge_capacity ) {
+    graph->edge_capacity = GROW_CAPACITY(graph->edge_capacity);
+    graph->edges = (int*)realloc(graph->edges, sizeof(int) * graph->edge_capacity);
+    if ( graph->edges == NULL ) exit(80);
+  }
+  graph->edges[graph->edge_count++] = node;
+}
+
+// Turns what the last marking grayed into edges, unmarking it again.
+void heap_take_grays(HeapGraph* graph) {
+  while ( vm->gray_count > 0 ) {
+    Object* object = vm->gray_stack[--vm->gray_count];
+    object->is_marked = false;
+    int node = heap_node(graph, object);
+    if ( node > 0 ) heap_edge(graph, node);
+  }
+}
+
+void heap_build(HeapGraph* graph) {
+  int count = 1;
+  for ( Object* object = vm->objects; object != NULL; object = object->next ) ++count;
+  graph->count = count;
+  graph->objects = (Object**)heap_alloc(sizeof(Object*) * count);
+  graph->key_capacity = 16;
+  while ( graph->key_capacity < count * 2 ) graph->key_capacity *= 2;
+  graph->keys = (Object**)calloc(graph->key_capacity, sizeof(Object*));
+  graph->key_nodes = (int*)calloc(graph->key_capacity, sizeof(int));
+  graph->root_names = (ObjectString**)calloc(count, sizeof(ObjectString*));
+  if ( graph->keys == NULL || graph->key_nodes == NULL || graph->root_names == NULL ) exit(80);
+  graph->size = (size_t*)heap_alloc(sizeof(size_t) * count);
+  graph->edge_start = (int*)heap_alloc(sizeof(int) * (count + 1));
+  graph->objects[0] = NULL;
+  graph->size[0] = 0;
+  int node = 1;
+  for ( Object* object = vm->objects; object != NULL; object = object->next, ++node ) {
+    graph->objects[node] = object;
+    graph->size[node] = heap_object_size(object);
+    int slot = heap_key_slot(graph, object);
+    graph->keys[slot] = object;
+    graph->key_nodes[slot] = node;
+  }
+  // Globals first, their names make the most readable paths.
+  graph->edge_start[0] = 0;
+  Table* globals = &vm->globals;
+  for ( int i = 0; i TAB_COMP_OP globals->capacity; ++i ) {
+    Entry* entry = globals->entries + i;
+    if ( entry->key == NULL || !IS_OBJECT(entry->value) ) continue;
+    int target = heap_node(graph, AS_OBJECT(entry->value));
+    if ( target <= 0 ) continue;
+    if ( graph->root_names[target] == NULL ) graph->root_names[target] = entry->key;
+    heap_edge(graph, target);
+  }
+  gc_mark_roots();
+  heap_take_grays(graph);
+  for ( node = 1; node < count; ++node ) {
+    graph->edge_start[node] = graph->edge_count;
+    gc_blacken_object(graph->objects[node]);
+    heap_take_grays(graph);
+  }
+  graph->edge_start[count] = graph->edge_count;
+}
+
+// Depth first from the roots, numbering reachable nodes in preorder.
+void heap_number(HeapGraph* graph) {
+  int count = graph->count;
+  graph->number = (int*)heap_alloc(sizeof(int) * count);
+  graph->order = (int*)heap_alloc(sizeof(int) * count);
+  graph->tree_parent = (int*)heap_alloc(sizeof(int) * count);
+  int* stack = (int*)heap_alloc(sizeof(int) * count);
+  int* next = (int*)heap_alloc(sizeof(int) * count);
+  for ( int i = 0; i < count; ++i ) graph->number[i] = -1;
+  int depth = 0, numbered = 0;
+  stack[depth++] = 0;
+  next[0] = graph->edge_start[0];
+  graph->order[numbered] = 0;
+  graph->number[0] = numbered++;
+  graph->tree_parent[0] = 0;
+  while ( depth > 0 ) {
+    int node = stack[depth - 1];
+    if ( next[node] == graph->edge_start[node + 1] ) {
+      --depth;
+      continue;
+    }
+    int target = graph->edges[next[node]++];
+    if ( graph->number[target] >= 0 ) continue;
+    graph->order[numbered] = target;
+    graph->number[target] = numbered++;
+    graph->tree_parent[target] = node;
+    next[target] = graph->edge_start[target];
+    stack[depth++] = target;
+  }
+  graph->reachable = numbered;
+  free(stack);
+  free(next);
+}
+
+// Lengauer and Tarjan's dominators with simple path compression, all
+// on preorder numbers. Compression is iterative, chains of objects
+// can be far deeper than the C stack.
+void heap_compress(int* ancestor, int* label, int* semi, int* path, int v) {
+  int top = 0;
+  while ( ancestor[ancestor[v]] >= 0 ) {
+    path[top++] = v;
+    v = ancestor[v];
+  }
+  while ( top > 0 ) {
+    v = path[--top];
+    int a = ancestor[v];
+    if ( semi[label[a]] < semi[label[v]] ) label[v] = label[a];
+    ancestor[v] = ancestor[a];
+  }
+}
+
+int heap_eval(int* ancestor, int* label, int* semi, int* path, int v) {
+  if ( ancestor[v] < 0 ) return v;
+  heap_compress(ancestor, label, semi, path, v);
+  return label[v];
+}
+
+// Immediate dominators, then retained sizes summed up the dominator tree.
+void heap_dominate(HeapGraph* graph) {
+  int count = graph->count, reachable = graph->reachable;
+  // Predecessors by number, of reachable nodes only.
+  int* pred_start = (int*)calloc(reachable + 1, sizeof(int));
+  int* preds = (int*)heap_alloc(sizeof(int) * (graph->edge_count + 1));
+  int* fill = (int*)heap_alloc(sizeof(int) * (reachable + 1));
+  if ( pred_start == NULL ) exit(80);
+  for ( int v = 0; v < reachable; ++v ) {
+    int node = graph->order[v];
+    for ( int e = graph->edge_start[node]; e < graph->edge_start[node + 1]; ++e )
+      ++pred_start[graph->number[graph->edges[e]] + 1];
+  }
+  for ( int v = 0; v < reachable; ++v ) pred_start[v + 1] += pred_start[v];
+  memcpy(fill, pred_start, sizeof(int) * reachable);
+  for ( int v = 0; v < reachable; ++v ) {
+    int node = graph->order[v];
+    for ( int e = graph->edge_start[node]; e < graph->edge_start[node + 1]; ++e )
+      preds[fill[graph->number[graph->edges[e]]]++] = v;
+  }
+
+  int* semi = (int*)heap_alloc(sizeof(int) * reachable);
+  int* label = (int*)heap_alloc(sizeof(int) * reachable);
+  int* ancestor = (int*)heap_alloc(sizeof(int) * reachable);
+  int* dom = (int*)heap_alloc(sizeof(int) * reachable);
+  int* parent = (int*)heap_alloc(sizeof(int) * reachable);
+  int* path = (int*)heap_alloc(sizeof(int) * reachable);
+  // Buckets as linked lists: bucket_head per node, bucket_next per member.
+  int* bucket_head = fill;
+  int* bucket_next = (int*)heap_alloc(sizeof(int) * reachable);
+  for ( int v = 0; v < reachable; ++v ) {
+    semi[v] = label[v] = v;
+    ancestor[v] = -1;
+    bucket_head[v] = -1;
+    parent[v] = graph->number[graph->tree_parent[graph->order[v]]];
+  }
+  for ( int w = reachable - 1; w > 0; --w ) {
+    for ( int p = pred_start[w]; p < pred_start[w + 1]; ++p ) {
+      int u = heap_eval(ancestor, label, semi, path, preds[p]);
+      if ( semi[u] < semi[w] ) semi[w] = semi[u];
+    }
+    bucket_next[w] = bucket_head[semi[w]];
+    bucket_head[semi[w]] = w;
+    ancestor[w] = parent[w];
+    for ( int v = bucket_head[parent[w]]; v >= 0; v = bucket_next[v] ) {
+      int u = heap_eval(ancestor, label, semi, path, v);
+      dom[v] = semi[u] < semi[v] ? u : parent[w];
+    }
+    bucket_head[parent[w]] = -1;
+  }
+  dom[0] = 0;
+  for ( int w = 1; w < reachable; ++w )
+    if ( dom[w] != semi[w] ) dom[w] = dom[dom[w]];
+
+  graph->idom = (int*)heap_alloc(sizeof(int) * count);
+  for ( int i = 0; i < count; ++i ) graph->idom[i] = -1;
+  for ( int v = 0; v < reachable; ++v ) graph->idom[graph->order[v]] = graph->order[dom[v]];
+  free(pred_start);
+  free(preds);
+  free(fill);
+  free(semi);
+  free(label);
+  free(ancestor);
+  free(dom);
+  free(parent);
+  free(path);
+  free(bucket_next);
+
+  // Dominators come first in preorder, children are summed before them.
+  graph->retained = (uint64_t*)heap_alloc(sizeof(uint64_t) * count);
+  for ( int i = 0; i < count; ++i ) graph->retained[i] = graph->size[i];
+  for ( int v = reachable - 1; v > 0; --v ) {
+    int node = graph->order[v];
+    graph->retained[graph->idom[node]] += graph->retained[node];
+  }
+}
+
+// Breadth first from the roots for the shortest retaining paths.
+void heap_paths(HeapGraph* graph) {
+  int count = graph->count;
+  graph->parent = (int*)heap_alloc(sizeof(int) * count);
+  graph->depth = (int*)heap_alloc(sizeof(int) * count);
+  graph->first = (int*)heap_alloc(sizeof(int) * count);
+  int* queue = (int*)heap_alloc(sizeof(int) * count);
+  for ( int i = 0; i < count; ++i ) graph->parent[i] = -1;
+  int head = 0, tail = 0;
+  graph->parent[0] = 0;
+  graph->depth[0] = 0;
+  queue[tail++] = 0;
+  while ( head < tail ) {
+    int node = queue[head++];
+    for ( int e = graph->edge_start[node]; e < graph->edge_start[node + 1]; ++e ) {
+      int target = graph->edges[e];
+      if ( graph->parent[target] >= 0 ) continue;
+      graph->parent[target] = node;
+      graph->depth[target] = graph->depth[node] + 1;
+      graph->first[target] = node == 0 ? target : graph->first[node];
+      queue[tail++] = target;
+    }
+  }
+  free(queue);
+}
+
+// Groups every node, then walks the dominator tree so a group's
+// retained size only counts members no other member dominates.
+void heap_group(HeapGraph* graph) {
+  int count = graph->count;
+  graph->group = (int*)heap_alloc(sizeof(int) * count);
+  graph->groups = (HeapGroup*)calloc(HEAP_TYPES + count, sizeof(HeapGroup));
+  if ( graph->groups == NULL ) exit(80);
+  int* class_group = (int*)heap_alloc(sizeof(int) * count);
+  for ( int i = 0; i < count; ++i ) class_group[i] = -1;
+  for ( int type = 0; type < HEAP_TYPES; ++type ) graph->groups[type].type = type;
+  graph->group_count = HEAP_TYPES;
+  graph->group[0] = -1;
+  for ( int node = 1; node < count; ++node ) {
+    Object* object = graph->objects[node];
+    int group = object->type < HEAP_TYPES ? (int)object->type : 0;
+    int klass = object->type == OBJ_INSTANCE
+      ? heap_node(graph, (Object*)((ObjectInstance*)object)->klass) : 0;
+    if ( klass > 0 ) {
+      if ( class_group[klass] < 0 ) {
+        class_group[klass] = graph->group_count;
+        graph->groups[graph->group_count++] = (HeapGroup){
+          .type = OBJ_INSTANCE, .klass = ((ObjectInstance*)object)->klass };
+      }
+      group = class_group[klass];
+    }
+    graph->group[node] = group;
+    HeapGroup* entry = &graph->groups[group];
+    ++entry->count;
+    entry->bytes += graph->size[node];
+    if ( graph->number[node] >= 0 ) ++entry->reachable;
+  }
+  free(class_group);
+
+  // Dominator tree children, then a depth first walk counting the
+  // members of each group on the current path.
+  int* child_start = (int*)calloc(count + 1, sizeof(int));
+  int* children = (int*)heap_alloc(sizeof(int) * count);
+  int* active = (int*)calloc(graph->group_count, sizeof(int));
+  int* stack = (int*)heap_alloc(sizeof(int) * count);
+  int* next = (int*)heap_alloc(sizeof(int) * count);
+  if ( child_start == NULL || active == NULL ) exit(80);
+  for ( int node = 1; node < count; ++node )
+    if ( graph->number[node] >= 0 ) ++child_start[graph->idom[node] + 1];
+  for ( int node = 0; node < count; ++node ) child_start[node + 1] += child_start[node];
+  memcpy(next, child_start, sizeof(int) * count);
+  for ( int node = 1; node < count; ++node )
+    if ( graph->number[node] >= 0 ) children[next[graph->idom[node]]++] = node;
+  memcpy(next, child_start, sizeof(int) * count);
+  int depth = 0;
+  stack[depth++] = 0;
+  while ( depth > 0 ) {
+    int node = stack[depth - 1];
+    if ( next[node] < child_start[node + 1] ) {
+      int child = children[next[node]++], group = graph->group[child];
+      if ( active[group]++ == 0 ) graph->groups[group].retained += graph->retained[child];
+      stack[depth++] = child;
+      continue;
+    }
+    if ( node != 0 ) --active[graph->group[node]];
+    --depth;
+  }
+  free(child_start);
+  free(children);
+  free(active);
+  free(stack);
+  free(next);
+}
+
+void heap_analyze(HeapGraph* graph) {
+  *graph = (HeapGraph){ NULL };
+  heap_build(graph);
+  heap_number(graph);
+  heap_dominate(graph);
+  heap_paths(graph);
+  heap_group(graph);
+}
+
+void heap_free(HeapGraph* graph) {
+  free(graph->objects);
+  free(graph->keys);
+  free(graph->key_nodes);
+  free(graph->edge_start);
+  free(graph->edges);
+  free(graph->root_names);
+  free(graph->size);
+  free(graph->retained);
+  free(graph->number);
+  free(graph->order);
+  free(graph->tree_parent);
+  free(graph->idom);
+  free(graph->parent);
+  free(graph->depth);
+  free(graph->first);
+  free(graph->group);
+  free(graph->groups);
+}
+
+void heap_group_name(HeapGroup* group, char* buffer, size_t size) {
+  if ( group->klass != NULL )
+    snprintf(buffer, size, "INSTANCE %s", group->klass->name->chars);
+  else snprintf(buffer, size, "%s", strobjtype(group->type) + 7);
+}
+
+int heap_group_compare(const void* a, const void* b) {
+  const HeapGroup* x = *(HeapGroup* const*)a, * y = *(HeapGroup* const*)b;
+  if ( x->retained != y->retained ) return x->retained < y->retained ? 1 : -1;
+  return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+void heap_census_write(HeapGraph* graph, FILE* out, int top) {
+  uint64_t bytes = 0, reachable_bytes = 0;
+  for ( int node = 1; node < graph->count; ++node ) {
+    bytes += graph->size[node];
+    if ( graph->number[node] >= 0 ) reachable_bytes += graph->size[node];
+  }
+  fprintf(out, "Heap: %d objects, %llu bytes, %d reachable (%llu bytes), %d garbage.\n",
+    graph->count - 1, (unsigned long long)bytes, graph->reachable - 1,
+    (unsigned long long)reachable_bytes, graph->count - graph->reachable);
+  HeapGroup** sorted = (HeapGroup**)heap_alloc(sizeof(HeapGroup*) * graph->group_count);
+  int rows = 0;
+  for ( int i = 0; i < graph->group_count; ++i )
+    if ( graph->groups[i].count ) sorted[rows++] = &graph->groups[i];
+  qsort(sorted, rows, sizeof(HeapGroup*), heap_group_compare);
+  fprintf(out, "%-32s %10s %14s %10s %14s\n", "group", "count", "bytes", "reachable", "retained");
+  for ( int i = 0; i < rows && (top <= 0 || i < top); ++i ) {
+    char name[64];
+    heap_group_name(sorted[i], name, sizeof(name));
+    fprintf(out, "%-32s %10llu %14llu %10llu %14llu\n", name,
+      (unsigned long long)sorted[i]->count, (unsigned long long)sorted[i]->bytes,
+      (unsigned long long)sorted[i]->reachable, (unsigned long long)sorted[i]->retained);
+  }
+  free(sorted);
+}
+
+void heap_describe(Object* object, FILE* out) {
+  switch ( object->type ) {
+  case OBJ_STRING: {
+    ObjectString* string = (ObjectString*)object;
+    fputs("STRING \"", out);
+    for ( int i = 0; i < string->length && i < 32; ++i ) {
+      char c = string->chars[i];
+      fputc(c == '\n' || c == '"' ? ' ' : c, out);
+    }
+    fputs(string->length > 32 ? "...\"" : "\"", out);
+    return;
+  }
+  case OBJ_FUNCTION: {
+    ObjectString* name = ((ObjectFunction*)object)->name;
+    fprintf(out, "FUNCTION %s", name != NULL ? name->chars : "script");
+    return;
+  }
+  case OBJ_CLOSURE: {
+    ObjectString* name = ((ObjectClosure*)object)->function->name;
+    fprintf(out, "CLOSURE %s", name != NULL ? name->chars : "script");
+    return;
+  }
+  case OBJ_CLASS: fprintf(out, "CLASS %s", ((ObjectClass*)object)->name->chars); return;
+  case OBJ_INSTANCE:
+    fprintf(out, "INSTANCE %s", ((ObjectInstance*)object)->klass->name->chars);
+    return;
+  case OBJ_NATIVE: fprintf(out, "NATIVE %s", ((ObjectNative*)object)->name); return;
+  case OBJ_LIST: fprintf(out, "LIST of %d", ((ObjectList*)object)->count); return;
+  case OBJ_F64_ARRAY: fprintf(out, "F64_ARRAY of %d", ((ObjectF64Array*)object)->count); return;
+  case OBJ_MAP: fprintf(out, "MAP of %d", ((ObjectMap*)object)->live); return;
+  case OBJ_READER:
+    fprintf(out, "READER %s %zu bytes", ((ObjectReader*)object)->mapped ? "mapping" : "reading",
+      ((ObjectReader*)object)->size);
+    return;
+  default: fputs(strobjtype(object->type) + 7, out); return;
+  }
+}
+
+// How from refers to to, for retaining paths.
+void heap_edge_label(Object* from, Object* to, FILE* out) {
+  switch ( from->type ) {
+  case OBJ_INSTANCE: {
+    Table* fields = &((ObjectInstance*)from)->fields;
+    for ( int i = 0; i TAB_COMP_OP fields->capacity; ++i ) {
+      Entry* entry = fields->entries + i;
+      if ( entry->key != NULL && IS_OBJECT(entry->value) && AS_OBJECT(entry->value) == to ) {
+        fprintf(out, ".%s", entry->key->chars);
+        return;
+      }
+    }
+    fputs(to->type == OBJ_CLASS ? "class" : "field name", out);
+    return;
+  }
+  case OBJ_CLASS: {
+    Table* methods = &((ObjectClass*)from)->methods;
+    for ( int i = 0; i TAB_COMP_OP methods->capacity; ++i ) {
+      Entry* entry = methods->entries + i;
+      if ( entry->key != NULL && IS_OBJECT(entry->value) && AS_OBJECT(entry->value) == to ) {
+        fprintf(out, "method %s", entry->key->chars);
+        return;
+      }
+    }
+    fputs("name", out);
+    return;
+  }
+  case OBJ_CLOSURE:
+    fputs(to->type == OBJ_FUNCTION ? "function" : "upvalue", out);
+    return;
+  case OBJ_FUNCTION: fputs(to == (Object*)((ObjectFunction*)from)->name ? "name" : "constant", out); return;
+  case OBJ_UPVALUE: fputs(to->type == OBJ_FIBER ? "fiber" : "value", out); return;
+  case OBJ_BOUND_METHOD:
+    fputs(to == (Object*)((ObjectBoundMethod*)from)->method ? "method" : "receiver", out);
+    return;
+  case OBJ_FIBER: fputs(to == (Object*)((ObjectFiber*)from)->caller ? "caller" : "stack", out); return;
+  case OBJ_LIST: {
+    ObjectList* list = (ObjectList*)from;
+    for ( int i = 0; i < list->count; ++i )
+      if ( IS_OBJECT(list->items[i]) && AS_OBJECT(list->items[i]) == to ) {
+        fprintf(out, "[%d]", i);
+        return;
+      }
+    fputs("item", out);
+    return;
+  }
+  case OBJ_MAP: {
+    ObjectMap* map = (ObjectMap*)from;
+    for ( int i = 0; i < map->capacity; ++i ) {
+      Value key = map->entries[i].key, value = map->entries[i].value;
+      if ( IS_NIL(key) || !IS_OBJECT(value) || AS_OBJECT(value) != to ) continue;
+      if ( IS_STRING(key) ) fprintf(out, "[%.*s]", AS_STRING(key)->length, AS_CSTRING(key));
+      else if ( IS_NUMBER(key) ) fprintf(out, "[%g]", AS_NUMBER(key));
+      else fputs("value", out);
+      return;
+    }
+    fputs("key", out);
+    return;
+  }
+  case OBJ_STRING: fputs("view of", out); return;
+  case OBJ_READER: fputs("block", out); return;
+  default: fputs("reference", out); return;
+  }
+}
+
+void heap_path_write(HeapGraph* graph, int node, FILE* out) {
+  int root = graph->first[node], steps = graph->depth[node];
+  ObjectString* name = graph->root_names[root];
+  if ( name != NULL ) fprintf(out, "global %s #%d", name->chars, root);
+  else fprintf(out, "root #%d", root);
+  int shown = steps <= HEAP_PATH_STEPS ? steps - 1 : HEAP_PATH_STEPS - 1;
+  if ( shown < steps - 1 ) fprintf(out, " ... %d steps ...", steps - 1 - shown);
+  int path[HEAP_PATH_STEPS];
+  for ( int step = node, i = shown; i > 0; step = graph->parent[step] ) path[--i] = step;
+  for ( int i = 0; i < shown; ++i ) {
+    fputc(' ', out);
+    heap_edge_label(graph->objects[graph->parent[path[i]]], graph->objects[path[i]], out);
+    fprintf(out, " #%d", path[i]);
+  }
+}
+
+void heap_snapshot_write(HeapGraph* graph, FILE* out) {
+  fputs("# clox heap snapshot\n", out);
+  heap_census_write(graph, out, 0);
+  fputc('\n', out);
+  for ( int node = 1; node < graph->count; ++node ) {
+    fprintf(out, "#%d ", node);
+    heap_describe(graph->objects[node], out);
+    fprintf(out, " size %zu", graph->size[node]);
+    if ( graph->number[node] < 0 ) {
+      fputs(" garbage\n", out);
+      continue;
+    }
+    fprintf(out, " retained %llu dominator #%d\n  path ",
+      (unsigned long long)graph->retained[node], graph->idom[node]);
+    heap_path_write(graph, node, out);
+    fputs("\n  refs", out);
+    for ( int e = graph->edge_start[node]; e < graph->edge_start[node + 1]; ++e )
+      fprintf(out, " #%d", graph->edges[e]);
+    fputc('\n', out);
+  }
+}
+
+// Census of the running VM, must not run during a collection.
+int heap_census(FILE* out) {
+  HeapGraph graph;
+  heap_analyze(&graph);
+  heap_census_write(&graph, out, HEAP_CENSUS_TOP);
+  int reachable = graph.reachable - 1;
+  heap_free(&graph);
+  return reachable;
+}
+
+bool heap_snapshot(const char* path) {
+  FILE* out = fopen(path, "w");
+  if ( out == NULL ) return false;
+  HeapGraph graph;
+  heap_analyze(&graph);
+  heap_snapshot_write(&graph, out);
+  heap_free(&graph);
+  fclose(out);
+  return true;
+}
+
+// Called by the VM at points where the heap is consistent.
+void heap_safepoint() {
+  if ( vm != heap_vm || vm->gc_collection_in_progress ) return;
+  heap_requested = 0;
+  heap_census(stderr);
+  const char* path = getenv("CLOX_HEAP_SNAPSHOT");
+  if ( path == NULL ) return;
+  if ( heap_snapshot(path) ) fprintf(stderr, "Heap: snapshot written to '%s'.\n", path);
+  else fprintf(stderr, "Heap: cannot write '%s'.\n", path);
+}
+
+// SIGUSR1 handler, only raises the flag the VM polls.
+void heap_signal(int signal_number) {
+  heap_requested = 1;
+}
+
+// Dumps instance's heap on SIGUSR1. The handler stays installed and
+// interrupted calls restart, see profile_handler.
+void heap_watch(Vm* instance) {
+  heap_vm = instance;
+  struct sigaction action = { 0 };
+  action.sa_handler = heap_signal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, NULL);
+}
+
+Value heap_census_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 0 ) return ERROR_VAL("Did not expect any arguments.");
+  return NUMBER_VAL(heap_census(stderr));
+}
+
+Value heap_snapshot_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 || !IS_STRING(*args) )
+    return ERROR_VAL("Expected a snapshot path.");
+  if ( !heap_snapshot(string_intern(AS_STRING(*args))->chars) )
+    return ERROR_VAL("Cannot write the snapshot.");
+  return NIL_VAL;
+}
+
+void setup_heap_native() {
+  define_native("heap_census", heap_census_native);
+  define_native("heap_snapshot", heap_snapshot_native);
+}
+
+CLOX_END_DECLS
+
+#endif //_CLOX_HEAP_H
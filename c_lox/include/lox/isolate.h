@@ -0,0 +1,691 @@
+#ifndef _CLOX_ISOLATE_H
+#define _CLOX_ISOLATE_H
+
+#include "common.h"
+#include "object.h"
+#include "cache.h"
+#include <pthread.h>
+
+CLOX_BEG_DECLS
+
+// Isolates are VMs running on their own OS thread. They share no
+// heap: values cross between them as messages through channels and
+// are rebuilt in the receiving VM.
+//
+//   fun worker(jobs, results) { send(results, receive(jobs) * 2); }
+//   var jobs = channel(); var results = channel();
+//   var isolate = spawn(worker, jobs, results);
+//   send(jobs, 21); print receive(results); join(isolate);
+//
+// spawn also accepts a script path, such scripts find their channels
+// by name: channel("jobs") is the same channel in every isolate.
+// Spawned functions see the natives but none of the spawner's globals.
+//
+// Message layout (native endianness, written with the cache.h writers):
+//   value: tag:u8 then nothing (nil, true, false), f64 (MSG_NUMBER),
+//          i32 (MSG_INT), i32 length + bytes (MSG_STRING),
+//          class name + field_count:i32 + (name, value)* (MSG_INSTANCE),
+//          count:i32 + value* (MSG_LIST), count:i32 + f64* (MSG_F64_ARRAY),
+//          count:i32 + (key, value)* (MSG_MAP), i32 index of an instance,
+//          list, array or map seen earlier (MSG_REF), pad4 and a
+//          cache function record (MSG_FUNCTION) or an i32 index into
+//          the message's shared handles (MSG_CHANNEL, MSG_ISOLATE).
+
+typedef enum {
+  MSG_NIL,
+  MSG_TRUE,
+  MSG_FALSE,
+  MSG_NUMBER,
+  MSG_INT,
+  MSG_STRING,
+  MSG_INSTANCE,
+  MSG_REF,
+  MSG_FUNCTION,
+  MSG_CHANNEL,
+  MSG_ISOLATE,
+  MSG_LIST,
+  MSG_F64_ARRAY,
+  MSG_MAP,
+} MessageTag;
+
+struct Shared {
+  int refs;
+  void (*destroy)(Shared*);
+};
+
+typedef struct Message {
+  struct Message* next;
+  ByteBuffer buffer;
+  // Channels and isolates referenced by the message hold a
+  // reference until it is deleted.
+  Shared** shared;
+  int shared_count;
+  int shared_capacity;
+  // Chunks borrow their code from the bytes, see message_read.
+  bool has_function;
+} Message;
+
+struct Channel {
+  Shared shared;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  Message* head;
+  Message* tail;
+  char* name;
+  Channel* next_named;
+};
+
+struct Isolate {
+  Shared shared;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  bool joined;
+  bool failed;
+  char* path;
+  Message start;
+  Message result;
+};
+
+typedef struct {
+  Message* message;
+  Object** seen;
+  int seen_count;
+  int seen_capacity;
+  const char* error;
+} MessageWriter;
+
+typedef struct {
+  CacheReader reader;
+  Message* message;
+  Value* seen;
+  int seen_count;
+  int seen_capacity;
+  const char* error;
+} MessageReader;
+
+// Named channels live as long as the process.
+Channel* named_channels = NULL;
+pthread_mutex_t named_channels_lock = PTHREAD_MUTEX_INITIALIZER;
+
+Shared* shared_retain(Shared* shared) {
+  __atomic_add_fetch(&shared->refs, 1, __ATOMIC_RELAXED);
+  return shared;
+}
+
+void shared_release(Shared* shared) {
+  if ( __atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) == 0 )
+    shared->destroy(shared);
+}
+
+// ---- Messages ----
+
+void message_init(Message* message) {
+  message->next = NULL;
+  buffer_init(&message->buffer);
+  message->shared = NULL;
+  message->shared_count = 0;
+  message->shared_capacity = 0;
+  message->has_function = false;
+}
+
+void message_delete(Message* message) {
+  for ( int i = 0; i < message->shared_count; ++i )
+    shared_release(message->shared[i]);
+  free(message->shared);
+  buffer_delete(&message->buffer);
+  message_init(message);
+}
+
+void message_write_shared(MessageWriter* writer, MessageTag tag, Shared* shared) {
+  Message* message = writer->message;
+  if ( message->shared_count == message->shared_capacity ) {
+    message->shared_capacity = GROW_CAPACITY(message->shared_capacity);
+    message->shared = (Shared**)realloc(message->shared,
+      sizeof(Shared*) * message->shared_capacity);
+    if ( message->shared == NULL ) exit(80);
+  }
+  message->shared[message->shared_count] = shared_retain(shared);
+  cache_write_tag(&message->buffer, tag);
+  cache_write_i32(&message->buffer, message->shared_count++);
+}
+
+void message_write_string(ByteBuffer* buffer, ObjectString* string) {
+  cache_write_i32(buffer, string->length);
+  buffer_write(buffer, string->chars, string->length);
+}
+
+// Writes a reference to an object sent earlier in the message,
+// or remembers it for later ones and returns false.
+bool message_write_seen(MessageWriter* writer, Object* object) {
+  if ( object->is_marked ) {
+    int index = 0;
+    while ( writer->seen[index] != object ) ++index;
+    cache_write_tag(&writer->message->buffer, MSG_REF);
+    cache_write_i32(&writer->message->buffer, index);
+    return true;
+  }
+  if ( writer->seen_count == writer->seen_capacity ) {
+    writer->seen_capacity = GROW_CAPACITY(writer->seen_capacity);
+    writer->seen = (Object**)realloc(writer->seen,
+      sizeof(Object*) * writer->seen_capacity);
+    if ( writer->seen == NULL ) exit(80);
+  }
+  writer->seen[writer->seen_count++] = object;
+  object->is_marked = true;
+  return false;
+}
+
+// Instances and lists are marked while written so shared and cyclic
+// references are sent once, the writer does not allocate so
+// no collection can observe the marks.
+void message_write_value(MessageWriter* writer, Value value) {
+  ByteBuffer* buffer = &writer->message->buffer;
+  if ( writer->error != NULL ) return;
+#ifdef NAN_BOXING_OPT
+  if ( IS_INT(value) ) {
+    cache_write_tag(buffer, MSG_INT);
+    cache_write_i32(buffer, AS_INT(value));
+    return;
+  }
+#endif // NAN_BOXING_OPT
+  if ( IS_NIL(value) ) cache_write_tag(buffer, MSG_NIL);
+  else if ( IS_BOOL(value) )
+    cache_write_tag(buffer, AS_BOOL(value) ? MSG_TRUE : MSG_FALSE);
+  else if ( IS_NUMBER(value) ) {
+    double number = AS_NUMBER(value);
+    cache_write_tag(buffer, MSG_NUMBER);
+    buffer_write(buffer, &number, sizeof(number));
+  } else if ( !IS_OBJECT(value) ) writer->error = "Cannot send this value.";
+  else switch ( OBJECT_TYPE(value) ) {
+  case OBJ_STRING:
+    cache_write_tag(buffer, MSG_STRING);
+    message_write_string(buffer, AS_STRING(value));
+    break;
+  case OBJ_CHANNEL:
+    message_write_shared(writer, MSG_CHANNEL, AS_HANDLE(value)->shared);
+    break;
+  case OBJ_ISOLATE:
+    message_write_shared(writer, MSG_ISOLATE, AS_HANDLE(value)->shared);
+    break;
+  case OBJ_CLOSURE: {
+    ObjectClosure* closure = AS_CLOSURE(value);
+    if ( closure->upvalue_count ) {
+      writer->error = "Cannot send closures that capture variables.";
+      break;
+    }
+    cache_write_tag(buffer, MSG_FUNCTION);
+    cache_write_pad(buffer);
+    if ( !cache_write_function(buffer, closure->function) ) {
+      writer->error = "Cannot send functions with this constant.";
+      break;
+    }
+    writer->message->has_function = true;
+    break;
+  }
+  case OBJ_LIST: {
+    if ( message_write_seen(writer, AS_OBJECT(value)) ) break;
+    ObjectList* list = AS_LIST(value);
+    cache_write_tag(buffer, MSG_LIST);
+    cache_write_i32(buffer, list->count);
+    for ( int i = 0; i < list->count; ++i )
+      message_write_value(writer, list->items[i]);
+    break;
+  }
+  case OBJ_F64_ARRAY: {
+    if ( message_write_seen(writer, AS_OBJECT(value)) ) break;
+    ObjectF64Array* array = AS_F64_ARRAY(value);
+    cache_write_tag(buffer, MSG_F64_ARRAY);
+    cache_write_i32(buffer, array->count);
+    if ( array->count )
+      buffer_write(buffer, array->values, sizeof(double) * array->count);
+    break;
+  }
+  case OBJ_MAP: {
+    if ( message_write_seen(writer, AS_OBJECT(value)) ) break;
+    ObjectMap* map = AS_MAP(value);
+    cache_write_tag(buffer, MSG_MAP);
+    cache_write_i32(buffer, map->live);
+    for ( int i = map_next(map, 0); i >= 0; i = map_next(map, i + 1) ) {
+      message_write_value(writer, map->entries[i].key);
+      message_write_value(writer, map->entries[i].value);
+    }
+    break;
+  }
+  case OBJ_INSTANCE: {
+    if ( message_write_seen(writer, AS_OBJECT(value)) ) break;
+    ObjectInstance* instance = AS_INSTANCE(value);
+    cache_write_tag(buffer, MSG_INSTANCE);
+    message_write_string(buffer, instance->klass->name);
+    // count includes tombstones, the live fields are counted here.
+    int32_t count = 0;
+    Entry* entry;
+    for ( int i = 0; i TAB_COMP_OP instance->fields.capacity; ++i )
+      count += instance->fields.entries[i].key != NULL;
+    cache_write_i32(buffer, count);
+    for ( int i = 0; i TAB_COMP_OP instance->fields.capacity; ++i ) {
+      entry = instance->fields.entries + i;
+      if ( entry->key == NULL ) continue;
+      message_write_string(buffer, entry->key);
+      message_write_value(writer, entry->value);
+    }
+    break;
+  }
+  default: writer->error = "Cannot send classes, natives, methods or readers."; break;
+  }
+}
+
+// Appends value to message, returns an error message or NULL.
+const char* message_write(Message* message, Value value) {
+  MessageWriter writer = { message, NULL, 0, 0, NULL };
+  message_write_value(&writer, value);
+  for ( int i = 0; i < writer.seen_count; ++i )
+    writer.seen[i]->is_marked = false;
+  free(writer.seen);
+  return writer.error;
+}
+
+// Reads straight from the message bytes, functions read borrow
+// their code from it so the caller keeps the message alive for
+// as long as they may run, see parallel.h.
+void message_reader_borrow(MessageReader* reader, Message* message) {
+  uint8_t* bytes = message->buffer.bytes;
+  reader->reader = (CacheReader){ bytes, bytes, bytes + message->buffer.count };
+  reader->message = message;
+  reader->seen = NULL;
+  reader->seen_count = 0;
+  reader->seen_capacity = 0;
+  reader->error = NULL;
+  // Nothing read is reachable until the caller stores it.
+  gc_pause();
+}
+
+void message_reader_init(MessageReader* reader, Message* message) {
+  message_reader_borrow(reader, message);
+  // Chunks outlive the message, give the vm its own copy to borrow from.
+  if ( message->has_function ) {
+    uint8_t* bytes = (uint8_t*)malloc(message->buffer.count);
+    if ( bytes == NULL ) exit(80);
+    memcpy(bytes, message->buffer.bytes, message->buffer.count);
+    cache_image_adopt(&vm->cache_images, bytes, message->buffer.count, false);
+    reader->reader = (CacheReader){ bytes, bytes, bytes + message->buffer.count };
+  }
+}
+
+void message_reader_delete(MessageReader* reader) {
+  free(reader->seen);
+  gc_resume();
+}
+
+ObjectString* message_read_string(MessageReader* reader) {
+  int32_t length;
+  const uint8_t* chars;
+  if ( !cache_read(&reader->reader, &length, sizeof(length)) || length < 0 ||
+    (chars = cache_borrow(&reader->reader, length)) == NULL ) return NULL;
+  return copy_string((const char*)chars, length);
+}
+
+void message_reader_see(MessageReader* reader, Value value) {
+  if ( reader->seen_count == reader->seen_capacity ) {
+    reader->seen_capacity = GROW_CAPACITY(reader->seen_capacity);
+    reader->seen = (Value*)realloc(reader->seen, sizeof(Value) * reader->seen_capacity);
+    if ( reader->seen == NULL ) exit(80);
+  }
+  reader->seen[reader->seen_count++] = value;
+}
+
+Value message_read_value(MessageReader* reader) {
+  uint8_t tag;
+  if ( reader->error != NULL ) return NIL_VAL;
+  if ( !cache_read(&reader->reader, &tag, 1) ) goto corrupt;
+  switch ( tag ) {
+  case MSG_NIL: return NIL_VAL;
+  case MSG_TRUE: return BOOL_VAL(true);
+  case MSG_FALSE: return BOOL_VAL(false);
+  case MSG_NUMBER: {
+    double number;
+    if ( !cache_read(&reader->reader, &number, sizeof(number)) ) goto corrupt;
+    return NUMBER_VAL(number);
+  }
+  case MSG_INT: {
+    int32_t number;
+    if ( !cache_read(&reader->reader, &number, sizeof(number)) ) goto corrupt;
+#ifdef NAN_BOXING_OPT
+    return INT_VAL(number);
+#else
+    return NUMBER_VAL((double)number);
+#endif // NAN_BOXING_OPT
+  }
+  case MSG_STRING: {
+    ObjectString* string = message_read_string(reader);
+    if ( string == NULL ) goto corrupt;
+    return OBJECT_VAL(string);
+  }
+  case MSG_REF: {
+    int32_t index;
+    if ( !cache_read(&reader->reader, &index, sizeof(index)) ||
+      index < 0 || index >= reader->seen_count ) goto corrupt;
+    return reader->seen[index];
+  }
+  case MSG_CHANNEL:
+  case MSG_ISOLATE: {
+    int32_t index;
+    if ( !cache_read(&reader->reader, &index, sizeof(index)) ||
+      index < 0 || index >= reader->message->shared_count ) goto corrupt;
+    Shared* shared = shared_retain(reader->message->shared[index]);
+    return OBJECT_VAL(new_handle(tag == MSG_CHANNEL ? OBJ_CHANNEL : OBJ_ISOLATE, shared));
+  }
+  case MSG_FUNCTION: {
+    if ( !cache_read_pad(&reader->reader) ) goto corrupt;
+    ObjectFunction* function = cache_read_function(&reader->reader);
+    if ( function == NULL ) goto corrupt;
+    return OBJECT_VAL(new_closure(function));
+  }
+  case MSG_INSTANCE: {
+    // Classes are matched by name, an unknown class
+    // gets a method-less stand-in with the same name.
+    ObjectString* name = message_read_string(reader);
+    if ( name == NULL ) goto corrupt;
+    Value klass;
+    if ( !table_get(&vm->globals, name, &klass) || !IS_CLASS(klass) )
+      klass = OBJECT_VAL(new_class(name));
+    ObjectInstance* instance = new_instance(AS_CLASS(klass));
+    message_reader_see(reader, OBJECT_VAL(instance));
+    int32_t count;
+    if ( !cache_read(&reader->reader, &count, sizeof(count)) ) goto corrupt;
+    for ( int32_t i = 0; i < count; ++i ) {
+      ObjectString* field = message_read_string(reader);
+      if ( field == NULL ) goto corrupt;
+      Value value = message_read_value(reader);
+      if ( reader->error != NULL ) return NIL_VAL;
+      table_set(&instance->fields, field, value);
+    }
+    return OBJECT_VAL(instance);
+  }
+  case MSG_LIST: {
+    int32_t count;
+    if ( !cache_read(&reader->reader, &count, sizeof(count)) || count < 0 ) goto corrupt;
+    ObjectList* list = new_list(NULL, 0);
+    message_reader_see(reader, OBJECT_VAL(list));
+    for ( int32_t i = 0; i < count; ++i ) {
+      Value item = message_read_value(reader);
+      if ( reader->error != NULL ) return NIL_VAL;
+      list_append(list, item);
+    }
+    return OBJECT_VAL(list);
+  }
+  case MSG_F64_ARRAY: {
+    int32_t count;
+    const uint8_t* values;
+    if ( !cache_read(&reader->reader, &count, sizeof(count)) || count < 0 ||
+      (values = cache_borrow(&reader->reader, sizeof(double) * (size_t)count)) == NULL )
+      goto corrupt;
+    ObjectF64Array* array = new_f64_array(count);
+    message_reader_see(reader, OBJECT_VAL(array));
+    if ( count ) memcpy(array->values, values, sizeof(double) * count);
+    return OBJECT_VAL(array);
+  }
+  case MSG_MAP: {
+    int32_t count;
+    // Every key and value takes at least its tag byte.
+    if ( !cache_read(&reader->reader, &count, sizeof(count)) || count < 0 ||
+      count > (reader->reader.end - reader->reader.current) / 2 ) goto corrupt;
+    ObjectMap* map = new_map();
+    message_reader_see(reader, OBJECT_VAL(map));
+    map_reserve(map, count);
+    for ( int32_t i = 0; i < count; ++i ) {
+      Value key = message_read_value(reader);
+      if ( reader->error != NULL ) return NIL_VAL;
+      Value value = message_read_value(reader);
+      if ( reader->error != NULL ) return NIL_VAL;
+      if ( map_key_error(key) != NULL ) goto corrupt;
+      map_set(map, key, value);
+    }
+    return OBJECT_VAL(map);
+  }
+  }
+corrupt:
+  reader->error = "Corrupted message.";
+  return NIL_VAL;
+}
+
+// ---- Channels ----
+
+void channel_destroy(Shared* shared) {
+  Channel* channel = (Channel*)shared;
+  Message* message;
+  while ( channel->head != NULL ) {
+    message = channel->head;
+    channel->head = message->next;
+    message_delete(message);
+    free(message);
+  }
+  pthread_mutex_destroy(&channel->lock);
+  pthread_cond_destroy(&channel->ready);
+  free(channel->name);
+  free(channel);
+}
+
+Channel* channel_new(const char* name, int length) {
+  Channel* channel = (Channel*)malloc(sizeof(Channel));
+  if ( channel == NULL ) exit(80);
+  channel->shared = (Shared){ 1, channel_destroy };
+  pthread_mutex_init(&channel->lock, NULL);
+  pthread_cond_init(&channel->ready, NULL);
+  channel->head = channel->tail = NULL;
+  channel->name = NULL;
+  channel->next_named = NULL;
+  if ( name != NULL ) {
+    channel->name = (char*)malloc(length + 1);
+    if ( channel->name == NULL ) exit(80);
+    memcpy(channel->name, name, length);
+    channel->name[length] = '\0';
+  }
+  return channel;
+}
+
+Channel* channel_named(const char* name, int length) {
+  pthread_mutex_lock(&named_channels_lock);
+  Channel* channel = named_channels;
+  while ( channel != NULL &&
+    (strlen(channel->name) != (size_t)length || memcmp(channel->name, name, length)) )
+    channel = channel->next_named;
+  if ( channel == NULL ) {
+    channel = channel_new(name, length);
+    channel->next_named = named_channels;
+    named_channels = channel;
+  }
+  shared_retain(&channel->shared);
+  pthread_mutex_unlock(&named_channels_lock);
+  return channel;
+}
+
+void channel_send(Channel* channel, Message* message) {
+  pthread_mutex_lock(&channel->lock);
+  if ( channel->tail == NULL ) channel->head = message;
+  else channel->tail->next = message;
+  channel->tail = message;
+  pthread_cond_signal(&channel->ready);
+  pthread_mutex_unlock(&channel->lock);
+}
+
+Message* channel_receive(Channel* channel) {
+  pthread_mutex_lock(&channel->lock);
+  while ( channel->head == NULL )
+    pthread_cond_wait(&channel->ready, &channel->lock);
+  Message* message = channel->head;
+  channel->head = message->next;
+  if ( channel->head == NULL ) channel->tail = NULL;
+  pthread_mutex_unlock(&channel->lock);
+  return message;
+}
+
+void print_channel(Channel* channel) {
+  if ( channel->name == NULL ) output_string("<channel>");
+  else output_printf("<channel %s>", channel->name);
+}
+
+// ---- Isolates ----
+
+void isolate_destroy(Shared* shared) {
+  Isolate* isolate = (Isolate*)shared;
+  if ( !isolate->joined ) pthread_detach(isolate->thread);
+  pthread_mutex_destroy(&isolate->lock);
+  message_delete(&isolate->start);
+  message_delete(&isolate->result);
+  free(isolate->path);
+  free(isolate);
+}
+
+// Runs the spawned function, start holds it followed by
+// the argument count and the arguments.
+bool isolate_call(Isolate* isolate) {
+  MessageReader reader;
+  message_reader_init(&reader, &isolate->start);
+  int32_t arg_count = 0;
+  stack_push(message_read_value(&reader));
+  if ( !cache_read(&reader.reader, &arg_count, sizeof(arg_count)) )
+    reader.error = "Corrupted message.";
+  for ( int32_t i = 0; i < arg_count && reader.error == NULL; ++i )
+    stack_push(message_read_value(&reader));
+  message_reader_delete(&reader);
+  if ( reader.error != NULL ) {
+    fprintf(stderr, "Isolate: %s\n", reader.error);
+    return false;
+  }
+  if ( !call_value(stack_peek(arg_count), arg_count) || run() != INTERPRET_OKAY )
+    return false;
+  const char* error = message_write(&isolate->result, stack_pop());
+  if ( error != NULL ) fprintf(stderr, "Isolate result: %s\n", error);
+  return error == NULL;
+}
+
+void* isolate_main(void* argument) {
+  Isolate* isolate = (Isolate*)argument;
+  Vm* worker = (Vm*)malloc(sizeof(Vm));
+  if ( worker == NULL ) exit(80);
+  vm_init(worker);
+  if ( isolate->path != NULL ) isolate->failed = run_file(worker, isolate->path) != 0;
+  else isolate->failed = !isolate_call(isolate);
+  vm_delete(worker);
+  free(worker);
+  shared_release(&isolate->shared);
+  return NULL;
+}
+
+// ---- Natives ----
+
+Value channel_native(Vm* vm, int arg_count, Value* args) {
+  Channel* channel;
+  if ( arg_count == 0 ) channel = channel_new(NULL, 0);
+  else if ( arg_count == 1 && IS_STRING(*args) )
+    channel = channel_named(AS_CSTRING(*args), AS_STRING(*args)->length);
+  else return ERROR_VAL("Expected no arguments or a channel name.");
+  return OBJECT_VAL(new_handle(OBJ_CHANNEL, &channel->shared));
+}
+
+Value send_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 2 || !IS_CHANNEL(args[0]) )
+    return ERROR_VAL("Expected a channel and a value.");
+  Message* message = (Message*)malloc(sizeof(Message));
+  if ( message == NULL ) exit(80);
+  message_init(message);
+  const char* error = message_write(message, args[1]);
+  if ( error != NULL ) {
+    message_delete(message);
+    free(message);
+    return ERROR_VAL(error);
+  }
+  // Lines printed before the send come out before the receiver's.
+  output_flush();
+  channel_send(AS_CHANNEL(args[0]), message);
+  return NIL_VAL;
+}
+
+// Blocks until a message arrives.
+Value receive_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 || !IS_CHANNEL(*args) )
+    return ERROR_VAL("Expected a channel.");
+  Message* message = channel_receive(AS_CHANNEL(*args));
+  MessageReader reader;
+  message_reader_init(&reader, message);
+  Value value = message_read_value(&reader);
+  message_reader_delete(&reader);
+  message_delete(message);
+  free(message);
+  return reader.error == NULL ? value : ERROR_VAL(reader.error);
+}
+
+Value spawn_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count == 0 || !(IS_CLOSURE(*args) || IS_STRING(*args)) )
+    return ERROR_VAL("Expected a function or a script path.");
+  if ( IS_STRING(*args) && arg_count > 1 )
+    return ERROR_VAL("Scripts take no arguments, use named channels.");
+  if ( IS_STRING(*args) && access(string_intern(AS_STRING(*args))->chars, R_OK) )
+    return ERROR_VAL("Cannot open script.");
+  if ( IS_CLOSURE(*args) && UNWRAP_CLOSURE(*args)->arity != arg_count - 1 )
+    return ERROR_VAL("Argument count does not match the function arity.");
+  Isolate* isolate = (Isolate*)malloc(sizeof(Isolate));
+  if ( isolate == NULL ) exit(80);
+  // One reference for the handle and one for the thread.
+  isolate->shared = (Shared){ 2, isolate_destroy };
+  pthread_mutex_init(&isolate->lock, NULL);
+  isolate->joined = false;
+  isolate->failed = false;
+  isolate->path = NULL;
+  message_init(&isolate->start);
+  message_init(&isolate->result);
+  const char* error = NULL;
+  if ( IS_STRING(*args) ) {
+    isolate->path = (char*)malloc(AS_STRING(*args)->length + 1);
+    if ( isolate->path == NULL ) exit(80);
+    memcpy(isolate->path, AS_CSTRING(*args), AS_STRING(*args)->length);
+    isolate->path[AS_STRING(*args)->length] = '\0';
+  } else {
+    error = message_write(&isolate->start, *args);
+    cache_write_i32(&isolate->start.buffer, arg_count - 1);
+    for ( int i = 1; i < arg_count && error == NULL; ++i )
+      error = message_write(&isolate->start, args[i]);
+  }
+  output_flush();
+  if ( error == NULL && pthread_create(&isolate->thread, NULL, isolate_main, isolate) )
+    error = "Could not start a thread.";
+  if ( error != NULL ) {
+    isolate->joined = true;
+    isolate_destroy(&isolate->shared);
+    return ERROR_VAL(error);
+  }
+  return OBJECT_VAL(new_handle(OBJ_ISOLATE, &isolate->shared));
+}
+
+// Waits for the isolate and returns a copy of its result, any
+// number of isolates holding the handle may join it.
+Value join_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 || !IS_ISOLATE(*args) )
+    return ERROR_VAL("Expected an isolate.");
+  Isolate* isolate = AS_ISOLATE(*args);
+  pthread_mutex_lock(&isolate->lock);
+  if ( !isolate->joined ) {
+    pthread_join(isolate->thread, NULL);
+    isolate->joined = true;
+  }
+  pthread_mutex_unlock(&isolate->lock);
+  if ( isolate->failed ) return ERROR_VAL("Isolate failed.");
+  if ( isolate->path != NULL ) return NIL_VAL;
+  MessageReader reader;
+  message_reader_init(&reader, &isolate->result);
+  Value value = message_read_value(&reader);
+  message_reader_delete(&reader);
+  return reader.error == NULL ? value : ERROR_VAL(reader.error);
+}
+
+void setup_isolate_native() {
+  define_native("channel", channel_native);
+  define_native("send", send_native);
+  define_native("receive", receive_native);
+  define_native("spawn", spawn_native);
+  define_native("join", join_native);
+}
+
+CLOX_END_DECLS
+
+#endif //_CLOX_ISOLATE_H
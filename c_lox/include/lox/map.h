@@ -0,0 +1,210 @@
+#ifndef _CLOX_MAP_H
+#define _CLOX_MAP_H
+
+#include "common.h"
+#include "object.h"
+#include <math.h>
+
+CLOX_BEG_DECLS
+
+// Maps: hash maps keyed by numbers, strings and object identities.
+//
+//   var ages = map();
+//   ages["ann"] = 31;
+//   ages[7] = "seven";
+//   for (var key in ages) print key;
+//   print length(ages);                // 2
+//
+// A missing key reads as nil, has() tells the two apart. Numbers are
+// keys by value (1 and 1.0 are one key), strings by their characters
+// and everything else by identity, nil and nan are not keys. for-in
+// visits the keys in slot order, keys added while iterating may or
+// may not be visited.
+//
+// Slots are probed linearly like a Table's, deletes leave tombstones.
+// A delete in front of a free slot frees its run of tombstones, and a
+// map filled up by tombstones is rehashed rather than grown.
+
+#define MAP_MIN_CAPACITY 8
+
+ObjectMap* new_map() {
+  ObjectMap* map = ALLOCATE_OBJECT(ObjectMap, OBJ_MAP);
+  map->entries = NULL;
+  map->count = 0;
+  map->live = 0;
+  map->capacity = 0;
+  return map;
+}
+
+const char* map_key_error(Value key) {
+  if ( IS_NIL(key) ) return "Map keys cannot be nil.";
+  if ( IS_NUMBER(key) && isnan(AS_NUMBER(key)) ) return "Map keys cannot be nan.";
+  return NULL;
+}
+
+uint64_t map_hash(Value key) {
+  uint64_t bits;
+  if ( IS_NUMBER(key) ) {
+    double number = AS_NUMBER(key) + 0.0; // -0 and 0 are one key.
+    memcpy(&bits, &number, sizeof(bits));
+  } else if ( IS_STRING(key) ) bits = string_hash(AS_STRING(key));
+  else if ( IS_OBJECT(key) ) bits = (uintptr_t)AS_OBJECT(key);
+  else bits = AS_BOOL(key);
+  // Slots are picked by the low bits, which are weak in all three.
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdu;
+  return bits ^ (bits >> 33);
+}
+
+MapEntry* map_find(MapEntry* entries, int capacity, Value key) {
+  uint32_t mask = capacity - 1, index = map_hash(key) & mask;
+  MapEntry* tombstone = NULL;
+  for ( ;; index = (index + 1) & mask ) {
+    MapEntry* entry = entries + index;
+    if ( IS_NIL(entry->key) ) {
+      if ( IS_NIL(entry->value) ) return tombstone ? tombstone : entry;
+      if ( tombstone == NULL ) tombstone = entry;
+    } else if ( values_equal(entry->key, key) ) return entry;
+  }
+}
+
+// Smallest capacity holding count entries.
+int map_capacity_for(int count) {
+  int capacity = MAP_MIN_CAPACITY;
+  while ( capacity * TABLE_MAX_LOAD < count ) capacity *= 2;
+  return capacity;
+}
+
+// Rehashes the entries into capacity slots, dropping the tombstones.
+// The map must be reachable, allocating may collect.
+void map_adjust_cap(ObjectMap* map, int capacity) {
+  MapEntry* entries = ALLOCATE(MapEntry, capacity);
+  for ( int i = 0; i < capacity; ++i )
+    entries[i] = (MapEntry){ NIL_VAL, NIL_VAL };
+  for ( int i = 0; i < map->capacity; ++i ) {
+    MapEntry* entry = map->entries + i;
+    if ( !IS_NIL(entry->key) ) *map_find(entries, capacity, entry->key) = *entry;
+  }
+  FREE_ARRAY(MapEntry, map->entries, map->capacity);
+  map->entries = entries;
+  map->capacity = capacity;
+  map->count = map->live;
+}
+
+// Makes room for count entries at once, bulk inserts never rehash.
+void map_reserve(ObjectMap* map, int count) {
+  if ( map->count - map->live + count > map->capacity * TABLE_MAX_LOAD )
+    map_adjust_cap(map, map_capacity_for(count));
+}
+
+bool map_get(ObjectMap* map, Value key, Value* value) {
+  if ( map->live == 0 ) return false;
+  MapEntry* entry = map_find(map->entries, map->capacity, key);
+  if ( IS_NIL(entry->key) ) return false;
+  *value = entry->value;
+  return true;
+}
+
+// Returns whether key is new, key and value must be reachable.
+bool map_set(ObjectMap* map, Value key, Value value) {
+  if ( map->count + 1 > map->capacity * TABLE_MAX_LOAD )
+    // Grows, or shrinks when tombstones rather than entries filled it.
+    map_adjust_cap(map, map_capacity_for(2 * (map->live + 1)));
+  // A view key would keep all of its owner alive. Interning comes
+  // last, nothing may collect the copy before it is stored.
+  if ( IS_STRING(key) && AS_STRING(key)->owner != NULL )
+    key = OBJECT_VAL(string_intern(AS_STRING(key)));
+  MapEntry* entry = map_find(map->entries, map->capacity, key);
+  bool new_key = IS_NIL(entry->key);
+  if ( new_key ) {
+    if ( IS_NIL(entry->value) ) ++map->count;
+    ++map->live;
+  }
+  *entry = (MapEntry){ key, value };
+  return new_key;
+}
+
+bool map_delete(ObjectMap* map, Value key) {
+  if ( map->live == 0 ) return false;
+  MapEntry* entry = map_find(map->entries, map->capacity, key);
+  if ( IS_NIL(entry->key) ) return false;
+  *entry = (MapEntry){ NIL_VAL, TRUE_VAL };
+  --map->live;
+  // No probe goes past a free slot, the tombstones right before it
+  // end no search and can be freed too.
+  uint32_t mask = map->capacity - 1, index = (uint32_t)(entry - map->entries);
+  MapEntry* next = map->entries + ((index + 1) & mask);
+  if ( !IS_NIL(next->key) || !IS_NIL(next->value) ) return true;
+  for ( ; IS_NIL(map->entries[index].key) && !IS_NIL(map->entries[index].value);
+    index = (index - 1) & mask ) {
+    map->entries[index].value = NIL_VAL;
+    --map->count;
+  }
+  return true;
+}
+
+// First slot holding an entry from index on, -1 past the last one.
+int map_next(ObjectMap* map, int index) {
+  for ( ; index < map->capacity; ++index )
+    if ( !IS_NIL(map->entries[index].key) ) return index;
+  return -1;
+}
+
+Value map_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 0 ) return ERROR_VAL("Did not expect any arguments.");
+  return OBJECT_VAL(new_map());
+}
+
+Value has_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 2 || !IS_MAP(args[0]) ) return ERROR_VAL("Expected a map and a key.");
+  Value value;
+  return BOOL_VAL(map_get(AS_MAP(args[0]), args[1], &value));
+}
+
+// delete(map, key) returns whether the key was there.
+Value delete_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 2 || !IS_MAP(args[0]) ) return ERROR_VAL("Expected a map and a key.");
+  return BOOL_VAL(map_delete(AS_MAP(args[0]), args[1]));
+}
+
+// keys(map) lists the keys in for-in order.
+Value keys_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 || !IS_MAP(*args) ) return ERROR_VAL("Expected a map.");
+  ObjectMap* map = AS_MAP(*args);
+  Value* keys = (Value*)malloc(sizeof(Value) * (map->live + 1));
+  if ( keys == NULL ) exit(80);
+  int count = 0;
+  for ( int i = map_next(map, 0); i >= 0; i = map_next(map, i + 1) )
+    keys[count++] = map->entries[i].key;
+  ObjectList* list = new_list(keys, count);
+  free(keys);
+  return OBJECT_VAL(list);
+}
+
+// merge(to, from) copies the entries of from into to, returns to.
+Value merge_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 2 || !IS_MAP(args[0]) || !IS_MAP(args[1]) )
+    return ERROR_VAL("Expected two maps.");
+  ObjectMap* to = AS_MAP(args[0]), * from = AS_MAP(args[1]);
+  if ( to->live > INT32_MAX / 2 - from->live ) return ERROR_VAL("Map is full.");
+  // Keys of from already in to need no room, but sizing for
+  // all of them keeps the loop free of rehashes.
+  map_reserve(to, to->live + from->live);
+  for ( int i = map_next(from, 0); i >= 0; i = map_next(from, i + 1) )
+    map_set(to, from->entries[i].key, from->entries[i].value);
+  return args[0];
+}
+
+void setup_map_native() {
+  define_native("map", map_native);
+  define_native("has", has_native);
+  define_native("delete", delete_native);
+  define_native("keys", keys_native);
+  define_native("merge", merge_native);
+}
+
+#undef MAP_MIN_CAPACITY
+
+CLOX_END_DECLS
+
+#endif //_CLOX_MAP_H
@@ -22,12 +22,21 @@ CLOX_BEG_DECLS
 
 void collect_garbage();
 void update_gc_state(size_t old_size, size_t new_size);
+bool gc_paused();
+void gc_pause();
+void gc_resume();
+#ifdef CLOX_ALLOC_STATS
+void alloc_stats_bytes(size_t);
+#endif // CLOX_ALLOC_STATS
 
 void* reallocate(void* ptr, size_t osize, size_t nsize) {
   update_gc_state(osize, nsize);
 #ifdef CLOX_GC_STRESS
-  if ( nsize > osize ) collect_garbage();
+  if ( nsize > osize && !gc_paused() ) collect_garbage();
 #endif // CLOX_GC_STRESS
+#ifdef CLOX_ALLOC_STATS
+  if ( nsize > osize ) alloc_stats_bytes(nsize - osize);
+#endif // CLOX_ALLOC_STATS
   // puts("~ realloc: start");
   if ( nsize == 0 ) {
     free(ptr);
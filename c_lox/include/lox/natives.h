@@ -6,25 +6,170 @@
 #include "time.h"
 #include "object.h"
 #include "unistd.h"
+#include <errno.h>
 
 CLOX_BEG_DECLS
 
-long double start_time();
 void define_native(const char*, NativeFn);
+void setup_isolate_native();
+void setup_parallel_native();
+void setup_fiber_native();
+void setup_event_loop_native();
+void setup_heap_native();
+void setup_f64_array_native();
+void setup_map_native();
+void setup_reader_native();
+void setup_slice_native();
+bool in_task();
+Value loop_sleep(double);
+void vm_safepoint();
+bool call_nested(int);
+Value stack_peek(int);
+extern const char call_failed[];
 
-Value clock_native(int arg_count, Value* args) {
+// Monotonic nanoseconds, wall clock ones where POSIX clocks are hidden.
+uint64_t clock_nanoseconds() {
+  struct timespec now;
+#ifdef CLOCK_MONOTONIC
+  clock_gettime(CLOCK_MONOTONIC, &now);
+#else
+  timespec_get(&now, TIME_UTC);
+#endif // CLOCK_MONOTONIC
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+// Seconds since the VM started.
+Value clock_native(Vm* vm, int arg_count, Value* args) {
   if ( arg_count != 0 )
     return ERROR_VAL("Did not expect any arguments.");
-  // My clock.
-  return NUMBER_VAL((long double)time(NULL) - start_time());
-  // For some reason clock doesn't work if I call sleep_native
-  // return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+  return NUMBER_VAL((clock_nanoseconds() - vm->start_time) / 1e9);
+}
+
+// Nanoseconds since the VM started.
+Value clock_ns_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 0 )
+    return ERROR_VAL("Did not expect any arguments.");
+  return NUMBER_VAL((double)(clock_nanoseconds() - vm->start_time));
+}
+
+Value string_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 ) return ERROR_VAL("Expected one value.");
+  char buffer[NUMBER_FORMAT_MAX];
+  int length;
+  if ( IS_STRING(*args) ) return *args;
+  if ( IS_NIL(*args) ) length = snprintf(buffer, sizeof(buffer), "nil");
+  else if ( IS_BOOL(*args) ) length = snprintf(buffer, sizeof(buffer), AS_BOOL(*args) ? "true" : "false");
+  else if ( IS_NUMBER(*args) ) length = number_format(AS_NUMBER(*args), buffer);
+  else return ERROR_VAL("Expected a number, string, boolean or nil.");
+  return OBJECT_VAL(copy_string(buffer, length));
+}
+
+Value length_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 ) return ERROR_VAL("Expected a list, an array, a map or a string.");
+  if ( IS_LIST(*args) ) return int_value(AS_LIST(*args)->count);
+  if ( IS_STRING(*args) ) return int_value(AS_STRING(*args)->length);
+  if ( IS_F64_ARRAY(*args) ) return int_value(AS_F64_ARRAY(*args)->count);
+  if ( IS_MAP(*args) ) return int_value(AS_MAP(*args)->live);
+  return ERROR_VAL("Expected a list, an array, a map or a string.");
+}
+
+// push(list, value) appends value, returns the new length.
+Value push_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 2 || !IS_LIST(args[0]) )
+    return ERROR_VAL("Expected a list and a value.");
+  ObjectList* list = AS_LIST(args[0]);
+  if ( list->count == INT32_MAX ) return ERROR_VAL("List is full.");
+  list_append(list, args[1]);
+  return int_value(list->count);
+}
+
+// pop(list) removes and returns the last item.
+Value pop_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 || !IS_LIST(*args) ) return ERROR_VAL("Expected a list.");
+  ObjectList* list = AS_LIST(*args);
+  if ( list->count == 0 ) return ERROR_VAL("Cannot pop from an empty list.");
+  return list->items[--list->count];
 }
 
-Value exit_native(int arg_count, Value* args) {
+// bench(fn, iterations, repetitions = BENCH_REPETITIONS) calls fn
+// iterations times per repetition, after one untimed repetition to
+// warm up. Returns a Bench instance with the nanoseconds per call of
+// the repetitions: min, max, mean, median, p10 and p90, along with
+// iterations and repetitions. Times include the call from C.
+#define BENCH_REPETITIONS 11
+#define BENCH_REPETITIONS_MAX 1000
+#define BENCH_ITERATIONS_MAX 1e12
+
+// Whether value is a whole count in [1, BENCH_ITERATIONS_MAX].
+bool bench_count(Value value) {
+  return IS_NUMBER(value) && AS_NUMBER(value) >= 1 && AS_NUMBER(value) <= BENCH_ITERATIONS_MAX
+    && AS_NUMBER(value) == (int64_t)AS_NUMBER(value);
+}
+
+int bench_compare(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Nearest rank percentile of sorted samples.
+double bench_percentile(double* samples, int count, int percent) {
+  int rank = (percent * count + 99) / 100;
+  return samples[rank > 0 ? rank - 1 : 0];
+}
+
+void bench_field(ObjectInstance* result, const char* name, double value) {
+  stack_push(OBJECT_VAL(copy_string(name, strlen(name))));
+  table_set(&result->fields, AS_STRING(stack_peek(0)), NUMBER_VAL(value));
+  stack_pop();
+}
+
+Value bench_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count < 2 || arg_count > 3 || !IS_OBJECT(args[0]) || !bench_count(args[1])
+    || (arg_count == 3 && (!bench_count(args[2]) || AS_NUMBER(args[2]) > BENCH_REPETITIONS_MAX)) )
+    return ERROR_VAL("Expected a function, iterations and optional repetitions.");
+  Value function = args[0];
+  double iterations = AS_NUMBER(args[1]);
+  int repetitions = arg_count == 3 ? (int)AS_NUMBER(args[2]) : BENCH_REPETITIONS;
+  double samples[BENCH_REPETITIONS_MAX];
+  for ( int repetition = -1; repetition < repetitions; ++repetition ) {
+    uint64_t start = clock_nanoseconds();
+    for ( double i = 0; i < iterations; ++i ) {
+      stack_push(function);
+      if ( !call_nested(0) ) return ERROR_VAL(call_failed);
+      stack_pop();
+    }
+    if ( repetition >= 0 ) samples[repetition] = (clock_nanoseconds() - start) / iterations;
+  }
+  qsort(samples, repetitions, sizeof(double), bench_compare);
+  double sum = 0;
+  for ( int i = 0; i < repetitions; ++i ) sum += samples[i];
+  double median = repetitions % 2 ? samples[repetitions / 2]
+    : (samples[repetitions / 2 - 1] + samples[repetitions / 2]) / 2;
+
+  stack_push(OBJECT_VAL(copy_string("Bench", 5)));
+  stack_push(OBJECT_VAL(new_class(AS_STRING(stack_peek(0)))));
+  ObjectInstance* result = new_instance(AS_CLASS(stack_peek(0)));
+  stack_push(OBJECT_VAL(result));
+  bench_field(result, "iterations", iterations);
+  bench_field(result, "repetitions", repetitions);
+  bench_field(result, "min", samples[0]);
+  bench_field(result, "max", samples[repetitions - 1]);
+  bench_field(result, "mean", sum / repetitions);
+  bench_field(result, "median", median);
+  bench_field(result, "p10", bench_percentile(samples, repetitions, 10));
+  bench_field(result, "p90", bench_percentile(samples, repetitions, 90));
+  vm->stack_top -= 3;
+  return OBJECT_VAL(result);
+}
+
+Value exit_native(Vm* vm, int arg_count, Value* args) {
   if ( arg_count > 1 )
     return ERROR_VAL("exit expected one integer argument.");
+  output_flush();
   if ( arg_count == 0 ) exit(0);
+#ifdef NAN_BOXING_OPT
+  else if ( IS_INT(*args) ) exit(AS_INT(*args));
+#endif // NAN_BOXING_OPT
   else if ( IS_NUMBER(*args) ) {
     double code = AS_NUMBER(*args);
     if ( code != (int)code )
@@ -34,24 +179,42 @@ Value exit_native(int arg_count, Value* args) {
   return NIL_VAL;
 }
 
-Value sleep_native(int arg_count, Value* args) {
-  if ( arg_count != 1 )
-    return ERROR_VAL("Expected one integer argument");
-  else if ( IS_NUMBER(*args) ) {
-    double seconds = AS_NUMBER(*args);
-    if ( seconds < 0 )
-      return ERROR_VAL("Seconds must be positive integer.");
-    if ( seconds != (uint32_t)seconds )
-      return ERROR_VAL("Expected seconds to be an integer");
-    sleep((uint32_t)seconds);
-  } else return ERROR_VAL("Expected an integer seconds argument.");
+#define SLEEP_MAX_SECONDS 1e9 // About 31 years.
+
+// Tasks park on a timer, anything else blocks the thread. Signals
+// (the profiler's SIGPROF) cut nanosleep short, it sleeps the rest.
+Value sleep_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 || !IS_NUMBER(*args) )
+    return ERROR_VAL("Expected a number of seconds.");
+  double seconds = AS_NUMBER(*args);
+  if ( !(seconds >= 0) ) return ERROR_VAL("Seconds must be positive.");
+  if ( seconds > SLEEP_MAX_SECONDS ) return ERROR_VAL("Seconds out of range.");
+  if ( in_task() ) return loop_sleep(seconds);
+  struct timespec left = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+  while ( nanosleep(&left, &left) < 0 && errno == EINTR && !interrupt_requested );
+  if ( interrupt_requested ) vm_safepoint();
   return NIL_VAL;
 }
 
 void setup_lox_native() {
   define_native("exit", exit_native);
   define_native("clock", clock_native);
+  define_native("clock_ns", clock_ns_native);
+  define_native("string", string_native);
+  define_native("bench", bench_native);
+  define_native("length", length_native);
+  define_native("push", push_native);
+  define_native("pop", pop_native);
   define_native("sleep", sleep_native);
+  setup_isolate_native();
+  setup_parallel_native();
+  setup_fiber_native();
+  setup_event_loop_native();
+  setup_heap_native();
+  setup_f64_array_native();
+  setup_map_native();
+  setup_reader_native();
+  setup_slice_native();
 }
 
 CLOX_END_DECLS
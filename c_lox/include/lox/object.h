@@ -15,6 +15,13 @@
 #define IS_FUNCTION(value)     is_object_type(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)     is_object_type(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value) is_object_type(value, OBJ_BOUND_METHOD)
+#define IS_CHANNEL(value)      is_object_type(value, OBJ_CHANNEL)
+#define IS_ISOLATE(value)      is_object_type(value, OBJ_ISOLATE)
+#define IS_FIBER(value)        is_object_type(value, OBJ_FIBER)
+#define IS_LIST(value)         is_object_type(value, OBJ_LIST)
+#define IS_F64_ARRAY(value)    is_object_type(value, OBJ_F64_ARRAY)
+#define IS_MAP(value)          is_object_type(value, OBJ_MAP)
+#define IS_READER(value)       is_object_type(value, OBJ_READER)
 
 #define AS_NATIVE_OBJ(value)   ((ObjectNative *)AS_OBJECT(value))
 #define AS_NATIVE(value)       AS_NATIVE_OBJ(value)->function
@@ -26,6 +33,14 @@
 #define AS_INSTANCE(value)     ((ObjectInstance *)AS_OBJECT(value))
 #define AS_BOUND_METHOD(value) ((ObjectBoundMethod*)AS_OBJECT(value))
 #define UNWRAP_CLOSURE(value)  (AS_CLOSURE(value))->function
+#define AS_HANDLE(value)       ((ObjectHandle*)AS_OBJECT(value))
+#define AS_CHANNEL(value)      ((Channel*)AS_HANDLE(value)->shared)
+#define AS_ISOLATE(value)      ((Isolate*)AS_HANDLE(value)->shared)
+#define AS_FIBER(value)        ((ObjectFiber*)AS_OBJECT(value))
+#define AS_LIST(value)         ((ObjectList*)AS_OBJECT(value))
+#define AS_F64_ARRAY(value)    ((ObjectF64Array*)AS_OBJECT(value))
+#define AS_MAP(value)          ((ObjectMap*)AS_OBJECT(value))
+#define AS_READER(value)       ((ObjectReader*)AS_OBJECT(value))
 
 #define ALLOCATE_OBJECT(Type, ObjectType) \
   (Type *)allocate_object(sizeof(Type), ObjectType)
@@ -40,7 +55,14 @@ typedef enum {
   OBJ_UPVALUE,
   OBJ_STRING,
   OBJ_NATIVE,
-  OBJ_CLASS
+  OBJ_CLASS,
+  OBJ_CHANNEL,
+  OBJ_ISOLATE,
+  OBJ_FIBER,
+  OBJ_LIST,
+  OBJ_F64_ARRAY,
+  OBJ_MAP,
+  OBJ_READER
 } ObjectType;
 
 #define _STR(value) #value
@@ -48,6 +70,7 @@ typedef enum {
 
 const char* strobjtype(ObjectType type) {
   switch ( type ) {
+    CSOT(BOUND_METHOD);
     CSOT(STRING);
     CSOT(FUNCTION);
     CSOT(NATIVE);
@@ -55,7 +78,14 @@ const char* strobjtype(ObjectType type) {
     CSOT(UPVALUE);
     CSOT(CLASS);
     CSOT(INSTANCE);
-  default: "<UnknownObjectType>";
+    CSOT(CHANNEL);
+    CSOT(ISOLATE);
+    CSOT(FIBER);
+    CSOT(LIST);
+    CSOT(F64_ARRAY);
+    CSOT(MAP);
+    CSOT(READER);
+  default: return "<UnknownObjectType>";
   }
 }
 
@@ -66,13 +96,19 @@ struct Object {
   ObjectType type;
   Object* next;
   bool is_marked;
+#ifdef CLOX_ALLOC_STATS
+  bool survived; // Lived through a collection, see allocstats.h.
+  int alloc_site;
+#endif // CLOX_ALLOC_STATS
 };
 
 typedef struct {
   Object object;
-  char* chars;
-  uint64_t hash;
+  char* chars; // Not terminated in views.
+  uint64_t hash; // Computed on first use in views, see string_hash.
   int length;
+  bool hashed;
+  Object* owner; // Keeps the chars of a view alive, NULL when owned.
 } ObjectString;
 
 typedef struct {
@@ -83,12 +119,14 @@ typedef struct {
   ObjectString* name;
 } ObjectFunction;
 
-typedef Value(*NativeFn)(int, Value*);
+typedef struct Vm Vm;
+typedef Value(*NativeFn)(Vm*, int, Value*);
 
 typedef struct {
   Object object;
   const char* name;
   NativeFn function;
+  int arity; // Negative for natives checking their own arguments.
 } ObjectNative;
 
 typedef struct ObjectUpvalue {
@@ -96,6 +134,8 @@ typedef struct ObjectUpvalue {
   Value* location;
   Value closed;
   struct ObjectUpvalue* next;
+  // Owner of the stack an open upvalue points into.
+  struct ObjectFiber* fiber;
 } ObjectUpvalue;
 
 typedef struct {
@@ -105,12 +145,85 @@ typedef struct {
   int upvalue_count;
 } ObjectClosure;
 
+typedef struct {
+  // ObjectFunction *function;
+  ObjectClosure* closure;
+  uint8_t* ip;
+  Value* slots;
+} CallFrame;
+
+typedef enum {
+  FIBER_NEW,
+  FIBER_SUSPENDED,
+  FIBER_RUNNING, // Running or waiting on a fiber it resumed.
+  FIBER_WAITING, // Parked by the event loop, see eventloop.h.
+  FIBER_DONE,
+} FiberState;
+
+// A value and frame stack of its own, the vm works on the running
+// fiber's through its registers, see fiber.h. The counts and
+// upvalues here are only current while the fiber is switched out.
+typedef struct ObjectFiber {
+  Object object;
+  FiberState state;
+  CallFrame* frames;
+  int frame_count;
+  int frame_capacity;
+  Value* stack;
+  Value* stack_top;
+  int stack_capacity;
+  ObjectUpvalue* open_upvalues;
+  struct ObjectFiber* caller;
+  bool task; // Scheduled by the event loop rather than resumed.
+} ObjectFiber;
+
+typedef struct {
+  Object object;
+  Value* items;
+  int count;
+  int capacity;
+} ObjectList;
+
+// Unboxed doubles of a fixed length, see f64array.h.
+typedef struct {
+  Object object;
+  double* values;
+  int count;
+} ObjectF64Array;
+
+typedef struct {
+  Value key;   // nil in free slots and tombstones.
+  Value value; // nil in free slots, true in tombstones.
+} MapEntry;
+
+// Keyed by numbers, strings and object identities, see map.h.
+typedef struct {
+  Object object;
+  MapEntry* entries;
+  int count; // Entries and tombstones.
+  int live;
+  int capacity; // A power of two.
+} ObjectMap;
+
+// Lines and records of a file or of stdin, see reader.h.
+typedef struct {
+  Object object;
+  char* bytes; // The mapping, or the chars of block.
+  size_t size; // Bytes mapped, or read into block.
+  size_t position; // Of the first byte not handed out yet.
+  ObjectString* block; // Holds what was read from a pipe, NULL when mapped.
+  int fd; // -1 once the whole input is mapped or read.
+  bool mapped;
+} ObjectReader;
+
 #include "table.h"
 
 typedef struct {
   Object object;
   ObjectString* name;
   Table methods;
+  Value initializer; // The init method, nil without one.
+  int field_capacity; // Largest fields capacity of an instance so far.
 } ObjectClass;
 
 typedef struct {
@@ -125,14 +238,42 @@ typedef struct {
   ObjectClosure* method;
 } ObjectBoundMethod;
 
+// Handles to state shared between isolates, the object
+// owns one reference to it, see isolate.h.
+typedef struct Shared Shared;
+typedef struct Channel Channel;
+typedef struct Isolate Isolate;
+
+typedef struct {
+  Object object;
+  Shared* shared;
+} ObjectHandle;
+
+void shared_release(Shared*);
+void print_channel(Channel*);
+void fiber_delete(ObjectFiber*);
+void reader_delete(ObjectReader*);
+Value reader_line(ObjectReader*);
+
 void new_object(Object*);
+#ifdef CLOX_ALLOC_STATS
+void alloc_stats_object(Object*);
+#endif // CLOX_ALLOC_STATS
 ObjectInstance* new_instance(ObjectClass*);
 ObjectClass* new_class(ObjectString*);
 ObjectBoundMethod* new_bound_method(Value, ObjectClosure*);
 ObjectUpvalue* new_upvalue(Value*);
 ObjectClosure* new_closure(ObjectFunction*);
 ObjectFunction* new_function();
-ObjectNative* new_native(NativeFn, const char*);
+ObjectNative* new_native(NativeFn, const char*, int);
+ObjectList* new_list(Value*, int);
+ObjectF64Array* new_f64_array(int);
+ObjectMap* new_map();
+bool map_get(ObjectMap*, Value, Value*);
+bool map_set(ObjectMap*, Value, Value);
+void map_reserve(ObjectMap*, int);
+int map_next(ObjectMap*, int);
+const char* map_key_error(Value);
 void intern_string(ObjectString*);
 ObjectString* table_find_istring(const char*, int, uint64_t);
 
@@ -146,16 +287,20 @@ Object* allocate_object(size_t size, ObjectType type) {
   object->type = type;
   object->next = NULL;
   new_object(object);
+#ifdef CLOX_ALLOC_STATS
+  alloc_stats_object(object);
+#endif // CLOX_ALLOC_STATS
 #ifdef CLOX_GC_LOG
   printf("%p allocate %ld for %s\n", (void*)object, size, strobjtype(type));
 #endif // CLOX_GC_LOG
   return object;
 }
 
-ObjectNative* new_native(NativeFn function, const char* name) {
+ObjectNative* new_native(NativeFn function, const char* name, int arity) {
   ObjectNative* native = ALLOCATE_OBJECT(ObjectNative, OBJ_NATIVE);
   native->function = function;
   native->name = name;
+  native->arity = arity;
   return native;
 }
 
@@ -163,6 +308,8 @@ ObjectClass* new_class(ObjectString* klass_name) {
   ObjectClass* klass = ALLOCATE_OBJECT(ObjectClass, OBJ_CLASS);
   klass->name = klass_name;
   table_init(&klass->methods);
+  klass->initializer = NIL_VAL;
+  klass->field_capacity = 0;
   return klass;
 }
 
@@ -173,18 +320,56 @@ ObjectBoundMethod* new_bound_method(Value receiver, ObjectClosure* method) {
   return bound_method;
 }
 
+ObjectHandle* new_handle(ObjectType type, Shared* shared) {
+  ObjectHandle* handle = ALLOCATE_OBJECT(ObjectHandle, type);
+  handle->shared = shared;
+  return handle;
+}
+
+// Instances start with the fields capacity earlier ones of their
+// class grew to, init fills them without rehashing.
+#define INSTANCE_MAX_PREALLOC 64
+
+// klass must be reachable, allocating may collect.
 ObjectInstance* new_instance(ObjectClass* klass) {
+  Table fields;
+  table_init(&fields);
+  if ( klass->field_capacity > 0 ) table_adjust_cap(&fields, klass->field_capacity);
   ObjectInstance* instance = ALLOCATE_OBJECT(ObjectInstance, OBJ_INSTANCE);
-  table_init(&instance->fields);
+  instance->fields = fields;
   instance->klass = klass;
   return instance;
 }
 
+// A list holding a copy of count items, which stay reachable
+// from wherever they are until the list is stored.
+ObjectList* new_list(Value* items, int count) {
+  Value* copy = ALLOCATE(Value, count);
+  if ( count ) memcpy(copy, items, sizeof(Value) * count);
+  ObjectList* list = ALLOCATE_OBJECT(ObjectList, OBJ_LIST);
+  list->items = copy;
+  list->count = count;
+  list->capacity = count;
+  return list;
+}
+
+// The list must be reachable, growing it may collect.
+void list_append(ObjectList* list, Value value) {
+  if ( list->capacity < list->count + 1 ) {
+    int capacity = GROW_CAPACITY(list->capacity);
+    list->items = GROW_ARRAY(Value, list->items, list->capacity, capacity);
+    list->capacity = capacity;
+  }
+  list->items[list->count++] = value;
+}
+
 ObjectString* allocate_string_noi(char* payload, int size, uint64_t hash) {
   ObjectString* string = ALLOCATE_OBJECT(ObjectString, OBJ_STRING);
   string->chars = payload;
   string->length = size;
   string->hash = hash;
+  string->hashed = true;
+  string->owner = NULL;
   return string;
 }
 
@@ -209,40 +394,144 @@ ObjectString* copy_string(const char* chars, int size) {
   return str;
 }
 
+// A string over length chars kept alive by owner, which must be
+// reachable. Nothing is copied, hashed or interned: views compare
+// equal to strings by their chars and are interned before becoming
+// keys, see string_intern.
+ObjectString* new_string_view(Object* owner, const char* chars, int length) {
+  if ( owner->type == OBJ_STRING && ((ObjectString*)owner)->owner != NULL )
+    owner = ((ObjectString*)owner)->owner;
+  ObjectString* string = ALLOCATE_OBJECT(ObjectString, OBJ_STRING);
+  string->chars = (char*)chars;
+  string->length = length;
+  string->hash = 0;
+  string->hashed = false;
+  string->owner = owner;
+  return string;
+}
+
+uint64_t string_hash(ObjectString* string) {
+  if ( !string->hashed ) {
+    string->hash = hash_string(string->chars, string->length);
+    string->hashed = true;
+  }
+  return string->hash;
+}
+
+// The interned string spelling the same chars, views are copied.
+// The result is terminated, unlike a view.
+ObjectString* string_intern(ObjectString* string) {
+  if ( string->owner == NULL ) return string;
+  ObjectString* interned = table_find_istring(string->chars, string->length, string_hash(string));
+  return interned != NULL ? interned : copy_string(string->chars, string->length);
+}
+
+// Interned strings are equal to themselves only, views by their chars.
+bool string_views_equal(Value a, Value b) {
+  if ( !IS_STRING(a) || !IS_STRING(b) ) return false;
+  ObjectString* x = AS_STRING(a), * y = AS_STRING(b);
+  return (x->owner != NULL || y->owner != NULL) && x->length == y->length
+    && !memcmp(x->chars, y->chars, x->length);
+}
+
 void value_function_print(ObjectFunction* function) {
-  if ( function->name == NULL ) printf("<script>");
-  else printf("<fn %s>", function->name->chars);
+  if ( function->name == NULL ) output_string("<script>");
+  else output_printf("<fn %s>", function->name->chars);
 }
 
 void print_bound_method(ObjectBoundMethod* bound_method) {
-  printf("<bound ");
+  output_string("<bound ");
   value_print(OBJECT_VAL(bound_method->method));
-  printf(" to ");
+  output_string(" to ");
   value_print(bound_method->receiver);
-  printf(">");
+  output_string(">");
+}
+
+void print_f64_array(ObjectF64Array* array) {
+  output_string("f64[");
+  for ( int i = 0; i < array->count; ++i ) {
+    if ( i ) output_string(", ");
+    number_print(array->values[i]);
+  }
+  output_string("]");
+}
+
+// Lists and maps being printed, one inside itself prints as [...] or {...}.
+#define PRINT_NESTED_DEPTH 64
+_Thread_local Object* printing_nested[PRINT_NESTED_DEPTH];
+_Thread_local int printing_nested_count = 0;
+
+bool print_nested_enter(Object* object, const char* cycle) {
+  for ( int i = 0; i < printing_nested_count; ++i )
+    if ( printing_nested[i] == object ) {
+      output_string(cycle);
+      return false;
+    }
+  if ( printing_nested_count == PRINT_NESTED_DEPTH ) {
+    output_string(cycle);
+    return false;
+  }
+  printing_nested[printing_nested_count++] = object;
+  return true;
 }
 
+void print_list(ObjectList* list) {
+  if ( !print_nested_enter((Object*)list, "[...]") ) return;
+  output_string("[");
+  for ( int i = 0; i < list->count; ++i ) {
+    if ( i ) output_string(", ");
+    value_print(list->items[i]);
+  }
+  output_string("]");
+  --printing_nested_count;
+}
+
+void print_map(ObjectMap* map) {
+  if ( !print_nested_enter((Object*)map, "{...}") ) return;
+  output_string("{");
+  for ( int i = 0, first = 1; i < map->capacity; ++i ) {
+    MapEntry* entry = map->entries + i;
+    if ( IS_NIL(entry->key) ) continue;
+    if ( !first ) output_string(", ");
+    first = 0;
+    value_print(entry->key);
+    output_string(": ");
+    value_print(entry->value);
+  }
+  output_string("}");
+  --printing_nested_count;
+}
+
+#undef PRINT_NESTED_DEPTH
+
 void value_oprint(Value value) {
   if (!AS_OBJECT(value)) {
-    printf("(NULL OBJECT)");
+    output_string("(NULL OBJECT)");
     return;
   }
 #ifdef CLOX_OBJECT_TYPE
-  printf("<%s at %p \"", strobjtype(OBJECT_TYPE(value)), value.payload.object);
+  output_printf("<%s at %p \"", strobjtype(OBJECT_TYPE(value)), value.payload.object);
 #endif // CLOX_OBJECT_TYPE
   switch ( OBJECT_TYPE(value) ) {
-  case OBJ_UPVALUE: printf("upvalue");                                                   break;
-  case OBJ_STRING: printf("%s", AS_CSTRING(value));                                      break;
+  case OBJ_UPVALUE: output_string("upvalue");                                            break;
+  case OBJ_STRING: output_write(AS_CSTRING(value), AS_STRING(value)->length);            break;
   case OBJ_FUNCTION: value_function_print(AS_FUNCTION(value));                           break;
   case OBJ_CLOSURE: value_function_print(UNWRAP_CLOSURE(value));                         break;
-  case OBJ_CLASS: printf("<class %s>", AS_CLASS(value)->name->chars);                    break;
+  case OBJ_CLASS: output_printf("<class %s>", AS_CLASS(value)->name->chars);             break;
   case OBJ_BOUND_METHOD: print_bound_method(AS_BOUND_METHOD(value));                     break;
-  case OBJ_NATIVE: printf("<native fn(%s)>", AS_NATIVE_OBJ(value)->name);                break;
-  case OBJ_INSTANCE: printf("<instance of %s>", AS_INSTANCE(value)->klass->name->chars); break;
-  default: printf("Unknown object[%p]: %d", value, OBJECT_TYPE(value));   break;
+  case OBJ_NATIVE: output_printf("<native fn(%s)>", AS_NATIVE_OBJ(value)->name);         break;
+  case OBJ_INSTANCE: output_printf("<instance of %s>", AS_INSTANCE(value)->klass->name->chars); break;
+  case OBJ_CHANNEL: print_channel(AS_CHANNEL(value));                                    break;
+  case OBJ_ISOLATE: output_string("<isolate>");                                          break;
+  case OBJ_FIBER: output_string("<fiber>");                                              break;
+  case OBJ_LIST: print_list(AS_LIST(value));                                             break;
+  case OBJ_F64_ARRAY: print_f64_array(AS_F64_ARRAY(value));                              break;
+  case OBJ_MAP: print_map(AS_MAP(value));                                                break;
+  case OBJ_READER: output_string("<reader>");                                            break;
+  default: output_printf("Unknown object[%p]: %d", value, OBJECT_TYPE(value));           break;
   }
 #ifdef CLOX_OBJECT_TYPE
-  printf("\">");
+  output_string("\">");
 #endif // CLOX_OBJECT_TYPE
 }
 
@@ -262,7 +551,7 @@ void object_delete(Object* object) {
   case OBJ_UPVALUE: FREE(ObjectUpvalue, object);                 break;
   case OBJ_STRING: {
     ObjectString* string = (ObjectString*)object;
-    FREE_ARRAY(char, string->chars, string->length + 1);
+    if ( string->owner == NULL ) FREE_ARRAY(char, string->chars, string->length + 1);
     FREE(ObjectString, object);                                  break;
   }
   case OBJ_FUNCTION:
@@ -279,6 +568,25 @@ void object_delete(Object* object) {
   case OBJ_INSTANCE:
     table_delete(&((ObjectInstance*)object)->fields);
     FREE(ObjectInstance, object);                                break;
+  case OBJ_CHANNEL:
+  case OBJ_ISOLATE:
+    shared_release(((ObjectHandle*)object)->shared);
+    FREE(ObjectHandle, object);                                  break;
+  case OBJ_FIBER:
+    fiber_delete((ObjectFiber*)object);
+    FREE(ObjectFiber, object);                                   break;
+  case OBJ_LIST:
+    FREE_ARRAY(Value, ((ObjectList*)object)->items, ((ObjectList*)object)->capacity);
+    FREE(ObjectList, object);                                    break;
+  case OBJ_F64_ARRAY:
+    FREE_ARRAY(double, ((ObjectF64Array*)object)->values, ((ObjectF64Array*)object)->count);
+    FREE(ObjectF64Array, object);                                break;
+  case OBJ_MAP:
+    FREE_ARRAY(MapEntry, ((ObjectMap*)object)->entries, ((ObjectMap*)object)->capacity);
+    FREE(ObjectMap, object);                                     break;
+  case OBJ_READER:
+    reader_delete((ObjectReader*)object);
+    FREE(ObjectReader, object);                                  break;
   default: printf("Deleting unknown object: %p\n", object);      break;
   }
 }
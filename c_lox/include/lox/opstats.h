@@ -0,0 +1,240 @@
+#ifndef _CLOX_OPSTATS_H
+#define _CLOX_OPSTATS_H
+
+#include "common.h"
+#include "chunk.h"
+#include "object.h"
+
+CLOX_BEG_DECLS
+
+#ifdef CLOX_OP_STATS
+
+// Instrumented dispatch for CLOX_OP_STATS builds. Every instruction
+// reads the cycle counter, the cycles since the previous dispatch are
+// charged to the previous opcode of the previous function, so time
+// spent in natives and collections lands on the instruction that
+// caused it. vm_delete prints sorted tables to stderr and writes
+// JSON to $CLOX_OP_STATS_JSON (clox.opstats.json by default):
+//
+//   { "instructions": n, "cycles": n,
+//     "opcodes": [ { "name": "ADD", "count": n, "cycles": n }, ... ],
+//     "functions": [ { "name": "fib", "line": 1, "count": n, "cycles": n,
+//                      "opcodes": [ { "name": "ADD", ... } ] }, ... ] }
+//
+// Arrays are sorted by cycles. Cycles include a fixed cost of the
+// counting itself, compare opcodes with each other rather than with
+// uninstrumented runs. Counted functions stay alive until vm_delete
+// so their names can be reported.
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define op_stats_clock() __rdtsc()
+#else
+# define op_stats_clock() clock_nanoseconds()
+#endif
+
+#define OP_STATS_OPS (OP_POP + 1)
+#define OP_STATS_TOP 20
+
+typedef struct {
+  ObjectFunction* function; // NULL for free slots.
+  uint64_t counts[OP_STATS_OPS];
+  uint64_t cycles[OP_STATS_OPS];
+} FunctionStats;
+
+struct OpStats {
+  FunctionStats* functions; // Open addressing on the pointer.
+  int count;
+  int capacity;
+  FunctionStats* current; // Running when the last op was dispatched.
+  uint8_t op;
+  uint64_t last;
+};
+
+FunctionStats* op_stats_slot(FunctionStats* functions, int capacity, ObjectFunction* function) {
+  uint32_t index = (uint32_t)(((uintptr_t)function >> 4) * 2654435761u) & (capacity - 1);
+  while ( functions[index].function != NULL && functions[index].function != function )
+    index = (index + 1) & (capacity - 1);
+  return &functions[index];
+}
+
+FunctionStats* op_stats_function(OpStats* stats, ObjectFunction* function) {
+  if ( stats->count + 1 > stats->capacity / 2 ) {
+    int capacity = stats->capacity ? stats->capacity * 2 : 64;
+    FunctionStats* functions = (FunctionStats*)calloc(capacity, sizeof(FunctionStats));
+    if ( functions == NULL ) exit(80);
+    for ( int i = 0; i < stats->capacity; ++i )
+      if ( stats->functions[i].function != NULL )
+        *op_stats_slot(functions, capacity, stats->functions[i].function) = stats->functions[i];
+    free(stats->functions);
+    stats->functions = functions;
+    stats->capacity = capacity;
+  }
+  FunctionStats* slot = op_stats_slot(stats->functions, stats->capacity, function);
+  if ( slot->function == NULL ) {
+    slot->function = function;
+    ++stats->count;
+  }
+  return slot;
+}
+
+// A new run, whatever happened since the last one is not charged.
+void op_stats_enter() {
+  if ( vm->op_stats == NULL ) {
+    vm->op_stats = (OpStats*)calloc(1, sizeof(OpStats));
+    if ( vm->op_stats == NULL ) exit(80);
+  }
+  vm->op_stats->current = NULL;
+}
+
+void op_stats_count(ObjectFunction* function, uint8_t op) {
+  OpStats* stats = vm->op_stats;
+  uint64_t now = op_stats_clock();
+  if ( stats->current != NULL ) stats->current->cycles[stats->op] += now - stats->last;
+  // Functions only change on calls and returns, the growth in
+  // op_stats_function can move the record, it is looked up again.
+  if ( stats->current == NULL || stats->current->function != function )
+    stats->current = op_stats_function(stats, function);
+  ++stats->current->counts[op];
+  stats->op = op;
+  stats->last = op_stats_clock();
+}
+
+void gc_mark_op_stats() {
+  if ( vm->op_stats == NULL ) return;
+  for ( int i = 0; i < vm->op_stats->capacity; ++i )
+    gc_mark_object((Object*)vm->op_stats->functions[i].function);
+}
+
+typedef struct {
+  int key; // Opcode or function index.
+  uint64_t count;
+  uint64_t cycles;
+} OpStatsRow;
+
+int op_stats_compare(const void* a, const void* b) {
+  uint64_t x = ((const OpStatsRow*)a)->cycles, y = ((const OpStatsRow*)b)->cycles;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Opcode rows of one function, or of all of them, sorted by cycles.
+int op_stats_rows(OpStats* stats, FunctionStats* only, OpStatsRow* rows) {
+  int count = 0;
+  for ( int op = 0; op < OP_STATS_OPS; ++op ) {
+    OpStatsRow row = { op, 0, 0 };
+    for ( int i = 0; i < stats->capacity; ++i ) {
+      FunctionStats* function = &stats->functions[i];
+      if ( function->function == NULL || (only != NULL && only != function) ) continue;
+      row.count += function->counts[op];
+      row.cycles += function->cycles[op];
+    }
+    if ( row.count ) rows[count++] = row;
+  }
+  qsort(rows, count, sizeof(OpStatsRow), op_stats_compare);
+  return count;
+}
+
+const char* op_stats_name(FunctionStats* function) {
+  ObjectString* name = function->function->name;
+  return name != NULL ? name->chars : "script";
+}
+
+int op_stats_line(FunctionStats* function) {
+  Chunk* chunk = &function->function->chunk;
+  return chunk->count ? chunk->lines[0] : 0;
+}
+
+void op_stats_write_ops(FILE* out, OpStatsRow* rows, int count) {
+  fputc('[', out);
+  for ( int i = 0; i < count; ++i )
+    fprintf(out, "%s{\"name\":\"%s\",\"count\":%llu,\"cycles\":%llu}", i ? "," : "",
+      inst_print(rows[i].key), (unsigned long long)rows[i].count,
+      (unsigned long long)rows[i].cycles);
+  fputc(']', out);
+}
+
+void op_stats_dump(OpStats* stats) {
+  OpStatsRow ops[OP_STATS_OPS];
+  int op_count = op_stats_rows(stats, NULL, ops);
+  OpStatsRow* functions = (OpStatsRow*)malloc(sizeof(OpStatsRow) * (stats->count + 1));
+  if ( functions == NULL ) exit(80);
+  int function_count = 0;
+  uint64_t instructions = 0, cycles = 0;
+  for ( int i = 0; i < op_count; ++i ) {
+    instructions += ops[i].count;
+    cycles += ops[i].cycles;
+  }
+  for ( int i = 0; i < stats->capacity; ++i ) {
+    FunctionStats* function = &stats->functions[i];
+    if ( function->function == NULL ) continue;
+    OpStatsRow row = { i, 0, 0 };
+    for ( int op = 0; op < OP_STATS_OPS; ++op ) {
+      row.count += function->counts[op];
+      row.cycles += function->cycles[op];
+    }
+    functions[function_count++] = row;
+  }
+  qsort(functions, function_count, sizeof(OpStatsRow), op_stats_compare);
+  double total = cycles ? (double)cycles : 1;
+
+  fprintf(stderr, "%-16s %14s %16s %10s %8s\n", "opcode", "count", "cycles", "cyc/op", "cycles%");
+  for ( int i = 0; i < op_count; ++i )
+    fprintf(stderr, "%-16s %14llu %16llu %10.1f %7.2f%%\n", inst_print(ops[i].key),
+      (unsigned long long)ops[i].count, (unsigned long long)ops[i].cycles,
+      (double)ops[i].cycles / ops[i].count, ops[i].cycles * 100 / total);
+  fprintf(stderr, "\n%-24s %14s %16s %8s  top opcodes\n", "function", "count", "cycles", "cycles%");
+  for ( int i = 0; i < function_count && i < OP_STATS_TOP; ++i ) {
+    FunctionStats* function = &stats->functions[functions[i].key];
+    char label[64];
+    snprintf(label, sizeof(label), "%s:%d", op_stats_name(function), op_stats_line(function));
+    fprintf(stderr, "%-24s %14llu %16llu %7.2f%% ", label,
+      (unsigned long long)functions[i].count, (unsigned long long)functions[i].cycles,
+      functions[i].cycles * 100 / total);
+    int count = op_stats_rows(stats, function, ops);
+    for ( int j = 0; j < count && j < 3; ++j )
+      fprintf(stderr, " %s %.0f%%", inst_print(ops[j].key),
+        functions[i].cycles ? ops[j].cycles * 100.0 / functions[i].cycles : 0.0);
+    fputc('\n', stderr);
+  }
+
+  const char* path = getenv("CLOX_OP_STATS_JSON");
+  if ( path == NULL ) path = "clox.opstats.json";
+  FILE* out = fopen(path, "w");
+  if ( out == NULL ) {
+    fprintf(stderr, "Op stats: cannot write '%s'.\n", path);
+    free(functions);
+    return;
+  }
+  fprintf(out, "{\"instructions\":%llu,\"cycles\":%llu,\"opcodes\":",
+    (unsigned long long)instructions, (unsigned long long)cycles);
+  op_stats_write_ops(out, ops, op_stats_rows(stats, NULL, ops));
+  fputs(",\"functions\":[", out);
+  for ( int i = 0; i < function_count; ++i ) {
+    FunctionStats* function = &stats->functions[functions[i].key];
+    // Lox identifiers need no escaping.
+    fprintf(out, "%s{\"name\":\"%s\",\"line\":%d,\"count\":%llu,\"cycles\":%llu,\"opcodes\":",
+      i ? "," : "", op_stats_name(function), op_stats_line(function),
+      (unsigned long long)functions[i].count, (unsigned long long)functions[i].cycles);
+    op_stats_write_ops(out, ops, op_stats_rows(stats, function, ops));
+    fputc('}', out);
+  }
+  fputs("]}\n", out);
+  fclose(out);
+  free(functions);
+}
+
+// Called by vm_delete while the functions are still alive.
+void op_stats_delete() {
+  OpStats* stats = vm->op_stats;
+  if ( stats == NULL ) return;
+  if ( stats->count ) op_stats_dump(stats);
+  free(stats->functions);
+  free(stats);
+  vm->op_stats = NULL;
+}
+
+#endif // CLOX_OP_STATS
+
+CLOX_END_DECLS
+
+#endif //_CLOX_OPSTATS_H
@@ -0,0 +1,373 @@
+#ifndef _CLOX_PARALLEL_H
+#define _CLOX_PARALLEL_H
+
+#include "common.h"
+#include "isolate.h"
+
+CLOX_BEG_DECLS
+
+// Data parallel loops over a process wide pool of worker VMs, one
+// per core, started on first use and kept warm for later calls.
+//
+//   fun square(i) { return i * i; }
+//   fun add(a, b) { return a + b; }
+//   print parallel_reduce(square, add, 0, 1000);
+//   var squares = parallel_map(square, 0, 10);
+//   print receive(squares); // 0, then 1, 4, ... in index order
+//   print parallel_map(square, [1, 2, 3]); // [1, 4, 9]
+//   print parallel_reduce(square, add, [1, 2, 3]); // 14
+//
+// The function is serialized once per call and every worker loads
+// it from the same bytes, chunks borrow that code read-only. Workers
+// claim chunks of [start, end), map queues each result and reduce
+// folds its chunk with combine. The worker finishing last folds the
+// chunk results in order, so combine only has to be associative.
+// A list runs over its indices, each item is serialized on its own
+// so a chunk reads only its items. Mapping a list returns a list of
+// the results in order rather than a channel.
+
+// Workers in the pool, one per online core unless defined.
+// #define CLOX_POOL_SIZE 8
+
+#ifndef CLOX_POOL_CHUNKS
+# define CLOX_POOL_CHUNKS 4 // Chunks per worker, evens out uneven work.
+#endif // CLOX_POOL_CHUNKS
+
+typedef struct ParallelJob {
+  struct ParallelJob* next;
+  Message program; // The function, then combine for reduce.
+  Message* items; // One per index for a list, NULL for a range.
+  bool reduce;
+  int32_t start;
+  int32_t end;
+  int32_t chunk_size;
+  int chunk_count;
+  int next_chunk;  // Guarded by the pool lock.
+  // Results of each chunk in order, one message per value.
+  Message** heads;
+  Message** tails;
+  Message result;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+  int done;
+  bool failed;
+  bool complete;
+} ParallelJob;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  ParallelJob* jobs; // Jobs with unclaimed chunks.
+  ParallelJob* last;
+  int size;
+} WorkerPool;
+
+WorkerPool worker_pool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0
+};
+_Thread_local bool in_worker_pool = false;
+
+// Calls the function below its arguments on the stack, the result
+// replaces them. The worker has no frames so run returns with it.
+bool parallel_call(int arg_count) {
+  return call_value(stack_peek(arg_count), arg_count) && run() == INTERPRET_OKAY;
+}
+
+bool parallel_emit(ParallelJob* job, int chunk, Value value) {
+  Message* message = (Message*)malloc(sizeof(Message));
+  if ( message == NULL ) exit(80);
+  message_init(message);
+  const char* error = message_write(message, value);
+  if ( error != NULL ) {
+    fprintf(stderr, "Parallel result: %s\n", error);
+    message_delete(message);
+    free(message);
+    return false;
+  }
+  if ( job->tails[chunk] == NULL ) job->heads[chunk] = message;
+  else job->tails[chunk]->next = message;
+  job->tails[chunk] = message;
+  return true;
+}
+
+// Pushes the function and combine, slots 0 and 1 of the worker
+// stack, the accumulator of a reduce lives in slot 2.
+bool parallel_load(ParallelJob* job) {
+  MessageReader reader;
+  message_reader_borrow(&reader, &job->program);
+  stack_push(message_read_value(&reader));
+  if ( job->reduce ) stack_push(message_read_value(&reader));
+  message_reader_delete(&reader);
+  return reader.error == NULL;
+}
+
+// Folds value into the accumulator, the first value becomes it.
+bool parallel_combine(Value value, bool first) {
+  if ( first ) {
+    stack_push(value);
+    return true;
+  }
+  stack_push(vm->stack[1]);
+  stack_push(vm->stack[2]);
+  stack_push(value);
+  if ( !parallel_call(2) ) return false;
+  vm->stack[2] = stack_pop();
+  return true;
+}
+
+bool parallel_run_chunk(ParallelJob* job, int chunk) {
+  bool okay = parallel_load(job);
+  int32_t from = job->start + chunk * job->chunk_size;
+  int32_t to = job->end - from < job->chunk_size ? job->end : from + job->chunk_size;
+  for ( int32_t i = from; okay && i < to; ++i ) {
+    stack_push(vm->stack[0]);
+    if ( job->items != NULL ) {
+      MessageReader reader;
+      message_reader_borrow(&reader, &job->items[i]);
+      Value item = message_read_value(&reader);
+      message_reader_delete(&reader);
+      if ( !(okay = reader.error == NULL) ) break;
+      stack_push(item);
+    } else stack_push(int_value(i));
+    if ( !(okay = parallel_call(1)) ) break;
+    if ( job->reduce ) okay = parallel_combine(stack_pop(), i == from);
+    else okay = parallel_emit(job, chunk, stack_pop());
+  }
+  if ( okay && job->reduce ) okay = parallel_emit(job, chunk, vm->stack[2]);
+  reset_stack();
+  return okay;
+}
+
+bool parallel_fold(ParallelJob* job) {
+  bool okay = parallel_load(job);
+  for ( int chunk = 0; okay && chunk < job->chunk_count; ++chunk ) {
+    MessageReader reader;
+    message_reader_borrow(&reader, job->heads[chunk]);
+    Value value = message_read_value(&reader);
+    message_reader_delete(&reader);
+    okay = reader.error == NULL && parallel_combine(value, chunk == 0);
+  }
+  if ( okay ) okay = message_write(&job->result, vm->stack[2]) == NULL;
+  reset_stack();
+  return okay;
+}
+
+void* parallel_worker_main(void* argument) {
+  Vm* worker = (Vm*)malloc(sizeof(Vm));
+  if ( worker == NULL ) exit(80);
+  vm_init(worker);
+  in_worker_pool = true;
+  for ( ;;) {
+    pthread_mutex_lock(&worker_pool.lock);
+    while ( worker_pool.jobs == NULL )
+      pthread_cond_wait(&worker_pool.work, &worker_pool.lock);
+    ParallelJob* job = worker_pool.jobs;
+    int chunk = job->next_chunk++;
+    if ( job->next_chunk == job->chunk_count ) {
+      worker_pool.jobs = job->next;
+      if ( worker_pool.jobs == NULL ) worker_pool.last = NULL;
+    }
+    pthread_mutex_unlock(&worker_pool.lock);
+    bool okay = parallel_run_chunk(job, chunk);
+    output_flush();
+    pthread_mutex_lock(&job->lock);
+    job->failed |= !okay;
+    bool last = ++job->done == job->chunk_count;
+    bool fold = last && job->reduce && !job->failed;
+    pthread_mutex_unlock(&job->lock);
+    if ( !last ) continue;
+    if ( fold ) okay = parallel_fold(job);
+    output_flush();
+    pthread_mutex_lock(&job->lock);
+    job->failed |= !okay;
+    job->complete = true;
+    pthread_cond_signal(&job->finished);
+    pthread_mutex_unlock(&job->lock);
+  }
+  return NULL;
+}
+
+// Called with the pool lock held.
+void parallel_pool_start() {
+#ifdef CLOX_POOL_SIZE
+  long count = CLOX_POOL_SIZE;
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif // CLOX_POOL_SIZE
+  pthread_t thread;
+  for ( long i = 0; i < (count < 1 ? 1 : count); ++i ) {
+    if ( pthread_create(&thread, NULL, parallel_worker_main, NULL) ) break;
+    pthread_detach(thread);
+    ++worker_pool.size;
+  }
+}
+
+void parallel_job_delete(ParallelJob* job) {
+  Message* message;
+  for ( int chunk = 0; chunk < job->chunk_count; ++chunk ) {
+    while ( job->heads[chunk] != NULL ) {
+      message = job->heads[chunk];
+      job->heads[chunk] = message->next;
+      message_delete(message);
+      free(message);
+    }
+  }
+  free(job->heads);
+  free(job->tails);
+  if ( job->items != NULL ) {
+    for ( int32_t i = job->start; i < job->end; ++i ) message_delete(&job->items[i]);
+    free(job->items);
+  }
+  message_delete(&job->program);
+  message_delete(&job->result);
+  pthread_mutex_destroy(&job->lock);
+  pthread_cond_destroy(&job->finished);
+}
+
+// Queues the job and blocks until every chunk has been run.
+const char* parallel_run(ParallelJob* job) {
+  pthread_mutex_lock(&worker_pool.lock);
+  if ( worker_pool.size == 0 ) parallel_pool_start();
+  if ( worker_pool.size == 0 ) {
+    pthread_mutex_unlock(&worker_pool.lock);
+    return "Could not start the worker pool.";
+  }
+  int64_t length = (int64_t)job->end - job->start;
+  int64_t chunks = (int64_t)worker_pool.size * CLOX_POOL_CHUNKS;
+  job->chunk_size = (int32_t)((length + chunks - 1) / chunks);
+  job->chunk_count = (int)((length + job->chunk_size - 1) / job->chunk_size);
+  job->heads = (Message**)calloc(job->chunk_count, sizeof(Message*));
+  job->tails = (Message**)calloc(job->chunk_count, sizeof(Message*));
+  if ( job->heads == NULL || job->tails == NULL ) exit(80);
+  if ( worker_pool.last == NULL ) worker_pool.jobs = job;
+  else worker_pool.last->next = job;
+  worker_pool.last = job;
+  pthread_cond_broadcast(&worker_pool.work);
+  pthread_mutex_unlock(&worker_pool.lock);
+  pthread_mutex_lock(&job->lock);
+  while ( !job->complete ) pthread_cond_wait(&job->finished, &job->lock);
+  pthread_mutex_unlock(&job->lock);
+  return job->failed ? "Parallel worker failed." : NULL;
+}
+
+bool parallel_range(Value start, Value end, int32_t* from, int32_t* to) {
+  if ( !IS_NUMBER(start) || !IS_NUMBER(end) ) return false;
+  double a = AS_NUMBER(start), b = AS_NUMBER(end);
+  if ( !is_int_number(a) || !is_int_number(b) || b - a > INT32_MAX ) return false;
+  *from = (int32_t)a;
+  *to = (int32_t)b;
+  return true;
+}
+
+// Serializes the items of list, one message each.
+const char* parallel_items(ParallelJob* job, ObjectList* list) {
+  job->items = (Message*)malloc(sizeof(Message) * list->count);
+  if ( job->items == NULL ) exit(80);
+  for ( int i = 0; i < list->count; ++i ) message_init(&job->items[i]);
+  job->start = 0;
+  job->end = list->count;
+  const char* error = NULL;
+  for ( int i = 0; error == NULL && i < list->count; ++i )
+    error = message_write(&job->items[i], list->items[i]);
+  return error;
+}
+
+// The map results of a list job in order, as a list.
+Value parallel_list(ParallelJob* job, const char** error) {
+  ObjectList* list = new_list(NULL, 0);
+  stack_push(OBJECT_VAL(list));
+  for ( int chunk = 0; chunk < job->chunk_count && *error == NULL; ++chunk )
+    for ( Message* message = job->heads[chunk]; message != NULL && *error == NULL;
+      message = message->next ) {
+      MessageReader reader;
+      message_reader_init(&reader, message);
+      Value value = message_read_value(&reader);
+      message_reader_delete(&reader);
+      if ( (*error = reader.error) != NULL ) break;
+      stack_push(value);
+      list_append(list, value);
+      stack_pop();
+    }
+  return stack_pop();
+}
+
+// Shared by both natives: args are the function, combine when
+// reducing, then the range or the list.
+Value parallel_native(Vm* vm, bool reduce, int arg_count, Value* args) {
+  if ( in_worker_pool ) return ERROR_VAL("Cannot nest parallel loops.");
+  ParallelJob job = { .next = NULL, .items = NULL, .reduce = reduce, .next_chunk = 0,
+    .done = 0, .failed = false, .complete = false, .chunk_count = 0 };
+  Value input = args[reduce + 1];
+  bool list = arg_count == reduce + 2;
+  if ( list ) {
+    if ( !IS_LIST(input) ) return ERROR_VAL("Expected a list or an integer range.");
+    if ( AS_LIST(input)->count == 0 )
+      return reduce ? NIL_VAL : OBJECT_VAL(new_list(NULL, 0));
+  } else {
+    if ( !parallel_range(input, args[reduce + 2], &job.start, &job.end) )
+      return ERROR_VAL("Expected a list or an integer range.");
+    if ( job.end <= job.start ) {
+      if ( reduce ) return NIL_VAL;
+      return OBJECT_VAL(new_handle(OBJ_CHANNEL, &channel_new(NULL, 0)->shared));
+    }
+  }
+  message_init(&job.program);
+  message_init(&job.result);
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.finished, NULL);
+  const char* error = message_write(&job.program, args[0]);
+  if ( error == NULL && reduce ) error = message_write(&job.program, args[1]);
+  if ( error == NULL && list ) error = parallel_items(&job, AS_LIST(input));
+  if ( error == NULL ) error = parallel_run(&job);
+  Value result = NIL_VAL;
+  if ( error == NULL && reduce ) {
+    MessageReader reader;
+    message_reader_init(&reader, &job.result);
+    result = message_read_value(&reader);
+    message_reader_delete(&reader);
+    error = reader.error;
+  } else if ( error == NULL && list ) {
+    result = parallel_list(&job, &error);
+  } else if ( error == NULL ) {
+    // The queued results become the channel's messages.
+    Channel* channel = channel_new(NULL, 0);
+    for ( int chunk = 0; chunk < job.chunk_count; ++chunk ) {
+      if ( job.heads[chunk] == NULL ) continue;
+      if ( channel->tail == NULL ) channel->head = job.heads[chunk];
+      else channel->tail->next = job.heads[chunk];
+      channel->tail = job.tails[chunk];
+      job.heads[chunk] = NULL;
+    }
+    result = OBJECT_VAL(new_handle(OBJ_CHANNEL, &channel->shared));
+  }
+  parallel_job_delete(&job);
+  return error == NULL ? result : ERROR_VAL(error);
+}
+
+// parallel_map(fn, start, end): a channel holding fn(i) in order.
+// parallel_map(fn, list): a list holding fn(item) in order.
+Value parallel_map_native(Vm* vm, int arg_count, Value* args) {
+  if ( (arg_count != 2 && arg_count != 3) || !IS_CLOSURE(args[0])
+    || UNWRAP_CLOSURE(args[0])->arity != 1 )
+    return ERROR_VAL("Expected a one argument function and a range or a list.");
+  return parallel_native(vm, false, arg_count, args);
+}
+
+// parallel_reduce(fn, combine, start, end) or (fn, combine, list):
+// combine over fn(i) or fn(item).
+Value parallel_reduce_native(Vm* vm, int arg_count, Value* args) {
+  if ( (arg_count != 3 && arg_count != 4) || !IS_CLOSURE(args[0])
+    || UNWRAP_CLOSURE(args[0])->arity != 1 ||
+    !IS_CLOSURE(args[1]) || UNWRAP_CLOSURE(args[1])->arity != 2 )
+    return ERROR_VAL("Expected a function, a two argument combine and a range or a list.");
+  return parallel_native(vm, true, arg_count, args);
+}
+
+void setup_parallel_native() {
+  define_native("parallel_map", parallel_map_native);
+  define_native("parallel_reduce", parallel_reduce_native);
+}
+
+CLOX_END_DECLS
+
+#endif //_CLOX_PARALLEL_H
@@ -0,0 +1,196 @@
+#ifndef _CLOX_PROFILE_H
+#define _CLOX_PROFILE_H
+
+#include "common.h"
+#include "object.h"
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+
+CLOX_BEG_DECLS
+
+// Sampling profiler behind `clox --profile[=hz] script.lox`. A SIGPROF
+// timer interrupts the VM at hz samples per second of CPU time, the
+// handler walks vm->frames and counts the stack in a table allocated
+// up front, nothing is allocated or locked while sampling. At exit
+// the table is written to script.lox.folded, one line per stack:
+//
+//   script:12;main:7;fib:3 418
+//
+// which flamegraph.pl and speedscope read as is. Only the VM that
+// started the profiler is sampled: ticks landing on isolate threads,
+// during a collection or with no frames are counted as dropped.
+// Functions in recorded stacks are kept alive until the report.
+
+#define PROFILE_HZ 1000
+#define PROFILE_STACKS 8192 // Distinct stacks, a power of two.
+#define PROFILE_FRAMES (1 << 18) // Frames over all distinct stacks.
+
+typedef struct {
+  ObjectFunction* function;
+  int line;
+} ProfileFrame;
+
+typedef struct {
+  uint64_t hash;
+  uint64_t count; // Zero for free slots.
+  int frames; // Offset into Profiler.frames.
+  int depth;
+} ProfileStack;
+
+typedef struct {
+  Vm* vm;
+  char* path;
+  ProfileStack* stacks;
+  ProfileFrame* frames;
+  int stack_count;
+  int frame_count;
+  uint64_t samples;
+  uint64_t dropped;
+} Profiler;
+
+Profiler profiler = { NULL };
+
+bool profile_same_stack(ProfileStack* entry, ProfileFrame* stack, int depth) {
+  if ( entry->depth != depth ) return false;
+  ProfileFrame* frames = profiler.frames + entry->frames;
+  for ( int i = 0; i < depth; ++i )
+    if ( frames[i].function != stack[i].function || frames[i].line != stack[i].line )
+      return false;
+  return true;
+}
+
+// SIGPROF handler, runs on whichever thread was on the CPU with
+// SIGPROF blocked. Frames count once filled, see call_function.
+void profile_sample(int signal_number) {
+  Vm* instance = vm;
+  if ( instance != profiler.vm || instance->gc_collection_in_progress
+    || instance->frame_count <= 0 || instance->frame_count > FRAMES_MAX ) {
+    ++profiler.dropped;
+    return;
+  }
+  ProfileFrame stack[FRAMES_MAX];
+  int depth = instance->frame_count;
+  uint64_t hash = 14695981039346656037u;
+  for ( int i = 0; i < depth; ++i ) {
+    CallFrame* frame = &instance->frames[i];
+    ObjectFunction* function = frame->closure->function;
+    int offset = (int)(frame->ip - function->chunk.code);
+    stack[i].function = function;
+    // A frame about to run its first instruction is on its first line.
+    stack[i].line = function->chunk.lines[offset > 0 ? offset - 1 : 0];
+    hash = (hash ^ (uintptr_t)function) * 1099511628211u;
+    hash = (hash ^ (uint64_t)stack[i].line) * 1099511628211u;
+  }
+  int index = hash & (PROFILE_STACKS - 1);
+  for ( ;; index = (index + 1) & (PROFILE_STACKS - 1) ) {
+    ProfileStack* entry = &profiler.stacks[index];
+    if ( entry->count == 0 ) break;
+    if ( entry->hash == hash && profile_same_stack(entry, stack, depth) ) {
+      ++entry->count;
+      ++profiler.samples;
+      return;
+    }
+  }
+  // New stack, the table is kept at most three quarters full.
+  if ( profiler.stack_count >= PROFILE_STACKS / 4 * 3
+    || profiler.frame_count + depth > PROFILE_FRAMES ) {
+    ++profiler.dropped;
+    return;
+  }
+  memcpy(profiler.frames + profiler.frame_count, stack, sizeof(ProfileFrame) * depth);
+  profiler.stacks[index] = (ProfileStack){ hash, 1, profiler.frame_count, depth };
+  profiler.frame_count += depth;
+  ++profiler.stack_count;
+  ++profiler.samples;
+}
+
+void gc_mark_profile() {
+  if ( profiler.vm != vm ) return;
+  for ( int i = 0; i < profiler.frame_count; ++i )
+    gc_mark_object((Object*)profiler.frames[i].function);
+}
+
+void profile_write() {
+  FILE* out = fopen(profiler.path, "w");
+  if ( out == NULL ) {
+    fprintf(stderr, "Profile: cannot write '%s'.\n", profiler.path);
+    return;
+  }
+  for ( int index = 0; index < PROFILE_STACKS; ++index ) {
+    ProfileStack* entry = &profiler.stacks[index];
+    if ( entry->count == 0 ) continue;
+    ProfileFrame* frames = profiler.frames + entry->frames;
+    for ( int i = 0; i < entry->depth; ++i ) {
+      ObjectString* name = frames[i].function->name;
+      fprintf(out, "%s%s:%d", i ? ";" : "",
+        name != NULL ? name->chars : "script", frames[i].line);
+    }
+    fprintf(out, " %llu\n", (unsigned long long)entry->count);
+  }
+  fclose(out);
+  fprintf(stderr, "Profile: %llu samples (%llu dropped) written to '%s'.\n",
+    (unsigned long long)profiler.samples, (unsigned long long)profiler.dropped,
+    profiler.path);
+}
+
+void profile_handler(void (*handler)(int)) {
+  struct sigaction action = { 0 };
+  action.sa_handler = handler;
+  // Interrupted calls restart, samples never nest.
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaddset(&action.sa_mask, SIGPROF);
+  sigaction(SIGPROF, &action, NULL);
+}
+
+void profile_free() {
+  free(profiler.path);
+  free(profiler.stacks);
+  free(profiler.frames);
+  profiler = (Profiler){ NULL };
+}
+
+// Stops sampling and writes the report, safe to call more than once.
+// Must run before vm_delete frees the sampled functions.
+void profile_stop() {
+  if ( profiler.vm == NULL ) return;
+  struct itimerval off = { 0 };
+  setitimer(ITIMER_PROF, &off, NULL);
+  profile_handler(SIG_IGN);
+  profile_write();
+  profile_free();
+}
+
+// Profiles instance until profile_stop, which also runs at exit to
+// cover scripts calling exit().
+bool profile_start(Vm* instance, const char* script, int hz) {
+  if ( profiler.vm != NULL || hz <= 0 || hz > 1000000 ) return false;
+  if ( !strcmp(script, "-") ) script = "clox";
+  size_t length = strlen(script);
+  profiler.path = (char*)malloc(length + sizeof(".folded"));
+  profiler.stacks = (ProfileStack*)calloc(PROFILE_STACKS, sizeof(ProfileStack));
+  profiler.frames = (ProfileFrame*)malloc(sizeof(ProfileFrame) * PROFILE_FRAMES);
+  if ( profiler.path == NULL || profiler.stacks == NULL || profiler.frames == NULL )
+    exit(80);
+  memcpy(profiler.path, script, length);
+  memcpy(profiler.path + length, ".folded", sizeof(".folded"));
+  static bool registered = false;
+  if ( !registered ) registered = atexit(profile_stop) == 0;
+  profiler.vm = instance;
+  profile_handler(profile_sample);
+  struct timeval period = { 1 / hz, 1000000 / hz % 1000000 };
+  struct itimerval timer = { .it_interval = period, .it_value = period };
+  if ( setitimer(ITIMER_PROF, &timer, NULL) ) {
+    fprintf(stderr, "Profile: cannot start the timer: %s.\n", strerror(errno));
+    profile_handler(SIG_IGN);
+    profile_free();
+    return false;
+  }
+  return true;
+}
+
+CLOX_END_DECLS
+
+#endif //_CLOX_PROFILE_H
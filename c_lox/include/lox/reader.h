@@ -0,0 +1,165 @@
+#ifndef _CLOX_READER_H
+#define _CLOX_READER_H
+
+#include "common.h"
+#include "object.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+CLOX_BEG_DECLS
+
+// Readers: lines and fixed size records of a file or of stdin.
+//
+//   var errors = 0;
+//   for (var line in reader("app.log"))
+//     if (line == "ERROR") errors = errors + 1;
+//   var input = reader();              // stdin
+//   var header = read_record(input, 16);
+//   print read_line(input);
+//
+// Lines drop their "\n", the last one may have none. Both come back
+// as string views into the reader's bytes: a small string object per
+// line, no copy, no hash and no intern. Regular files, stdin
+// redirected from one too, are mapped whole. Pipes and terminals are
+// read in blocks, the part of a line at the end of a block starts the
+// next one. A view keeps its mapping or block alive, store "" + line
+// to keep a line without them. Map keys are copied already.
+
+#define READER_BLOCK_SIZE (64 * 1024)
+
+void reader_close_fd(ObjectReader* reader) {
+  if ( reader->fd >= 0 ) close(reader->fd);
+  reader->fd = -1;
+}
+
+// Takes over fd, which is closed once the input is mapped or read.
+ObjectReader* new_reader(int fd) {
+  ObjectReader* reader = ALLOCATE_OBJECT(ObjectReader, OBJ_READER);
+  reader->bytes = NULL;
+  reader->size = 0;
+  reader->position = 0;
+  reader->block = NULL;
+  reader->fd = fd;
+  reader->mapped = false;
+  struct stat info;
+  if ( fstat(fd, &info) || !S_ISREG(info.st_mode) || info.st_size == 0 ) return reader;
+  void* bytes = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if ( bytes == MAP_FAILED ) return reader;
+  posix_madvise(bytes, info.st_size, POSIX_MADV_SEQUENTIAL);
+  reader->bytes = (char*)bytes;
+  reader->size = info.st_size;
+  reader->mapped = true;
+  // stdin may have been read from already.
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  if ( offset > 0 ) reader->position = offset < info.st_size ? offset : info.st_size;
+  reader_close_fd(reader);
+  return reader;
+}
+
+void reader_delete(ObjectReader* reader) {
+  if ( reader->mapped ) munmap(reader->bytes, reader->size);
+  reader_close_fd(reader);
+}
+
+// Reads more of a pipe, false at its end. A full block is replaced by
+// one starting with the bytes not handed out yet, views keep the old
+// block. The reader must be reachable, a new block may collect.
+bool reader_more(ObjectReader* reader) {
+  if ( reader->fd < 0 ) return false;
+  ObjectString* block = reader->block;
+  if ( block == NULL || reader->size == (size_t)block->length ) {
+    size_t pending = reader->size - reader->position;
+    size_t capacity = pending * 2 > READER_BLOCK_SIZE ? pending * 2 : READER_BLOCK_SIZE;
+    if ( capacity > INT_MAX ) return false;
+    char* payload = ALLOCATE(char, capacity + 1);
+    payload[capacity] = '\0';
+    if ( pending ) memcpy(payload, reader->bytes + reader->position, pending);
+    reader->block = allocate_string_noi(payload, (int)capacity, 0);
+    reader->bytes = payload;
+    reader->size = pending;
+    reader->position = 0;
+  }
+  ssize_t count;
+  do count = read(reader->fd, reader->bytes + reader->size, reader->block->length - reader->size);
+  while ( count < 0 && errno == EINTR );
+  if ( count <= 0 ) {
+    reader_close_fd(reader);
+    return false;
+  }
+  reader->size += count;
+  return true;
+}
+
+// The next length bytes as a view, the reader must be reachable.
+Value reader_take(ObjectReader* reader, size_t length, size_t skip) {
+  if ( length > INT_MAX ) return ERROR_VAL("Line is too long.");
+  Object* owner = reader->mapped ? (Object*)reader : (Object*)reader->block;
+  ObjectString* view = new_string_view(owner, reader->bytes + reader->position, (int)length);
+  reader->position += length + skip;
+  return OBJECT_VAL(view);
+}
+
+// The next line, nil at the end of the input.
+Value reader_line(ObjectReader* reader) {
+  size_t scanned = 0; // Bytes known to hold no newline.
+  for ( ;; ) {
+    size_t pending = reader->size - reader->position;
+    if ( pending > scanned ) {
+      char* start = reader->bytes + reader->position;
+      char* newline = (char*)memchr(start + scanned, '\n', pending - scanned);
+      if ( newline != NULL ) return reader_take(reader, newline - start, 1);
+      scanned = pending;
+    }
+    if ( !reader_more(reader) ) break;
+  }
+  if ( reader->position == reader->size ) return NIL_VAL;
+  return reader_take(reader, reader->size - reader->position, 0);
+}
+
+// The next length bytes, fewer at the end, nil past it.
+Value reader_record(ObjectReader* reader, size_t length) {
+  while ( reader->size - reader->position < length && reader_more(reader) );
+  size_t pending = reader->size - reader->position;
+  if ( pending == 0 ) return NIL_VAL;
+  return reader_take(reader, pending < length ? pending : length, 0);
+}
+
+// reader(path) or reader() for stdin, nil when the file cannot be opened.
+Value reader_native(Vm* vm, int arg_count, Value* args) {
+  int fd;
+  if ( arg_count == 0 ) fd = dup(STDIN_FILENO);
+  else if ( arg_count == 1 && IS_STRING(*args) )
+    fd = open(string_intern(AS_STRING(*args))->chars, O_RDONLY | O_CLOEXEC);
+  else return ERROR_VAL("Expected a path or no argument for stdin.");
+  if ( fd < 0 ) return NIL_VAL;
+  return OBJECT_VAL(new_reader(fd));
+}
+
+Value read_line_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 1 || !IS_READER(*args) ) return ERROR_VAL("Expected a reader.");
+  return reader_line(AS_READER(*args));
+}
+
+Value read_record_native(Vm* vm, int arg_count, Value* args) {
+  if ( arg_count != 2 || !IS_READER(args[0]) || !IS_NUMBER(args[1])
+    || !(AS_NUMBER(args[1]) >= 1 && AS_NUMBER(args[1]) <= INT_MAX)
+    || AS_NUMBER(args[1]) != (int)AS_NUMBER(args[1]) )
+    return ERROR_VAL("Expected a reader and a positive record size.");
+  return reader_record(AS_READER(args[0]), (size_t)AS_NUMBER(args[1]));
+}
+
+void setup_reader_native() {
+  define_native("reader", reader_native);
+  define_native("read_line", read_line_native);
+  define_native("read_record", read_record_native);
+}
+
+#undef READER_BLOCK_SIZE
+
+CLOX_END_DECLS
+
+#endif //_CLOX_READER_H
@@ -2,6 +2,12 @@
 #define _CLOX_SCANNER_H
 
 #include "common.h"
+#include <unistd.h>
+
+#if defined(__SSE2__) && !defined(CLOX_NO_SIMD)
+# define CLOX_SCAN_SIMD
+# include <emmintrin.h>
+#endif
 
 CLOX_BEG_DECLS
 
@@ -9,6 +15,7 @@ typedef enum {
   // Single character tokens
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
   TOKEN_DOT, TOKEN_COMMA, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
 
@@ -38,21 +45,93 @@ typedef struct {
   int line;
 } Token;
 
+#ifndef CLOX_STREAM_CHUNK
+# define CLOX_STREAM_CHUNK 1024 * 64
+#endif // CLOX_STREAM_CHUNK
+
+typedef struct SourceChunk {
+  struct SourceChunk* next;
+  char chars[];
+} SourceChunk;
+
 typedef struct {
   const char* start;
   const char* current;
+  const char* end;
   int line;
+  // File descriptor while streaming, -1 otherwise: the scanner
+  // reads the next chunk whenever it reaches end. Earlier chunks
+  // stay alive until scanner_delete since tokens point into them.
+  int stream;
+  SourceChunk* chunks;
 } Scanner;
 
-Scanner scanner;
+// Compile state is per thread, a compile runs to completion
+// on the thread that started it.
+_Thread_local Scanner scanner;
 
-void scanner_init(const char* source) {
+void scanner_init_buffer(const char* source, size_t length) {
   scanner.line = 1;
   scanner.start = source;
   scanner.current = source;
+  scanner.end = source + length;
+  scanner.stream = -1;
+  scanner.chunks = NULL;
 }
 
-bool is_at_end() { return *scanner.current == '\0'; }
+void scanner_init(const char* source) {
+  scanner_init_buffer(source, strlen(source));
+}
+
+void scanner_init_stream(int stream) {
+  scanner_init_buffer(NULL, 0);
+  scanner.stream = stream;
+}
+
+void scanner_delete() {
+  SourceChunk* chunk;
+  while ( scanner.chunks != NULL ) {
+    chunk = scanner.chunks;
+    scanner.chunks = chunk->next;
+    free(chunk);
+  }
+  scanner.stream = -1;
+}
+
+// Reads the next chunk of the stream. The token being scanned
+// is carried over so it stays contiguous, the chunk grows with
+// it so a long token is copied an amortized constant number of times.
+bool scanner_fill() {
+  if ( scanner.stream < 0 ) return false;
+  size_t pending = scanner.end - scanner.start;
+  size_t capacity = CLOX_STREAM_CHUNK;
+  while ( capacity < pending * 2 ) capacity *= 2;
+  SourceChunk* chunk = (SourceChunk*)malloc(sizeof(SourceChunk) + capacity);
+  if ( chunk == NULL ) {
+    fputs("Cannot allocate enough memory.\n", stderr);
+    exit(74);
+  }
+  if ( pending ) memcpy(chunk->chars, scanner.start, pending);
+  size_t bytes = 0;
+  ssize_t count;
+  while ( pending + bytes < capacity &&
+    (count = read(scanner.stream, chunk->chars + pending + bytes,
+      capacity - pending - bytes)) > 0 )
+    bytes += count;
+  if ( bytes == 0 ) {
+    free(chunk);
+    scanner.stream = -1;
+    return false;
+  }
+  chunk->next = scanner.chunks;
+  scanner.chunks = chunk;
+  scanner.current = chunk->chars + (scanner.current - scanner.start);
+  scanner.start = chunk->chars;
+  scanner.end = chunk->chars + pending + bytes;
+  return true;
+}
+
+bool is_at_end() { return scanner.current >= scanner.end && !scanner_fill(); }
 bool isalphanum(char c) { return c == '_' || isalnum(c); }
 
 int lexlen();
@@ -74,9 +153,12 @@ Token error_token(const char* message) {
   return _make_token_impl(TOKEN_ERROR, message, (int)strlen(message));
 }
 
-char peek() { return *scanner.current; }
-char advance() { return *scanner.current++; }
-char peek_next() { return *(scanner.current + 1); }
+char peek() { return is_at_end() ? '\0' : *scanner.current; }
+char advance() { char c = peek(); scanner.current++; return c; }
+char peek_next() {
+  if ( scanner.current + 1 >= scanner.end ) scanner_fill();
+  return scanner.current + 1 < scanner.end ? scanner.current[1] : '\0';
+}
 
 bool match(char expected) {
   if ( peek() != expected )
@@ -84,75 +166,180 @@ bool match(char expected) {
   advance(); return true;
 }
 
+#ifdef CLOX_SCAN_SIMD
+// 16 byte blocks are only loaded while they end before scanner.end,
+// the scalar loops that follow each fast path handle the tail.
+# define SCAN_BLOCK 16
+# define SCAN_HAS_BLOCK() (scanner.end - scanner.current >= SCAN_BLOCK)
+
+__m128i _scan_load() {
+  return _mm_loadu_si128((const __m128i*)scanner.current);
+}
+
+uint32_t _scan_eq_mask(__m128i block, char c) {
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+// Bytes >= 0x80 are negative as signed chars and never match.
+uint32_t _scan_range_mask(__m128i block, char low, char high) {
+  return (uint32_t)_mm_movemask_epi8(_mm_and_si128(
+    _mm_cmpgt_epi8(block, _mm_set1_epi8(low - 1)),
+    _mm_cmplt_epi8(block, _mm_set1_epi8(high + 1))));
+}
+
+uint32_t _scan_digit_mask(__m128i block) {
+  return _scan_range_mask(block, '0', '9');
+}
+
+uint32_t _scan_alphanum_mask(__m128i block) {
+  __m128i lower = _mm_or_si128(block, _mm_set1_epi8(0x20));
+  return _scan_range_mask(lower, 'a', 'z') |
+    _scan_digit_mask(block) | _scan_eq_mask(block, '_');
+}
+
+// Length of the leading run of set bits, SCAN_BLOCK if all are set.
+int _scan_run(uint32_t mask) {
+  return __builtin_ctz(~mask);
+}
+
+int _scan_lines_before(uint32_t newlines, int run) {
+  return __builtin_popcount(newlines & ((1u << run) - 1));
+}
+#endif // CLOX_SCAN_SIMD
+
+#ifdef CLOX_SCAN_SIMD
+void _skip_string_blocks() {
+  while ( SCAN_HAS_BLOCK() ) {
+    __m128i block = _scan_load();
+    uint32_t newlines = _scan_eq_mask(block, '\n');
+    uint32_t stops = _scan_eq_mask(block, '"');
+    int run = stops ? __builtin_ctz(stops) : SCAN_BLOCK;
+    scanner.line += _scan_lines_before(newlines, run);
+    scanner.current += run;
+    if ( run < SCAN_BLOCK ) return;
+  }
+}
+#endif // CLOX_SCAN_SIMD
+
 Token string() {
-  while ( peek() != '"' )
+  for ( ;;) {
+#ifdef CLOX_SCAN_SIMD
+    _skip_string_blocks();
+#endif // CLOX_SCAN_SIMD
+    if ( peek() == '"' ) break;
+    if ( is_at_end() ) return error_token("Unterminated string.");
     if ( advance() == '\n' ) scanner.line++;
-    else if ( is_at_end() )
-      return error_token("Unterminated string.");
+  }
   advance(); // Consume the closing quote
   return make_token(TOKEN_STRING);
 }
 
+#ifdef CLOX_SCAN_SIMD
+void _skip_whitespace_blocks() {
+  while ( SCAN_HAS_BLOCK() ) {
+    __m128i block = _scan_load();
+    uint32_t newlines = _scan_eq_mask(block, '\n');
+    int run = _scan_run(newlines |
+      _scan_eq_mask(block, ' ') | _scan_eq_mask(block, '\t'));
+    scanner.line += _scan_lines_before(newlines, run);
+    scanner.current += run;
+    if ( run < SCAN_BLOCK ) return;
+  }
+}
+#endif // CLOX_SCAN_SIMD
+
 void skip_whitespace() {
+  scanner.start = scanner.current; // Nothing to carry over on refill
   for ( ;;)
     switch ( peek() ) {
     default: return;
     case '\n': scanner.line++;
     case ' ':
     case '\t': advance();
+#ifdef CLOX_SCAN_SIMD
+      // Single separators stay scalar, longer runs
+      // such as indentation go a block at a time.
+      if ( peek() == ' ' || peek() == '\t' || peek() == '\n' )
+        _skip_whitespace_blocks();
+#endif // CLOX_SCAN_SIMD
     }
 }
 
-Token number() {
+void skip_digits() {
+#ifdef CLOX_SCAN_SIMD
+  while ( SCAN_HAS_BLOCK() ) {
+    int run = _scan_run(_scan_digit_mask(_scan_load()));
+    scanner.current += run;
+    if ( run < SCAN_BLOCK ) return;
+  }
+#endif // CLOX_SCAN_SIMD
   while ( isdigit(peek()) ) advance();
+}
+
+Token number() {
+  skip_digits();
   if ( match('.') )
-    if ( isdigit(peek()) ) while ( isdigit(peek()) ) advance();
+    if ( isdigit(peek()) ) skip_digits();
     else return error_token("Expect atleast one digit after decimal point.");
   return make_token(TOKEN_NUMBER);
 }
 
-TokenType check_keyword(int start, int length, const char* rest, TokenType type) {
-  if ( lexlen() == start + length &&
-    !memcmp(scanner.start + start, rest, length) )
-    return type;
-  return TOKEN_IDENTIFIER;
-}
-
 int lexlen() { return (int)(scanner.current - scanner.start); }
 
+typedef struct {
+  const char* name;
+  int length;
+  TokenType type;
+} Keyword;
+
+// Perfect hash over the keywords: every keyword is 2 to 6
+// characters long and (second_char * 6 + length) & 31 is
+// unique among them, so one probe and a memcmp decide.
+#define KEYWORD_HASH(start, length) (((uint8_t)(start)[1] * 6 + (length)) & 31)
+#define KEYWORD(word, second, type) \
+  [(second * 6 + sizeof(word) - 1) & 31] = { word, sizeof(word) - 1, TOKEN##type }
+
+Keyword keywords[32] = {
+  KEYWORD("and", 'n', _AND),
+  KEYWORD("class", 'l', _CLASS),
+  KEYWORD("else", 'l', _ELSE),
+  KEYWORD("false", 'a', _FALSE),
+  KEYWORD("for", 'o', _FOR),
+  KEYWORD("fun", 'u', _FUN),
+  KEYWORD("if", 'f', _IF),
+  KEYWORD("nil", 'i', _NIL),
+  KEYWORD("or", 'r', _OR),
+  KEYWORD("print", 'r', _PRINT),
+  KEYWORD("return", 'e', _RETURN),
+  KEYWORD("super", 'u', _SUPER),
+  KEYWORD("this", 'h', _THIS),
+  KEYWORD("true", 'r', _TRUE),
+  KEYWORD("var", 'a', _VAR),
+  KEYWORD("while", 'h', _WHILE),
+};
+
+#undef KEYWORD
+
 TokenType identifier_type() {
-  switch ( *scanner.start ) {
-  case 'a': return check_keyword(1, 2, "nd", TOKEN_AND);
-  case 'c': return check_keyword(1, 4, "lass", TOKEN_CLASS);
-  case 'e': return check_keyword(1, 3, "lse", TOKEN_ELSE);
-  case 'f':
-    if ( lexlen() > 1 )
-      switch ( *(scanner.start + 1) ) {
-      case 'a': return check_keyword(2, 3, "lse", TOKEN_FALSE);
-      case 'o': return check_keyword(2, 1, "r", TOKEN_FOR);
-      case 'u': return check_keyword(2, 1, "n", TOKEN_FUN);
-      }
-    break;
-  case 'i': return check_keyword(1, 1, "f", TOKEN_IF);
-  case 'n': return check_keyword(1, 2, "il", TOKEN_NIL);
-  case 'o': return check_keyword(1, 1, "r", TOKEN_OR);
-  case 'p': return check_keyword(1, 4, "rint", TOKEN_PRINT);
-  case 'r': return check_keyword(1, 5, "eturn", TOKEN_RETURN);
-  case 's': return check_keyword(1, 4, "uper", TOKEN_SUPER);
-  case 't':
-    if ( lexlen() > 1 )
-      switch ( *(scanner.start + 1) ) {
-      case 'h': return check_keyword(2, 2, "is", TOKEN_THIS);
-      case 'r': return check_keyword(2, 2, "ue", TOKEN_TRUE);
-      }
-    break;
-  case 'v': return check_keyword(1, 2, "ar", TOKEN_VAR);
-  case 'w': return check_keyword(1, 4, "hile", TOKEN_WHILE);
-  }
+  int length = lexlen();
+  if ( length < 2 || length > 6 ) return TOKEN_IDENTIFIER;
+  Keyword* keyword = keywords + KEYWORD_HASH(scanner.start, length);
+  if ( keyword->length == length &&
+    !memcmp(scanner.start, keyword->name, length) )
+    return keyword->type;
   return TOKEN_IDENTIFIER;
 }
 
+#undef KEYWORD_HASH
+
 Token identifier() {
+#ifdef CLOX_SCAN_SIMD
+  while ( SCAN_HAS_BLOCK() ) {
+    int run = _scan_run(_scan_alphanum_mask(_scan_load()));
+    scanner.current += run;
+    if ( run < SCAN_BLOCK ) return make_token(identifier_type());
+  }
+#endif // CLOX_SCAN_SIMD
   while ( isalphanum(peek()) ) advance();
   return make_token(identifier_type());
 }
@@ -160,6 +347,7 @@ Token identifier() {
 Token scan();
 
 bool _consume_multiline_comment() {
+  scanner.start = scanner.current;
   while ( !is_at_end() ) switch ( peek() ) {
   case '*': if ( (advance(), match('/')) )
     return true;
@@ -170,6 +358,7 @@ bool _consume_multiline_comment() {
 }
 
 void _consume_oneline_comment() {
+  scanner.start = scanner.current;
   while ( peek() != '\n' && !is_at_end() ) advance();
 }
 
@@ -212,6 +401,8 @@ Token scan() {
   case '{': return make_token(TOKEN_LEFT_BRACE);
   case ')': return make_token(TOKEN_RIGHT_PAREN);
   case '}': return make_token(TOKEN_RIGHT_BRACE);
+  case '[': return make_token(TOKEN_LEFT_BRACKET);
+  case ']': return make_token(TOKEN_RIGHT_BRACKET);
   case '!': return make_token(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
   case '<': return make_token(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
   case '=': return make_token(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
@@ -221,6 +412,11 @@ Token scan() {
   }
 }
 
+#ifdef CLOX_SCAN_SIMD
+# undef SCAN_BLOCK
+# undef SCAN_HAS_BLOCK
+#endif // CLOX_SCAN_SIMD
+
 #define CSTKTP(type) case TOKEN##type: return #type + 1
 
 const char* strtokentype(TokenType type) {
@@ -229,6 +425,8 @@ const char* strtokentype(TokenType type) {
     CSTKTP(_RIGHT_PAREN);
     CSTKTP(_LEFT_BRACE);
     CSTKTP(_RIGHT_BRACE);
+    CSTKTP(_LEFT_BRACKET);
+    CSTKTP(_RIGHT_BRACKET);
     CSTKTP(_COMMA);
     CSTKTP(_DOT);
     CSTKTP(_MINUS);
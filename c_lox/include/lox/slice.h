@@ -0,0 +1,113 @@
+#ifndef _CLOX_SLICE_H
+#define _CLOX_SLICE_H
+
+#include "common.h"
+#include "object.h"
+
+CLOX_BEG_DECLS
+
+// Slices: substrings sharing the chars of the string they come from.
+//
+//   var line = "GET /index.html 200";
+//   var fields = split(line);          // ["GET", "/index.html", "200"]
+//   var path = fields[1];
+//   print substring(path, 1, find(path, "."));   // index
+//   print split("a,b,,c", ",");        // ["a", "b", "", "c"]
+//
+// Slices are string views, see new_string_view: no copy, no hash and
+// no intern, the slice keeps its parent alive. A slice of a slice or
+// of a reader's line shares the same chars. Slices equal the strings
+// they spell and are interned when they become map keys.
+
+// Whether value is an integer in [low, high].
+bool slice_index(Value value, int low, int high) {
+  return IS_NUMBER(value) && AS_NUMBER(value) >= low && AS_NUMBER(value) <= high
+    && AS_NUMBER(value) == (int)AS_NUMBER(value);
+}
+
+// The chars [start, end) of string, which must be reachable.
+Value slice_string(ObjectString* string, int start, int end) {
+  if ( start == 0 && end == string->length ) return OBJECT_VAL(string);
+  return OBJECT_VAL(new_string_view((Object*)string, string->chars + start, end - start));
+}
+
+// First index of needle in chars from start on, -1 if there is none.
+int slice_find(ObjectString* string, ObjectString* needle, int start) {
+  if ( needle->length == 0 ) return start;
+  if ( needle->length > string->length - start ) return -1;
+  const char* last = string->chars + string->length - needle->length;
+  for ( const char* at = string->chars + start; at <= last; ++at ) {
+    at = (const char*)memchr(at, needle->chars[0], last - at + 1);
+    if ( at == NULL ) return -1;
+    if ( !memcmp(at, needle->chars, needle->length) ) return (int)(at - string->chars);
+  }
+  return -1;
+}
+
+// substring(string, start, end = length(string)), end is excluded.
+Value substring_native(Vm* vm, int arg_count, Value* args) {
+  if ( (arg_count != 2 && arg_count != 3) || !IS_STRING(args[0]) )
+    return ERROR_VAL("Expected a string, a start and an end index.");
+  ObjectString* string = AS_STRING(args[0]);
+  if ( arg_count == 3 && !slice_index(args[2], 0, string->length) )
+    return ERROR_VAL("Substring end out of range.");
+  int end = arg_count == 3 ? (int)AS_NUMBER(args[2]) : string->length;
+  if ( !slice_index(args[1], 0, end) ) return ERROR_VAL("Substring start out of range.");
+  return slice_string(string, (int)AS_NUMBER(args[1]), end);
+}
+
+// find(string, needle, start = 0) is the index of needle, nil if missing.
+Value find_native(Vm* vm, int arg_count, Value* args) {
+  if ( (arg_count != 2 && arg_count != 3) || !IS_STRING(args[0]) || !IS_STRING(args[1]) )
+    return ERROR_VAL("Expected a string, a string to find and a start index.");
+  ObjectString* string = AS_STRING(args[0]);
+  if ( arg_count == 3 && !slice_index(args[2], 0, string->length) )
+    return ERROR_VAL("Start index out of range.");
+  int index = slice_find(string, AS_STRING(args[1]), arg_count == 3 ? (int)AS_NUMBER(args[2]) : 0);
+  return index < 0 ? NIL_VAL : int_value(index);
+}
+
+// Appends [start, end) of string to the list on top of the stack.
+void slice_append(ObjectString* string, int start, int end) {
+  stack_push(slice_string(string, start, end));
+  list_append(AS_LIST(stack_peek(1)), stack_peek(0));
+  stack_pop();
+}
+
+// split(string, separator) lists the parts between separators,
+// split(string) the runs of characters other than spaces and tabs.
+Value split_native(Vm* vm, int arg_count, Value* args) {
+  if ( (arg_count != 1 && arg_count != 2) || !IS_STRING(args[0])
+    || (arg_count == 2 && (!IS_STRING(args[1]) || AS_STRING(args[1])->length == 0)) )
+    return ERROR_VAL("Expected a string and a non-empty separator.");
+  ObjectString* string = AS_STRING(args[0]);
+  stack_push(OBJECT_VAL(new_list(NULL, 0)));
+  if ( arg_count == 2 ) {
+    ObjectString* separator = AS_STRING(args[1]);
+    int start = 0, end;
+    while ( (end = slice_find(string, separator, start)) >= 0 ) {
+      slice_append(string, start, end);
+      start = end + separator->length;
+    }
+    slice_append(string, start, string->length);
+  } else {
+    const char* chars = string->chars;
+    for ( int i = 0, start; i < string->length; ) {
+      while ( i < string->length && (chars[i] == ' ' || chars[i] == '\t') ) ++i;
+      if ( i == string->length ) break;
+      for ( start = i; i < string->length && chars[i] != ' ' && chars[i] != '\t'; ++i );
+      slice_append(string, start, i);
+    }
+  }
+  return stack_pop();
+}
+
+void setup_slice_native() {
+  define_native("substring", substring_native);
+  define_native("find", find_native);
+  define_native("split", split_native);
+}
+
+CLOX_END_DECLS
+
+#endif //_CLOX_SLICE_H
@@ -152,10 +152,10 @@ bool table_set(Table* table, ObjectString* key, Value value) {
 }
 
 void table_concat(Table* to, Table* from) {
-  Entry* e = from->entries;
-  int cap = from->capacity;
-  for ( ; cap TAB_COMP_OP 0; --cap, ++e ) if ( e->key )
-    table_set(to, e->key, e->value);
+  for ( int idx = 0; idx TAB_COMP_OP from->capacity; idx++ ) {
+    Entry* e = from->entries + idx;
+    if ( e->key ) table_set(to, e->key, e->value);
+  }
 }
 
 bool table_get(Table* table, ObjectString* key, Value* value) {
@@ -177,17 +177,17 @@ bool table_del(Table* table, ObjectString* key) {
 
 void entry_print(Entry* entry) {
   value_oprint(OBJECT_VAL(entry->key));
-  printf(": ");
+  output_string(": ");
   value_print(entry->value);
 }
 
 void table_print(Table* table) {
   Entry* e = table->entries;
   int c = table->capacity;
-  putchar('{');
+  output_string("{");
   for ( ; c TAB_COMP_OP 0; --c, ++e ) if ( e->key )
-    entry_print(e), printf(", ");
-  putchar('}');
+    entry_print(e), output_string(", ");
+  output_string("}");
 }
 
 #endif //_CLOX_TABLE_H
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include "memory.h"
 #include "common.h"
+#include "dtoa.h"
 
 CLOX_BEG_DECLS
 
@@ -18,19 +19,34 @@ typedef  uint64_t Value;
 # define _QNAN      0x7f'f8'00'00'00'00'00'00 // 2nd to 13th are on
 # define _SIGN_BIT  0x80'00'00'00'00'00'00'00 // 1 << 63   1st bit is on
 # define _ERROR_BIT 0x00'04'00'00'00'00'00'00 // 1 << 49   15th bit is on
+# define _INT_BIT   0x00'01'00'00'00'00'00'00 // 1 << 48   16th bit is on
 # define _TAG_NIL   1
 # define _TAG_FALSE 2
 # define _TAG_TRUE  3
 # define _OBJECT_BITS (_SIGN_BIT | _QNAN)
 # define _ERROR_BITS  (_OBJECT_BITS | _ERROR_BIT)
-
-Value _double_to_value(double num) { return *((Value*)&num); }
+# define _INT_BITS    (_QNAN | _INT_BIT)
+// Every quiet NaN is a tag, computed NaNs are stored as this
+// signalling one, which the FPU still reads as NaN.
+# define _NAN_BITS    0x7f'f4'00'00'00'00'00'00
+
+// Small integers live in the low 32 bits of a quiet NaN
+// tagged with _INT_BIT, they never reach the FPU.
+# define INT_VAL(num) ((Value)(_INT_BITS | (uint32_t)(int32_t)(num)))
+# define AS_INT(val) ((int32_t)(uint32_t)(val))
+# define IS_INT(val) (((val) & (_SIGN_BIT | _INT_BITS)) == _INT_BITS)
+# define IS_DOUBLE(val) (((val) & _QNAN) != _QNAN)
+
+Value _double_to_value(double num) { return num == num ? *((Value*)&num) : _NAN_BITS; }
 double _value_to_double(Value val) { return *((double*)&val); }
+double _value_to_number(Value val) {
+  return IS_INT(val) ? (double)AS_INT(val) : _value_to_double(val);
+}
 
 // Lox NaN-Tagging Value macros
 # define NUMBER_VAL(num) _double_to_value(num)
-# define AS_NUMBER(val) _value_to_double(val)
-# define IS_NUMBER(val) (((val) & _QNAN) != _QNAN)
+# define AS_NUMBER(val) _value_to_number(val)
+# define IS_NUMBER(val) (IS_DOUBLE(val) || IS_INT(val))
 
 # define NIL_VAL ((Value)(_QNAN | _TAG_NIL))
 # define IS_NIL(val) ((val) == NIL_VAL)
@@ -39,7 +55,7 @@ double _value_to_double(Value val) { return *((double*)&val); }
 # define TRUE_VAL ((Value)(_QNAN | _TAG_TRUE))
 # define BOOL_VAL(val) ((val)? TRUE_VAL: FALSE_VAL)
 # define AS_BOOL(val) ((val) == TRUE_VAL)
-# define IS_BOOL(val) (((val) | _TAG_TRUE) == TRUE_VAL)
+# define IS_BOOL(val) (((val) | 1) == TRUE_VAL)
 
 # define OBJECT_VAL(ptr) ((Value)(_OBJECT_BITS | (uint64_t)(ptr)))
 # define AS_OBJECT(val) ((Object*)((val) & ~_OBJECT_BITS))
@@ -95,6 +111,20 @@ typedef struct {
 Value stack_pop();
 void stack_push(Value);
 
+// True if num survives a round trip through int32_t.
+bool is_int_number(double num) {
+  return num >= INT32_MIN && num <= INT32_MAX && num == (int32_t)num;
+}
+
+// Integers as the compiler emits them, see expr_number.
+Value int_value(int32_t num) {
+#ifdef NAN_BOXING_OPT
+  return INT_VAL(num);
+#else
+  return NUMBER_VAL((double)num);
+#endif // NAN_BOXING_OPT
+}
+
 typedef struct {
   Value* values;
   int capacity;
@@ -122,21 +152,97 @@ void value_append(ValueArray* array, Value value) {
 
 void value_oprint(Value object);
 
+// Where value_print writes: the running VM's output buffer, which
+// print statements fill without taking stdio's lock, see vm.h.
+typedef struct {
+  char* bytes;
+  int count;
+  int capacity; // 0 writes straight to stdout.
+  bool tty; // Flushed after every print statement.
+} Output;
+
+void output_write(const char*, int);
+void output_printf(const char*, ...);
+void output_flush();
+
+void output_string(const char* chars) {
+  output_write(chars, (int)strlen(chars));
+}
+
+// Fewest digits reading back as the same double, laid out like
+// "%g": positional from 1e-4 on, exponents below that and from 1e17
+// on (1.5e-07, 1e+21). Numbers below 1e17 keep their integer digits,
+// 10 rather than 1e+01. buffer must hold NUMBER_FORMAT_MAX bytes,
+// returns the length.
+#define NUMBER_FORMAT_MAX 32
+int number_format(double number, char* buffer) {
+  if ( number != number || number - number != 0 )
+    return snprintf(buffer, NUMBER_FORMAT_MAX, "%g", number);
+  char* out = buffer;
+  if ( number < 0 || (number == 0 && 1 / number < 0) ) {
+    *out++ = '-';
+    number = -number;
+  }
+  if ( number == 0 ) {
+    *out++ = '0';
+    *out = '\0';
+    return (int)(out - buffer);
+  }
+  char digits[20];
+  int length, exponent;
+  if ( !dtoa_grisu3(number, digits, &length, &exponent) )
+    length = dtoa_fallback(number, digits, &exponent);
+  int point = length + exponent; // Digits before the decimal point.
+  if ( point > -4 && point <= 17 ) {
+    if ( point <= 0 ) {
+      *out++ = '0';
+      *out++ = '.';
+      for ( ; point < 0; ++point ) *out++ = '0';
+      memcpy(out, digits, length);
+      out += length;
+    } else if ( point >= length ) {
+      memcpy(out, digits, length);
+      out += length;
+      for ( ; point > length; --point ) *out++ = '0';
+    } else {
+      memcpy(out, digits, point);
+      out += point;
+      *out++ = '.';
+      memcpy(out, digits + point, length - point);
+      out += length - point;
+    }
+    *out = '\0';
+    return (int)(out - buffer);
+  }
+  *out++ = digits[0];
+  if ( length > 1 ) {
+    *out++ = '.';
+    memcpy(out, digits + 1, length - 1);
+    out += length - 1;
+  }
+  return (int)(out - buffer) + snprintf(out, 8, "e%c%02d", point > 0 ? '+' : '-', abs(point - 1));
+}
+
+void number_print(double number) {
+  char buffer[NUMBER_FORMAT_MAX];
+  output_write(buffer, number_format(number, buffer));
+}
+
 void value_print(Value value) {
 #ifdef NAN_BOXING_OPT
-  if ( IS_NUMBER(value) ) printf("%g", AS_NUMBER(value));
-  else if ( IS_BOOL(value) ) printf(AS_BOOL(value) ? "true" : "false");
-  else if ( IS_NIL(value) ) printf("nil");
+  if ( IS_NUMBER(value) ) number_print(AS_NUMBER(value));
+  else if ( IS_BOOL(value) ) output_string(AS_BOOL(value) ? "true" : "false");
+  else if ( IS_NIL(value) ) output_string("nil");
   else if ( IS_OBJECT(value) ) value_oprint(value);
-  else if ( IS_ERROR(value) ) printf("(Error: '%s')", AS_ERROR(value));
-  else printf("Unknown Value: %ld", value);
+  else if ( IS_ERROR(value) ) output_printf("(Error: '%s')", AS_ERROR(value));
+  else output_printf("Unknown Value: %ld", value);
 #else
   switch ( value.type ) {
-  case VAL_BOOL:   printf(AS_BOOL(value) ? "true" : "false");  break;
-  case VAL_NUMBER: printf("%g", AS_NUMBER(value));             break;
-  case VAL_OBJECT: value_oprint(value);                        break;
-  case VAL_NIL: printf("nil");                                 break;
-  default: printf("Unknown Value: %d", value.type);            break;
+  case VAL_BOOL:   output_string(AS_BOOL(value) ? "true" : "false"); break;
+  case VAL_NUMBER: number_print(AS_NUMBER(value));                   break;
+  case VAL_OBJECT: value_oprint(value);                              break;
+  case VAL_NIL: output_string("nil");                                break;
+  default: output_printf("Unknown Value: %d", value.type);           break;
   }
 #endif
 }
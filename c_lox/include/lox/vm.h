@@ -8,13 +8,17 @@
 #include "debug.h"
 #include "value.h"
 #include <time.h>
-#include "natives.h"
+#include <signal.h>
+#include "cache.h"
 
 CLOX_BEG_DECLS
 
-#define TOP_FRAME() (&vm.frames[vm.frame_count - 1])
-#define CHUNK() (TOP_FRAME()->closure->function->chunk)
-#define VMIP() (TOP_FRAME()->ip)
+#define TOP_FRAME() (&vm->frames[vm->frame_count - 1])
+// run() keeps the top frame in a local, reloaded after anything
+// that may push, pop or switch frames (calls, returns, fibers).
+#define CHUNK() (frame->closure->function->chunk)
+#define VMIP() (frame->ip)
+#define LOAD_FRAME() (frame = TOP_FRAME())
 #define READ_BYTE() (*VMIP()++)
 #define READ_CONSTANT() (CHUNK().constants.values[READ_BYTE()])
 #define FRAMES_MAX 64
@@ -30,32 +34,93 @@ CLOX_BEG_DECLS
     double a = AS_NUMBER(stack_pop());                               \
     stack_push(Type(a op b));                                        \
   } while(false)
+#ifdef NAN_BOXING_OPT
+// Integer fast paths, they fall through to BINARY_OP on overflow
+// or when either operand is not a small integer.
+# define INT_BINARY_OP(overflow)                                     \
+  if (IS_INT(stack_peek(0)) && IS_INT(stack_peek(1))) {              \
+    int32_t result;                                                  \
+    if (!overflow(AS_INT(stack_peek(1)), AS_INT(stack_peek(0)),      \
+      &result)) {                                                    \
+      vm->stack_top[-2] = INT_VAL(result);                            \
+      vm->stack_top--;                                                \
+      break;                                                         \
+    }                                                                \
+  }
+# define INT_COMPARE_OP(op)                                          \
+  if (IS_INT(stack_peek(0)) && IS_INT(stack_peek(1))) {              \
+    bool result = AS_INT(stack_peek(1)) op AS_INT(stack_peek(0));    \
+    vm->stack_top[-2] = BOOL_VAL(result);                             \
+    vm->stack_top--;                                                  \
+    break;                                                           \
+  }
+#else
+# define INT_BINARY_OP(overflow)
+# define INT_COMPARE_OP(op)
+#endif // NAN_BOXING_OPT
 #define READ_SHORT() (VMIP() += 2, (uint16_t)((VMIP()[-2] << 8) | VMIP()[-1]))
 #define BOOL_COND() is_false(stack_peek(0))
 
-typedef struct {
-  // ObjectFunction *function;
-  ObjectClosure* closure;
-  uint8_t* ip;
-  Value* slots;
-} CallFrame;
+// Everything a running interpreter owns. Any number of VMs may
+// exist, each thread works on the one its vm pointer refers to.
+typedef struct EventLoop EventLoop;
+typedef struct OpStats OpStats;
+typedef struct AllocStats AllocStats;
+
+// Methods found by name, see class_method. Entries go stale when
+// their class is collected, collect_garbage clears them all.
+#define METHOD_CACHE_SIZE 256
 
 typedef struct {
-  CallFrame frames[FRAMES_MAX];
+  ObjectClass* klass;
+  ObjectString* name;
+  Value method;
+} MethodCacheEntry;
+
+struct Vm {
+  // Registers of the running fiber, see fiber.h.
+  CallFrame* frames;
   int frame_count;
-  Value stack[STACK_MAX];
+  Value* stack;
   Value* stack_top;
+  ObjectUpvalue* open_upvalues;
+  int frame_capacity;
+  Value* stack_limit; // A call needs UINT8_COUNT free slots past it.
+  ObjectFiber* fiber;
+  // The fiber scripts start on, its stacks are the arrays below.
+  ObjectFiber* main_fiber;
+  CallFrame main_frames[FRAMES_MAX];
+  Value main_stack[STACK_MAX];
   Object* objects;
   Table strings;
   Table globals;
-  ObjectUpvalue* open_upvalues;
   int gray_count;
   int gray_capacity;
   Object** gray_stack;
   ObjectString* init_string;
   size_t bytes_alloc;
   size_t next_gc;
-} Vm;
+  // True if Garbage Collector is collecting.
+  // Simple mutex to allow GC invocations when
+  // false and ignore when true.
+  bool gc_collection_in_progress;
+  // Collections are skipped while positive, see compile_scanner.
+  int gc_pause_count;
+  uint64_t start_time; // clock_nanoseconds() at vm_init.
+  // run() returns once a return brings frame_count down to it, see call_nested.
+  int run_base;
+  CacheImage* cache_images;
+  EventLoop* event_loop; // Created on first use, see eventloop.h.
+  ValueArray handles; // Closures pinned by call handles, see embed.h.
+  Output output; // Printed but not written yet, see output_write.
+  MethodCacheEntry method_cache[METHOD_CACHE_SIZE];
+#ifdef CLOX_OP_STATS
+  OpStats* op_stats; // Created by the first run, see opstats.h.
+#endif // CLOX_OP_STATS
+#ifdef CLOX_ALLOC_STATS
+  AllocStats* alloc_stats; // Created by the first allocation, see allocstats.h.
+#endif // CLOX_ALLOC_STATS
+};
 
 typedef enum {
   INTERPRET_OKAY,
@@ -63,45 +128,141 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-Vm vm;
-// True if Garbage Collector is collecting.
-// Initialize to true to prevent GC from ever running.
-// Simple mutex to allow GC invocations when
-// false and ignore when true.
-bool gc_collection_in_progress = false;
-long double vm_start_time = 0;
+// The VM the current thread is running, set by the entry
+// points (vm_init, interpret, run_file, repl and vm_delete).
+_Thread_local Vm* vm = NULL;
+
+// Raised by SIGUSR1, see heap.h, and by SIGINT, see interrupt_watch.
+// The VM acts on them in vm_safepoint.
+volatile sig_atomic_t heap_requested = 0;
+volatile sig_atomic_t interrupt_requested = 0;
+
+#include "natives.h"
+#include "opstats.h"
+#include "allocstats.h"
+
+// Returned by natives that switched fibers and set up
+// both stacks themselves, see call_value and fiber.h.
+const char fiber_switched[] = "Fiber switched.";
+// Returned by natives whose nested call failed, the error was
+// reported and the stack reset already, see call_nested.
+const char call_failed[] = "Call failed.";
+
+bool fiber_grow_frames();
+void fiber_grow_stack();
+void fiber_finish(Value);
+ObjectFiber* new_main_fiber();
+void loop_switch_next();
+Value loop_yield(int);
+void loop_reset();
+void gc_mark_event_loop();
+void gc_mark_array(ValueArray*);
+void gc_mark_profile();
+void vm_safepoint();
+void event_loop_delete(EventLoop*);
 
 ObjectString* take_string(char*, int);
 
 void stack_push(Value value) {
-  *vm.stack_top++ = value;
-  // *vm.stack_top = value;
-  // vm.stack_top++;
-}
-
-long double start_time() {
-  return vm_start_time;
+  *vm->stack_top++ = value;
+  // *vm->stack_top = value;
+  // vm->stack_top++;
 }
 
 ObjectString* table_find_istring(const char* payload, int size, uint64_t hash) {
-  return table_find_string(&vm.strings, payload, size, hash);
+  return table_find_string(&vm->strings, payload, size, hash);
 }
 
 Value stack_pop() {
-  // vm.stack_top--;
-  // return *vm.stack_top;
-  return *--vm.stack_top;
+  // vm->stack_top--;
+  // return *vm->stack_top;
+  return *--vm->stack_top;
 }
 
 Value stack_peek(int distance) {
-  return vm.stack_top[-1 - distance];
+  return vm->stack_top[-1 - distance];
 }
 
+#ifdef NAN_BOXING_OPT
+bool int_add_overflow(int32_t a, int32_t b, int32_t* result) {
+  return __builtin_add_overflow(a, b, result);
+}
+
+bool int_sub_overflow(int32_t a, int32_t b, int32_t* result) {
+  return __builtin_sub_overflow(a, b, result);
+}
+
+// A zero product with a negative operand is -0 as a double.
+bool int_mul_overflow(int32_t a, int32_t b, int32_t* result) {
+  return __builtin_mul_overflow(a, b, result) || (*result == 0 && (a | b) < 0);
+}
+#endif // NAN_BOXING_OPT
+
 void reset_stack();
 ObjectUpvalue* new_upvalue(Value*);
 ObjectUpvalue* capture_upvalue(Value*);
 
+// Print statements append to the VM's buffer, a full buffer goes out
+// in one fwrite. It is flushed before anything else may write to the
+// terminal or look at what was printed: errors, exit, the end of a
+// run, sends and spawns. Trace builds print their own lines in
+// between, they write straight through.
+#if defined(CLOX_STACK_TRACE) || defined(CLOX_INST_TRACE) || defined(CLOX_AINST_TRACE) \
+  || defined(CLOX_GC_LOG) || defined(CLOX_ODEL_TRACE)
+# define OUTPUT_CAPACITY 0
+#else
+# define OUTPUT_CAPACITY (64 * 1024)
+#endif
+
+// Also empties stdio's buffer, stderr must not overtake the output.
+void output_flush() {
+  if ( vm != NULL && vm->output.count ) {
+    fwrite(vm->output.bytes, 1, vm->output.count, stdout);
+    vm->output.count = 0;
+  }
+  fflush(stdout);
+}
+
+void output_write(const char* chars, int length) {
+  Output* output = vm != NULL ? &vm->output : NULL;
+  if ( output == NULL || output->capacity - output->count < length ) {
+    output_flush();
+    if ( output == NULL || output->capacity < length ) {
+      fwrite(chars, 1, length, stdout);
+      return;
+    }
+  }
+  memcpy(output->bytes + output->count, chars, length);
+  output->count += length;
+}
+
+void output_printf(const char* format, ...) {
+  char buffer[256];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  if ( length < (int)sizeof(buffer) ) {
+    output_write(buffer, length);
+    return;
+  }
+  char* chars = (char*)malloc(length + 1);
+  if ( chars == NULL ) exit(80);
+  va_start(args, format);
+  vsnprintf(chars, length + 1, format, args);
+  va_end(args);
+  output_write(chars, length);
+  free(chars);
+}
+
+void vm_print(Value value) {
+  value_print(value);
+  output_write("\n", 1);
+  if ( vm->output.tty ) output_flush();
+}
+
 void runtime_error(const char* format, ...) {
+  output_flush();
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
@@ -112,8 +273,8 @@ void runtime_error(const char* format, ...) {
   size_t instruction;
   ObjectFunction* function;
 
-  for ( int i = vm.frame_count - 1; i >= 0; --i ) {
-    frame = vm.frames + i;
+  for ( int i = vm->frame_count - 1; i >= 0; --i ) {
+    frame = vm->frames + i;
     function = frame->closure->function;
     instruction = frame->ip - function->chunk.code - 1;
     fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
@@ -123,16 +284,20 @@ void runtime_error(const char* format, ...) {
   reset_stack();
 }
 
-void define_native(const char* name, NativeFn function) {
+void define_native_arity(const char* name, NativeFn function, int arity) {
   stack_push(OBJECT_VAL(copy_string(name, strlen(name))));
-  stack_push(OBJECT_VAL(new_native(function, name)));
+  stack_push(OBJECT_VAL(new_native(function, name, arity)));
   ObjectString* str = AS_STRING(stack_peek(1));
   // printf("String['%s']: %p\n", str->chars, str);
-  table_set(&vm.globals, AS_STRING(stack_peek(1)), stack_peek(0));
+  table_set(&vm->globals, AS_STRING(stack_peek(1)), stack_peek(0));
   stack_pop();
   stack_pop();
 }
 
+void define_native(const char* name, NativeFn function) {
+  define_native_arity(name, function, -1);
+}
+
 bool is_false(Value value) {
   return IS_NIL(value) ||
     ((IS_NUMBER(value)) && AS_NUMBER(value) == 0) ||
@@ -142,16 +307,17 @@ bool is_false(Value value) {
 
 bool values_equal(Value a, Value b) {
 #ifdef NAN_BOXING_OPT
+  if ( IS_INT(a) && IS_INT(b) ) return a == b;
   if ( IS_NUMBER(a) && IS_NUMBER(b) )
     return AS_NUMBER(a) == AS_NUMBER(b);
-  return a == b;
+  return a == b || string_views_equal(a, b);
 #else
   if ( a.type != b.type ) return false;
   switch ( a.type ) {
   case VAL_NIL: return true;
   case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
   case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-  case VAL_OBJECT: return AS_OBJECT(a) == AS_OBJECT(b);
+  case VAL_OBJECT: return AS_OBJECT(a) == AS_OBJECT(b) || string_views_equal(a, b);
   default: printf("ValuesEqual: type=%d not defined.\n", a.type);
   }
 #endif
@@ -160,7 +326,7 @@ bool values_equal(Value a, Value b) {
 
 ObjectString* take_string(char* chars, int length) {
   uint64_t hash = hash_string(chars, length);
-  // ObjectString* string = table_find_string(&vm.strings, chars, length, hash);
+  // ObjectString* string = table_find_string(&vm->strings, chars, length, hash);
   // if ( string ) {
   //   FREE_ARRAY(char, chars, length + 1);
   //   return string;
@@ -190,15 +356,19 @@ bool call_function(ObjectClosure* closure, int arg_count) {
       function->arity, arg_count
     ); return false;
   }
-  if ( vm.frame_count == FRAMES_MAX ) {
+  if ( vm->frame_count == vm->frame_capacity && !fiber_grow_frames() ) {
     runtime_error("Call stack overflow.");
     return false;
   }
-  CallFrame* frame = &vm.frames[vm.frame_count++];
+  if ( vm->stack_top > vm->stack_limit ) fiber_grow_stack();
+  CallFrame* frame = &vm->frames[vm->frame_count];
   // frame->function = function;
   frame->closure = closure;
   frame->ip = function->chunk.code;
-  frame->slots = vm.stack_top - arg_count - 1;
+  frame->slots = vm->stack_top - arg_count - 1;
+  // The profiler's SIGPROF handler walks the frames up to frame_count.
+  __atomic_signal_fence(__ATOMIC_RELEASE);
+  ++vm->frame_count;
   return true;
 }
 
@@ -207,23 +377,30 @@ bool call_value(Value callee, int arg_count) {
     // case OBJ_FUNCTION: return call_function(AS_FUNCTION(callee), arg_count);
   case OBJ_CLOSURE:  return call_function(AS_CLOSURE(callee), arg_count);
   case OBJ_NATIVE: {
+    int arity = AS_NATIVE_OBJ(callee)->arity;
+    if ( arity >= 0 && arg_count != arity ) {
+      runtime_error("Expected %d arguments but got %d.", arity, arg_count);
+      return false;
+    }
     NativeFn native = AS_NATIVE(callee);
-    Value result = native(arg_count, vm.stack_top - arg_count);
-    vm.stack_top -= arg_count + 1;
+    Value result = native(vm, arg_count, vm->stack_top - arg_count);
+    if ( IS_ERROR(result) && AS_ERROR(result) == fiber_switched ) return true;
+    if ( IS_ERROR(result) && AS_ERROR(result) == call_failed ) return false;
+    vm->stack_top -= arg_count + 1;
     if ( IS_ERROR(result) ) {
-      printf("Error from ");
+      output_string("Error from ");
       value_oprint(callee);
-      printf(": %s\n", AS_ERROR(result));
+      output_printf(": %s\n", AS_ERROR(result));
+      output_flush();
     }
     stack_push(IS_ERROR(result) ? NIL_VAL : result);
     return !IS_ERROR(result);
   }
   case OBJ_CLASS: {
     ObjectClass* klass = AS_CLASS(callee);
-    vm.stack_top[-arg_count - 1] = OBJECT_VAL(new_instance(klass));
-    Value initializer;
-    if ( table_get(&klass->methods, vm.init_string, &initializer) )
-      return call_function(AS_CLOSURE(initializer), arg_count);
+    vm->stack_top[-arg_count - 1] = OBJECT_VAL(new_instance(klass));
+    if ( !IS_NIL(klass->initializer) )
+      return call_function(AS_CLOSURE(klass->initializer), arg_count);
     else if ( arg_count ) {
       runtime_error("Expected 0 arguments but got %d.", arg_count);
       return false;
@@ -232,7 +409,7 @@ bool call_value(Value callee, int arg_count) {
   }
   case OBJ_BOUND_METHOD: {
     ObjectBoundMethod* bound_method = AS_BOUND_METHOD(callee);
-    vm.stack_top[-arg_count - 1] = bound_method->receiver;
+    vm->stack_top[-arg_count - 1] = bound_method->receiver;
     return call_function(bound_method->method, arg_count);
   }
   }
@@ -242,24 +419,47 @@ bool call_value(Value callee, int arg_count) {
 
 void close_upvalues(Value* last) {
   ObjectUpvalue* upvalue;
-  while ( vm.open_upvalues != NULL && vm.open_upvalues->location >= last ) {
-    upvalue = vm.open_upvalues;
+  while ( vm->open_upvalues != NULL && vm->open_upvalues->location >= last ) {
+    upvalue = vm->open_upvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
-    vm.open_upvalues = upvalue->next;
+    vm->open_upvalues = upvalue->next;
   }
 }
 
+MethodCacheEntry* method_cache_entry(ObjectClass* klass, ObjectString* name) {
+  uint64_t key = ((uintptr_t)klass ^ ((uintptr_t)name << 16)) * 0x9e3779b97f4a7c15u;
+  return vm->method_cache + (key >> 56) % METHOD_CACHE_SIZE;
+}
+
+void method_cache_clear() {
+  for ( int i = 0; i < METHOD_CACHE_SIZE; ++i ) vm->method_cache[i].klass = NULL;
+}
+
+// Looks name up in the methods of klass, hits are kept in the cache.
+bool class_method(ObjectClass* klass, ObjectString* name, Value* method) {
+  MethodCacheEntry* entry = method_cache_entry(klass, name);
+  if ( entry->klass == klass && entry->name == name ) {
+    *method = entry->method;
+    return true;
+  }
+  if ( !table_get(&klass->methods, name, method) ) return false;
+  *entry = (MethodCacheEntry){ klass, name, *method };
+  return true;
+}
+
 void define_method(ObjectString* method_name) {
   Value method = stack_peek(0);
   ObjectClass* klass = AS_CLASS(stack_peek(1));
   table_set(&klass->methods, method_name, method);
+  method_cache_entry(klass, method_name)->klass = NULL;
+  if ( method_name == vm->init_string ) klass->initializer = method;
   stack_pop();
 }
 
 bool bind_method(ObjectClass* klass, ObjectString* name) {
   Value method;
-  if ( !table_get(&klass->methods, name, &method) ) return false;
+  if ( !class_method(klass, name, &method) ) return false;
   ObjectBoundMethod* bound_method = new_bound_method(stack_peek(0), AS_CLOSURE(method));
   stack_pop(); // Instance
   stack_push(OBJECT_VAL(bound_method));
@@ -268,7 +468,7 @@ bool bind_method(ObjectClass* klass, ObjectString* name) {
 
 bool invoke_from_class(ObjectClass* klass, ObjectString* method_name, int arg_count) {
   Value method;
-  if ( !table_get(&klass->methods, method_name, &method) ) {
+  if ( !class_method(klass, method_name, &method) ) {
     runtime_error("Undefined property '%s'.", method_name->chars);
     return false;
   }
@@ -284,25 +484,98 @@ bool invoke_property(ObjectString* property, int arg_count) {
   ObjectInstance* instance = AS_INSTANCE(receiver);
   Value field;
   if ( table_get(&instance->fields, property, &field) ) {
-    vm.stack_top[-arg_count - 1] = field;
+    vm->stack_top[-arg_count - 1] = field;
     return call_value(field, arg_count);
   }
   return invoke_from_class(instance->klass, property, arg_count);
 }
 
+// Position of index among count items, -1 after reporting an error.
+int item_position(Value index, int count) {
+  if ( !IS_NUMBER(index) ) {
+    runtime_error("Index must be a number.");
+    return -1;
+  }
+  double position = AS_NUMBER(index);
+  if ( !(position >= 0 && position < count) ) {
+    runtime_error("Index %g out of range for length %d.", position, count);
+    return -1;
+  }
+  if ( position != (int)position ) {
+    runtime_error("Index must be an integer.");
+    return -1;
+  }
+  return (int)position;
+}
+
+// target[index], the item replaces both on the stack.
+bool index_get() {
+  Value target = stack_peek(1);
+  int position;
+  if ( IS_LIST(target) ) {
+    if ( (position = item_position(stack_peek(0), AS_LIST(target)->count)) < 0 ) return false;
+    vm->stack_top[-2] = AS_LIST(target)->items[position];
+  } else if ( IS_F64_ARRAY(target) ) {
+    if ( (position = item_position(stack_peek(0), AS_F64_ARRAY(target)->count)) < 0 ) return false;
+    vm->stack_top[-2] = NUMBER_VAL(AS_F64_ARRAY(target)->values[position]);
+  } else if ( IS_MAP(target) ) {
+    if ( !map_get(AS_MAP(target), stack_peek(0), &vm->stack_top[-2]) )
+      vm->stack_top[-2] = NIL_VAL;
+  } else {
+    runtime_error("Only lists, arrays and maps can be indexed.");
+    return false;
+  }
+  vm->stack_top--;
+  return true;
+}
+
+// target[index] = value, the value replaces all three on the stack.
+bool index_set() {
+  Value target = stack_peek(2), value = stack_peek(0);
+  int position;
+  if ( IS_LIST(target) ) {
+    if ( (position = item_position(stack_peek(1), AS_LIST(target)->count)) < 0 ) return false;
+    AS_LIST(target)->items[position] = value;
+  } else if ( IS_F64_ARRAY(target) ) {
+    if ( (position = item_position(stack_peek(1), AS_F64_ARRAY(target)->count)) < 0 ) return false;
+    if ( !IS_NUMBER(value) ) {
+      runtime_error("Arrays can only hold numbers.");
+      return false;
+    }
+    AS_F64_ARRAY(target)->values[position] = AS_NUMBER(value);
+  } else if ( IS_MAP(target) ) {
+    const char* error = map_key_error(stack_peek(1));
+    if ( error != NULL ) {
+      runtime_error("%s", error);
+      return false;
+    }
+    map_set(AS_MAP(target), stack_peek(1), value);
+  } else {
+    runtime_error("Only lists, arrays and maps can be indexed.");
+    return false;
+  }
+  vm->stack_top -= 2;
+  vm->stack_top[-1] = value;
+  return true;
+}
+
 InterpretResult run() {
   // puts("--- RUNNING ---");
+  CallFrame* frame = TOP_FRAME();
 #ifdef CLOX_AINST_TRACE
   disassemble_chunk(&CHUNK(), "All Instructions");
 #endif // CLOX_AINST_TRACE
 #ifndef CLOX_DRY_RUN
+#ifdef CLOX_OP_STATS
+  op_stats_enter();
+#endif // CLOX_OP_STATS
   uint8_t instruction;
   for ( ;;) {
 #ifdef CLOX_STACK_TRACE
     printf("STACK [");
-    for ( Value* slot = vm.stack; slot < vm.stack_top; slot++ ) {
+    for ( Value* slot = vm->stack; slot < vm->stack_top; slot++ ) {
       value_print(*slot);
-      if ( slot + 1 != vm.stack_top )
+      if ( slot + 1 != vm->stack_top )
         printf(", ");
     }
     printf("]\n");
@@ -310,25 +583,80 @@ InterpretResult run() {
 #ifdef CLOX_INST_TRACE
     disassemble_instruction(&CHUNK(), (int)(VMIP() - CHUNK().code));
 #endif
+#ifdef CLOX_OP_STATS
+    op_stats_count(frame->closure->function, *VMIP());
+#endif // CLOX_OP_STATS
     switch ( instruction = READ_BYTE() ) {
     case OP_NIL:      stack_push(NIL_VAL);                                    break;
     case OP_TRUE:     stack_push(TRUE_VAL);                                   break;
     case OP_FALSE:    stack_push(FALSE_VAL);                                  break;
     case OP_CONSTANT: stack_push(READ_CONSTANT());                            break;
-    case OP_LESS:     BINARY_OP(BOOL_VAL, < );                                break;
-    case OP_GREATER:  BINARY_OP(BOOL_VAL, > );                                break;
-    case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *);                               break;
-    case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -);                               break;
+    case OP_LESS:     INT_COMPARE_OP(< ); BINARY_OP(BOOL_VAL, < );            break;
+    case OP_GREATER:  INT_COMPARE_OP(> ); BINARY_OP(BOOL_VAL, > );            break;
+    case OP_MULTIPLY: INT_BINARY_OP(int_mul_overflow);
+                      BINARY_OP(NUMBER_VAL, *);                               break;
+    case OP_SUBTRACT: INT_BINARY_OP(int_sub_overflow);
+                      BINARY_OP(NUMBER_VAL, -);                               break;
     case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, / );                              break;
     case OP_NOT:      stack_push(BOOL_VAL(is_false(stack_pop())));            break;
     case OP_POP:      stack_pop();                                            break;
-    case OP_PRINT:    value_print(stack_pop()); putchar(10);                  break;
-    case OP_SET_LOCAL: TOP_FRAME()->slots[READ_BYTE()] = stack_peek(0);       break;
-    case OP_GET_LOCAL: stack_push(TOP_FRAME()->slots[READ_BYTE()]);           break;
+    case OP_PRINT:    vm_print(stack_pop());                                  break;
+    case OP_SET_LOCAL: frame->slots[READ_BYTE()] = stack_peek(0);            break;
+    case OP_GET_LOCAL: stack_push(frame->slots[READ_BYTE()]);                break;
     case OP_JUMP_IF_FALSE: VMIP() += BOOL_COND() * READ_SHORT();              break;
     case OP_JUMP:          VMIP() += READ_SHORT();                            break;
-    case OP_LOOP:          VMIP() -= READ_SHORT();                            break;
-    case OP_CLOSE_UPVALUE: close_upvalues(vm.stack_top - 1); stack_pop();     break;
+    case OP_LOOP:          VMIP() -= READ_SHORT();
+                           if ( heap_requested | interrupt_requested )
+                             vm_safepoint();                                  break;
+    case OP_CLOSE_UPVALUE: close_upvalues(vm->stack_top - 1); stack_pop();     break;
+    case OP_BUILD_LIST: {
+      int count = READ_BYTE();
+      ObjectList* list = new_list(vm->stack_top - count, count);
+      vm->stack_top -= count;
+      stack_push(OBJECT_VAL(list));                                           break;
+    }
+    case OP_GET_INDEX: if ( !index_get() ) return INTERPRET_RUNTIME_ERROR;    break;
+    case OP_SET_INDEX: if ( !index_set() ) return INTERPRET_RUNTIME_ERROR;    break;
+    case OP_FOR_ITER: {
+      // The sequence and the next index, the item is pushed as the loop
+      // variable. Maps push their keys and index their slots.
+      Value* iterator = frame->slots + READ_BYTE();
+      uint16_t exit = READ_SHORT();
+      int index = (int)AS_NUMBER(iterator[1]);
+      if ( IS_LIST(iterator[0]) ) {
+        ObjectList* list = AS_LIST(iterator[0]);
+        if ( index >= list->count ) {
+          VMIP() += exit;                                                     break;
+        }
+        stack_push(list->items[index]);
+      } else if ( IS_F64_ARRAY(iterator[0]) ) {
+        ObjectF64Array* array = AS_F64_ARRAY(iterator[0]);
+        if ( index >= array->count ) {
+          VMIP() += exit;                                                     break;
+        }
+        stack_push(NUMBER_VAL(array->values[index]));
+      } else if ( IS_MAP(iterator[0]) ) {
+        if ( (index = map_next(AS_MAP(iterator[0]), index)) < 0 ) {
+          VMIP() += exit;                                                     break;
+        }
+        stack_push(AS_MAP(iterator[0])->entries[index].key);
+      } else if ( IS_READER(iterator[0]) ) {
+        // Readers keep their own position, the index only counts.
+        Value line = reader_line(AS_READER(iterator[0]));
+        if ( IS_NIL(line) ) {
+          VMIP() += exit;                                                     break;
+        }
+        if ( IS_ERROR(line) ) {
+          runtime_error("%s", AS_ERROR(line));
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        stack_push(line);
+      } else {
+        runtime_error("Can only iterate over lists, arrays, maps and readers.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      iterator[1] = int_value(index + 1);                                     break;
+    }
     case OP_CLASS: stack_push(OBJECT_VAL(new_class(READ_STRING())));          break;
     case OP_METHOD: define_method(READ_STRING());                             break;
     case OP_SUPER_INVOKE: {
@@ -336,7 +664,8 @@ InterpretResult run() {
       int arg_count = READ_BYTE();
       ObjectClass* sup = AS_CLASS(stack_pop());
       if ( !invoke_from_class(sup, method, arg_count) )
-        return INTERPRET_RUNTIME_ERROR;                                       break;
+        return INTERPRET_RUNTIME_ERROR;
+      LOAD_FRAME();                                                           break;
     }
     case OP_GET_SUPER: {
       ObjectString* name = READ_STRING();
@@ -356,13 +685,15 @@ InterpretResult run() {
         * sup = AS_CLASS(stack_peek(1)),
         * sub = AS_CLASS(stack_peek(0));
       table_concat(&sub->methods, &sup->methods);
+      sub->initializer = sup->initializer;
       stack_pop();                                                            break;
     }
     case OP_INVOKE: {
       ObjectString* property = READ_STRING();
       int arg_count = READ_BYTE();
       if ( !invoke_property(property, arg_count) )
-        return INTERPRET_RUNTIME_ERROR;                                       break;
+        return INTERPRET_RUNTIME_ERROR;
+      LOAD_FRAME();                                                           break;
     }
     case OP_SET_PROPERTY: {
       if ( !IS_INSTANCE(stack_peek(1)) ) {
@@ -371,6 +702,9 @@ InterpretResult run() {
       }
       ObjectInstance* instance = AS_INSTANCE(stack_peek(1));
       table_set(&instance->fields, READ_STRING(), stack_peek(0));
+      if ( instance->fields.capacity > instance->klass->field_capacity
+        && instance->fields.capacity <= INSTANCE_MAX_PREALLOC )
+        instance->klass->field_capacity = instance->fields.capacity;
       Value value = stack_pop();
       stack_pop(); // Instance
       stack_push(value);                                                      break;
@@ -391,39 +725,88 @@ InterpretResult run() {
       runtime_error("Undefined property '%s'.", property->chars);
       return INTERPRET_RUNTIME_ERROR;
     }
+    // Method locals, see method_local: the receiver sits in the slot
+    // below the method and is nil once the slot holds a plain value.
+    case OP_GET_METHOD: {
+      if ( !IS_INSTANCE(stack_peek(0)) ) {
+        runtime_error("Only instances have properties.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      ObjectInstance* instance = AS_INSTANCE(stack_peek(0));
+      ObjectString* property = READ_STRING();
+      Value value;
+      if ( table_get(&instance->fields, property, &value) ) {
+        vm->stack_top[-1] = NIL_VAL;
+        stack_push(value);                                                    break;
+      }
+      if ( class_method(instance->klass, property, &value) ) {
+        stack_push(value);                                                    break;
+      }
+      runtime_error("Undefined property '%s'.", property->chars);
+      return INTERPRET_RUNTIME_ERROR;
+    }
+    case OP_GET_METHOD_LOCAL: {
+      Value* slot = frame->slots + READ_BYTE();
+      if ( !IS_NIL(slot[-1]) ) {
+        // Escapes: bound once, later reads share the bound method.
+        *slot = OBJECT_VAL(new_bound_method(slot[-1], AS_CLOSURE(*slot)));
+        slot[-1] = NIL_VAL;
+      }
+      stack_push(*slot);                                                      break;
+    }
+    case OP_SET_METHOD_LOCAL: {
+      Value* slot = frame->slots + READ_BYTE();
+      *slot = stack_peek(0);
+      slot[-1] = NIL_VAL;                                                     break;
+    }
+    case OP_METHOD_CALLEE: {
+      Value* slot = frame->slots + READ_BYTE();
+      stack_push(IS_NIL(slot[-1]) ? *slot : slot[-1]);                       break;
+    }
+    case OP_CALL_METHOD: {
+      Value* slot = frame->slots + READ_BYTE();
+      int arg_count = READ_BYTE();
+      if ( IS_NIL(slot[-1]) ? !call_value(*slot, arg_count)
+        : !call_function(AS_CLOSURE(*slot), arg_count) )
+        return INTERPRET_RUNTIME_ERROR;
+      LOAD_FRAME();                                                           break;
+    }
     case OP_RETURN: {
       Value result = stack_pop();
-      close_upvalues(TOP_FRAME()->slots);
-      --vm.frame_count;
-      if ( vm.frame_count == 0 ) {
-        stack_pop();
-        return INTERPRET_OKAY;
+      close_upvalues(frame->slots);
+      vm->stack_top = vm->frames[--vm->frame_count].slots;
+      if ( vm->frame_count == 0 && vm->fiber != vm->main_fiber ) {
+        fiber_finish(result);
+        LOAD_FRAME();                                                         break;
       }
-      vm.stack_top = (TOP_FRAME() + 1)->slots;
-      stack_push(result);                                                     break;
+      stack_push(result);
+      // The outermost result is left for the caller, see interpret_function.
+      if ( vm->frame_count == vm->run_base ) return INTERPRET_OKAY;
+      LOAD_FRAME();                                                           break;
     }
     case OP_GET_UPVALUE:
-      stack_push(*TOP_FRAME()->closure->upvalues[READ_BYTE()]->location);     break;
+      stack_push(*frame->closure->upvalues[READ_BYTE()]->location);          break;
     case OP_SET_UPVALUE:
-      *TOP_FRAME()->closure->upvalues[READ_BYTE()]->location = stack_peek(0); break;
+      *frame->closure->upvalues[READ_BYTE()]->location = stack_peek(0);      break;
     case OP_CLOSURE: {
       ObjectFunction* function = AS_FUNCTION(READ_CONSTANT());
       ObjectClosure* closure = new_closure(function);
       stack_push(OBJECT_VAL(closure));
       for ( int i = 0; i < closure->upvalue_count; ++i )
         closure->upvalues[i] = READ_BYTE() ?
-        capture_upvalue(TOP_FRAME()->slots + READ_BYTE()) :
-        TOP_FRAME()->closure->upvalues[READ_BYTE()];                          break;
+        capture_upvalue(frame->slots + READ_BYTE()) :
+        frame->closure->upvalues[READ_BYTE()];                                break;
     }
     case OP_CALL: {
       int arg_count = READ_BYTE();
       if ( !call_value(stack_peek(arg_count), arg_count) )
-        return INTERPRET_RUNTIME_ERROR;                                       break;
+        return INTERPRET_RUNTIME_ERROR;
+      LOAD_FRAME();                                                           break;
     }
     case OP_SET_GLOBAL: {
       ObjectString* name = READ_STRING();
-      if ( table_set(&vm.globals, name, stack_peek(0)) ) {
-        table_del(&vm.globals, name);
+      if ( table_set(&vm->globals, name, stack_peek(0)) ) {
+        table_del(&vm->globals, name);
         runtime_error("[Setter] Undefined variable '%s'.", name->chars);
         return INTERPRET_RUNTIME_ERROR;
       }                                                                       break;
@@ -431,17 +814,18 @@ InterpretResult run() {
     case OP_GET_GLOBAL: {
       ObjectString* name = READ_STRING();
       Value value;
-      if ( !table_get(&vm.globals, name, &value) ) {
+      if ( !table_get(&vm->globals, name, &value) ) {
         runtime_error("[Getter] Undefined variable '%s'.", name->chars);
         return INTERPRET_RUNTIME_ERROR;
       } stack_push(value);                                                    break;
     }
     case OP_DEFINE_GLOBAL: {
       ObjectString* name = READ_STRING();
-      table_set(&vm.globals, name, stack_peek(0));
+      table_set(&vm->globals, name, stack_peek(0));
       stack_pop();                                                            break;
     }
     case OP_ADD:
+      INT_BINARY_OP(int_add_overflow);
       if ( IS_STRING(stack_peek(0)) && IS_STRING(stack_peek(1)) )
         concatenate_string();
       else if ( IS_NUMBER(stack_peek(0)) && IS_NUMBER(stack_peek(1)) ) {
@@ -458,6 +842,13 @@ InterpretResult run() {
       stack_push(BOOL_VAL(values_equal(a, b)));                               break;
     }
     case OP_NEGATE:
+#ifdef NAN_BOXING_OPT
+      // Negating 0 gives -0 and INT32_MIN has no positive twin.
+      if ( IS_INT(stack_peek(0)) && AS_INT(stack_peek(0)) != 0 &&
+        AS_INT(stack_peek(0)) != INT32_MIN ) {
+        vm->stack_top[-1] = INT_VAL(-AS_INT(stack_peek(0)));                 break;
+      }
+#endif // NAN_BOXING_OPT
       if ( !IS_NUMBER(stack_peek(0)) ) {
         runtime_error("Operand must be a number.");
         return INTERPRET_RUNTIME_ERROR;
@@ -468,20 +859,42 @@ InterpretResult run() {
   return INTERPRET_OKAY;
 }
 
+// Calls the value below its arguments from inside a native, the
+// result replaces them. On failure the error has been reported and
+// the stack reset, the native must return ERROR_VAL(call_failed).
+// Fibers cannot be switched until the call returns.
+bool call_nested(int arg_count) {
+  int base = vm->run_base;
+  vm->run_base = vm->frame_count;
+  bool okay = call_value(stack_peek(arg_count), arg_count)
+    && (vm->frame_count == vm->run_base || run() == INTERPRET_OKAY);
+  vm->run_base = base;
+  return okay;
+}
+
 InterpretResult
-interpret(const char* source) {
-  // puts("--- INTERPRET ---");
-  ObjectFunction* function = compile(source);
-  if ( function == NULL ) return INTERPRET_COMPILE_ERROR;
+interpret_function(ObjectFunction* function) {
   stack_push(OBJECT_VAL(function));
   ObjectClosure* closure = new_closure(function);
   stack_pop();
   stack_push(OBJECT_VAL(closure));
   call_value(OBJECT_VAL(closure), 0);
-  return run();
+  InterpretResult result = run();
+  if ( result == INTERPRET_OKAY ) stack_pop();
+  output_flush();
+  return result;
 }
 
-void repl() {
+InterpretResult
+interpret(Vm* instance, const char* source) {
+  // puts("--- INTERPRET ---");
+  vm = instance;
+  ObjectFunction* function = compile(source);
+  if ( function == NULL ) return INTERPRET_COMPILE_ERROR;
+  return interpret_function(function);
+}
+
+void repl(Vm* instance) {
   const int length = 1024;
   char line[length];
   for ( ;;) {
@@ -490,40 +903,48 @@ void repl() {
       printf("\n");
       break;
     }
-    interpret(line);
+    interpret(instance, line);
   }
 }
 
-char* read_file(const char* path) {
-  // printf("--- READ FILE '%s' ---\n", path);
-  FILE* file = fopen(path, "rb");
-  if ( file == NULL ) {
+// Regular files are mapped and compiled in place, anything
+// else (pipes, '-' for stdin) is compiled as a stream.
+ObjectFunction* load_file(const char* path) {
+  // printf("--- LOAD FILE '%s' ---\n", path);
+  if ( !strcmp(path, "-") ) return compile_stream(STDIN_FILENO);
+  int fd = open(path, O_RDONLY);
+  if ( fd < 0 ) {
     fputs("Cannot open file.\n", stderr);
     exit(74);
   }
-  fseek(file, 0L, SEEK_END);
-  size_t file_size = ftell(file);
-  rewind(file);
-  char* buffer = (char*)malloc(file_size + 1);
-  if ( buffer == NULL ) {
-    fputs("Cannot allocate enough memory.\n", stderr);
-    exit(74);
+  ObjectFunction* function;
+  struct stat info;
+  if ( fstat(fd, &info) || !S_ISREG(info.st_mode) || info.st_size == 0 ) {
+    function = compile_stream(fd);
+    close(fd);
+    return function;
   }
-  size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
-  if ( bytes_read < file_size ) {
+  size_t length = info.st_size;
+  char* source = (char*)mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if ( source == MAP_FAILED ) {
     fputs("Could not load whole file.\n", stderr);
     exit(74);
   }
-  buffer[bytes_read] = '\0';
-  fclose(file);
-  return buffer;
+  function = cache_load(&vm->cache_images, path, source, length);
+  if ( function == NULL && (function = compile_buffer(source, length)) != NULL )
+    cache_store(path, source, length, function);
+  munmap(source, length);
+  return function;
 }
 
-int run_file(const char* path) {
+int run_file(Vm* instance, const char* path) {
   // puts("--- RUNNING FIlE ---");
-  char* source = read_file(path);
-  InterpretResult result = interpret(source);
-  free(source);
+  vm = instance;
+  InterpretResult result;
+  ObjectFunction* function = load_file(path);
+  if ( function == NULL ) result = INTERPRET_COMPILE_ERROR;
+  else result = interpret_function(function);
   switch ( result ) {
   case INTERPRET_COMPILE_ERROR: return 65;
   case INTERPRET_RUNTIME_ERROR: return 70;
@@ -532,15 +953,27 @@ int run_file(const char* path) {
   }
 }
 
+// Errors unwind every fiber back to the main one, the fibers
+// that were waiting on a resume cannot continue.
 void reset_stack() {
-  vm.stack_top = vm.stack;
-  vm.frame_count = 0;
-  vm.open_upvalues = NULL;
+  for ( ObjectFiber* fiber = vm->fiber;
+    fiber != NULL && fiber != vm->main_fiber; fiber = fiber->caller )
+    fiber->state = FIBER_DONE;
+  loop_reset();
+  vm->fiber = vm->main_fiber;
+  if ( vm->fiber != NULL ) vm->fiber->state = FIBER_RUNNING;
+  vm->frames = vm->main_frames;
+  vm->stack = vm->main_stack;
+  vm->stack_top = vm->stack;
+  vm->frame_capacity = FRAMES_MAX;
+  vm->stack_limit = vm->stack + STACK_MAX - UINT8_COUNT;
+  vm->frame_count = 0;
+  vm->open_upvalues = NULL;
 }
 
 void new_object(Object* object) {
-  object->next = vm.objects;
-  vm.objects = object;
+  object->next = vm->objects;
+  vm->objects = object;
 }
 
 ObjectFunction* new_function() {
@@ -568,50 +1001,84 @@ ObjectUpvalue* new_upvalue(Value* slot) {
   upvalue->closed = NIL_VAL;
   upvalue->location = slot;
   upvalue->next = NULL;
+  upvalue->fiber = vm->fiber;
   return upvalue;
 }
 
 ObjectUpvalue* capture_upvalue(Value* slot) {
-  ObjectUpvalue* prev = NULL, * upvalue = vm.open_upvalues;
+  ObjectUpvalue* prev = NULL, * upvalue = vm->open_upvalues;
   while ( upvalue != NULL && upvalue->location > slot ) { prev = upvalue; upvalue = upvalue->next; }
   if ( upvalue != NULL && upvalue->location == slot ) return upvalue;
-  return *(prev == NULL ? &vm.open_upvalues : &prev->next) = new_upvalue(slot);
-}
-
-void vm_init() {
-  vm_start_time = time(NULL);
-  vm.init_string = NULL;
-  table_init(&vm.globals);
-  table_init(&vm.strings);
-  vm.objects = NULL;
-  vm.gray_capacity = 0;
-  vm.gray_count = 0;
-  vm.gray_stack = NULL;
-  vm.bytes_alloc = 0;
-  vm.next_gc = GC_NEXT_INIT;
+  return *(prev == NULL ? &vm->open_upvalues : &prev->next) = new_upvalue(slot);
+}
+
+void vm_init(Vm* instance) {
+  vm = instance;
+  vm->start_time = clock_nanoseconds();
+  vm->run_base = 0;
+  vm->gc_collection_in_progress = false;
+  vm->gc_pause_count = 0;
+  vm->cache_images = NULL;
+  vm->event_loop = NULL;
+#ifdef CLOX_ALLOC_STATS
+  vm->alloc_stats = NULL;
+#endif // CLOX_ALLOC_STATS
+  value_init(&vm->handles);
+  vm->output = (Output){ NULL, 0, OUTPUT_CAPACITY, isatty(STDOUT_FILENO) };
+  if ( OUTPUT_CAPACITY && (vm->output.bytes = (char*)malloc(OUTPUT_CAPACITY)) == NULL ) exit(80);
+  method_cache_clear();
+#ifdef CLOX_OP_STATS
+  vm->op_stats = NULL;
+#endif // CLOX_OP_STATS
+  vm->init_string = NULL;
+  table_init(&vm->globals);
+  table_init(&vm->strings);
+  vm->objects = NULL;
+  vm->gray_capacity = 0;
+  vm->gray_count = 0;
+  vm->gray_stack = NULL;
+  vm->bytes_alloc = 0;
+  vm->next_gc = GC_NEXT_INIT;
+  vm->fiber = vm->main_fiber = NULL;
   reset_stack();
-  vm.init_string = copy_string("init", 4);
+  vm->main_fiber = vm->fiber = new_main_fiber();
+  vm->init_string = copy_string("init", 4);
   setup_lox_native();
 }
 
 void intern_string(ObjectString* string) {
   stack_push(OBJECT_VAL(string));
-  table_set(&vm.strings, string, NIL_VAL);
+  table_set(&vm->strings, string, NIL_VAL);
   stack_pop();
   // printf("Interns: ");
-  // for ( int idx = 0; idx < vm.strings.capacity; idx++ ) {
-  //   Entry* e = vm.strings.entries + idx;
+  // for ( int idx = 0; idx < vm->strings.capacity; idx++ ) {
+  //   Entry* e = vm->strings.entries + idx;
   //   if ( e->key ) printf("\"%.*s\" ", e->key->length, e->key->chars);
   // }
   // putchar(10);
 }
 
-void vm_delete() {
-  vm.init_string = NULL;
-  table_delete(&vm.globals);
-  table_delete(&vm.strings);
-  objects_delete(vm.objects);
-  free(vm.gray_stack);
+void vm_delete(Vm* instance) {
+  vm = instance;
+  output_flush();
+  free(vm->output.bytes);
+  vm->output = (Output){ NULL, 0, 0, false };
+  // Freeing objects must not start a collection over them.
+  gc_pause();
+#ifdef CLOX_OP_STATS
+  op_stats_delete();
+#endif // CLOX_OP_STATS
+#ifdef CLOX_ALLOC_STATS
+  alloc_stats_delete();
+#endif // CLOX_ALLOC_STATS
+  vm->init_string = NULL;
+  table_delete(&vm->globals);
+  table_delete(&vm->strings);
+  value_delete(&vm->handles);
+  objects_delete(vm->objects);
+  cache_images_delete(&vm->cache_images);
+  event_loop_delete(vm->event_loop);
+  free(vm->gray_stack);
 }
 
 // GARBAGE COLLECTOR LIVES HERE: POOR CODE STRUCTURE.
@@ -625,12 +1092,12 @@ void gc_mark_object(Object* object) {
   putchar(10);
 #endif // CLOX_GC_LOG
   object->is_marked = true;
-  if ( vm.gray_capacity < vm.gray_count + 1 ) {
-    vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
-    vm.gray_stack = realloc(vm.gray_stack, sizeof(Object*) * vm.gray_capacity);
-    if ( vm.gray_stack == NULL ) exit(1);
+  if ( vm->gray_capacity < vm->gray_count + 1 ) {
+    vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
+    vm->gray_stack = realloc(vm->gray_stack, sizeof(Object*) * vm->gray_capacity);
+    if ( vm->gray_stack == NULL ) exit(1);
   }
-  vm.gray_stack[vm.gray_count++] = object;
+  vm->gray_stack[vm->gray_count++] = object;
 }
 
 void gc_mark_value(Value value) {
@@ -648,15 +1115,26 @@ void gc_mark_table(Table* table) {
 }
 
 void gc_mark_roots() {
-  gc_mark_object((Object*)vm.init_string);
-  for ( Value* slot = vm.stack; slot < vm.stack_top; ++slot )
+  gc_mark_object((Object*)vm->init_string);
+  gc_mark_object((Object*)vm->fiber);
+  gc_mark_object((Object*)vm->main_fiber);
+  for ( Value* slot = vm->stack; slot < vm->stack_top; ++slot )
     gc_mark_value(*slot);
-  for ( int i = 0; i < vm.frame_count; ++i )
-    gc_mark_object((Object*)vm.frames[i].closure);
-  for ( ObjectUpvalue* upv = vm.open_upvalues; upv != NULL; upv = upv->next )
+  for ( int i = 0; i < vm->frame_count; ++i )
+    gc_mark_object((Object*)vm->frames[i].closure);
+  for ( ObjectUpvalue* upv = vm->open_upvalues; upv != NULL; upv = upv->next )
     gc_mark_object((Object*)upv);
   gc_mark_compiler_roots();
-  gc_mark_table(&vm.globals);
+  gc_mark_event_loop();
+  gc_mark_array(&vm->handles);
+  gc_mark_profile();
+#ifdef CLOX_OP_STATS
+  gc_mark_op_stats();
+#endif // CLOX_OP_STATS
+#ifdef CLOX_ALLOC_STATS
+  gc_mark_alloc_stats();
+#endif // CLOX_ALLOC_STATS
+  gc_mark_table(&vm->globals);
 }
 
 void gc_mark_array(ValueArray* array) {
@@ -672,8 +1150,16 @@ void gc_blacken_object(Object* object) {
 #endif // CLOX_GC_LOG
   switch ( object->type ) {
   case OBJ_NATIVE:
-  case OBJ_STRING:                                                   break;
-  case OBJ_UPVALUE: gc_mark_value(((ObjectUpvalue*)object)->closed); break;
+  case OBJ_F64_ARRAY:
+  case OBJ_CHANNEL:
+  case OBJ_ISOLATE:                                                  break;
+  case OBJ_STRING: gc_mark_object(((ObjectString*)object)->owner);   break;
+  case OBJ_UPVALUE: {
+    ObjectUpvalue* upvalue = (ObjectUpvalue*)object;
+    gc_mark_value(upvalue->closed);
+    if ( upvalue->location != &upvalue->closed )
+      gc_mark_object((Object*)upvalue->fiber);                       break;
+  }
   case OBJ_FUNCTION: {
     ObjectFunction* func = (ObjectFunction*)object;
     gc_mark_object((Object*)func->name);
@@ -688,6 +1174,7 @@ void gc_blacken_object(Object* object) {
   case OBJ_CLASS: {
     ObjectClass* klass = (ObjectClass*)object;
     gc_mark_table(&klass->methods);
+    gc_mark_value(klass->initializer);
     gc_mark_object((Object*)klass->name);                            break;
   }
   case OBJ_INSTANCE: {
@@ -700,6 +1187,31 @@ void gc_blacken_object(Object* object) {
     gc_mark_value(bound_method->receiver);
     gc_mark_object((Object*)bound_method->method);                   break;
   }
+  case OBJ_FIBER: {
+    ObjectFiber* fiber = (ObjectFiber*)object;
+    gc_mark_object((Object*)fiber->caller);
+    // The running fiber's stacks are marked through the registers.
+    if ( fiber == vm->fiber )                                        break;
+    for ( Value* slot = fiber->stack; slot < fiber->stack_top; ++slot )
+      gc_mark_value(*slot);
+    for ( int i = 0; i < fiber->frame_count; ++i )
+      gc_mark_object((Object*)fiber->frames[i].closure);
+    for ( ObjectUpvalue* upv = fiber->open_upvalues; upv != NULL; upv = upv->next )
+      gc_mark_object((Object*)upv);                                  break;
+  }
+  case OBJ_LIST: {
+    ObjectList* list = (ObjectList*)object;
+    for ( int i = 0; i < list->count; ++i )
+      gc_mark_value(list->items[i]);                                 break;
+  }
+  case OBJ_MAP: {
+    ObjectMap* map = (ObjectMap*)object;
+    for ( int i = 0; i < map->capacity; ++i ) {
+      gc_mark_value(map->entries[i].key);
+      gc_mark_value(map->entries[i].value);
+    }                                                                break;
+  }
+  case OBJ_READER: gc_mark_object((Object*)((ObjectReader*)object)->block); break;
   default: printf("Blackening Unknown Object: %p\n", object);        break;
   }
 }
@@ -714,13 +1226,16 @@ void gc_table_remove_white(Table* table) {
 }
 
 void gc_trace_references() {
-  while ( vm.gray_count > 0 )
-    gc_blacken_object(vm.gray_stack[--vm.gray_count]);
+  while ( vm->gray_count > 0 )
+    gc_blacken_object(vm->gray_stack[--vm->gray_count]);
 }
 
 void gc_sweep() {
-  Object* prev = NULL, * obj = vm.objects;
+  Object* prev = NULL, * obj = vm->objects;
   while ( obj ) {
+#ifdef CLOX_ALLOC_STATS
+    alloc_stats_sweep(obj, !obj->is_marked);
+#endif // CLOX_ALLOC_STATS
     if ( obj->is_marked ) {
       obj->is_marked = false;
       prev = obj; obj = obj->next;
@@ -732,16 +1247,20 @@ void gc_sweep() {
     putchar(10);
 #endif // CLOX_GC_LOG
     if ( prev ) prev->next = obj->next;
-    else vm.objects = obj->next;
+    else vm->objects = obj->next;
     object_delete(obj);
-    obj = (prev ? prev : vm.objects)->next;
+    obj = prev ? prev->next : vm->objects;
   }
 }
 
+bool gc_paused() { return vm->gc_pause_count > 0; }
+void gc_pause() { ++vm->gc_pause_count; }
+void gc_resume() { --vm->gc_pause_count; }
+
 void update_gc_state(size_t old_size, size_t new_size) {
-  vm.bytes_alloc += new_size - old_size;
+  vm->bytes_alloc += new_size - old_size;
 #if !(defined(CLOX_NOGC) || defined(CLOX_STRESS))
-  if ( vm.bytes_alloc > vm.next_gc )
+  if ( vm->bytes_alloc > vm->next_gc && !gc_paused() )
     collect_garbage();
 #endif // CLOX_NOGC
 }
@@ -749,47 +1268,92 @@ void update_gc_state(size_t old_size, size_t new_size) {
 void collect_garbage() {
 #ifdef CLOX_NOGC
 # ifdef CLOX_GC_LOG
-  printf("-- gc invoked: %ld\n", vm.bytes_alloc);
+  printf("-- gc invoked: %ld\n", vm->bytes_alloc);
 # endif
 #else
   // Prevent recursive GC invocation.
-  if ( gc_collection_in_progress ) {
+  if ( vm->gc_collection_in_progress ) {
 #ifdef CLOX_GC_LOG
     printf("-- gc invoked while still running: alloc=%ld next=%ld\n",
-      vm.bytes_alloc, vm.next_gc);
+      vm->bytes_alloc, vm->next_gc);
 #endif // CLOX_GC_LOG
     return;
   }
   // Prevent any of the 4 collection phases
   // from recursively invoking the GC.
-  gc_collection_in_progress = true;
+  vm->gc_collection_in_progress = true;
 # ifdef CLOX_GC_LOG
   puts("-- gc begin");
-  size_t before = vm.bytes_alloc;
+  size_t before = vm->bytes_alloc;
 # endif // CLOX_GC_LOG
   gc_mark_roots();
   gc_trace_references();
-  gc_table_remove_white(&vm.strings);
+  gc_table_remove_white(&vm->strings);
+  method_cache_clear(); // A new class may take the place of a dead one.
   gc_sweep(); // May lead to GC-invocation: object_delete -> reallocate -> collect_garbage
-  vm.next_gc = vm.bytes_alloc * GC_HEAP_GROW_FACTOR;
+  vm->next_gc = vm->bytes_alloc * GC_HEAP_GROW_FACTOR;
 # ifdef CLOX_GC_LOG
   printf("-- collected %ld bytes (from %ld to %ld) next at %ld\n",
-    before - vm.bytes_alloc, before, vm.bytes_alloc, vm.next_gc);
+    before - vm->bytes_alloc, before, vm->bytes_alloc, vm->next_gc);
   puts("-- gc end");
 # endif // CLOX_GC_LOG
   // It's now safe for anyone to call GC
-  gc_collection_in_progress = false;
+  vm->gc_collection_in_progress = false;
 #endif // CLOX_NOGC
 }
 
+#include "isolate.h"
+#include "parallel.h"
+#include "fiber.h"
+#include "eventloop.h"
+#include "profile.h"
+#include "heap.h"
+#include "f64array.h"
+#include "map.h"
+#include "reader.h"
+#include "slice.h"
+
+Vm* interrupt_vm = NULL;
+
+void interrupt_signal(int signal_number) {
+  interrupt_requested = 1;
+}
+
+// Ctrl-C ends instance's script at its next safepoint, once output
+// and profile are written. Blocking calls are cut short, a second
+// Ctrl-C before the safepoint ends the process right away.
+void interrupt_watch(Vm* instance) {
+  interrupt_vm = instance;
+  struct sigaction action = { 0 };
+  action.sa_handler = interrupt_signal;
+  action.sa_flags = SA_RESETHAND;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+}
+
+// Serves the signal flags, polled by OP_LOOP and the event loop.
+void vm_safepoint() {
+  if ( heap_requested ) heap_safepoint();
+  if ( !interrupt_requested || vm != interrupt_vm ) return;
+  output_flush();
+  if ( vm->objects ) putchar('\n');
+  profile_stop();
+  vm_delete(vm);
+  exit(EXIT_SUCCESS);
+}
+
+#undef OUTPUT_CAPACITY
 #undef READ_CONSTANT
 #undef READ_BYTE
 #undef STACK_MAX
 #undef BINARY_OP
+#undef INT_BINARY_OP
+#undef INT_COMPARE_OP
 #undef READ_STRING
 #undef READ_SHORT
 #undef BOOL_COND
 #undef VMIP
+#undef LOAD_FRAME
 #undef TOP_FRAME
 #undef CHUNK
 
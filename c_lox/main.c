@@ -1,26 +1,27 @@
-#include <stdio.h>
-#include <signal.h>
 #include <lox/all.h>
+#include <stdio.h>
 
-void __attribute__((noreturn))
-vm_delete_on_sigint(int _) {
-  if (vm.objects) putchar(10);
-  vm_delete();
-  exit(EXIT_SUCCESS);
-}
+Vm main_vm;
 
 int main(int argc, char **argv) {
-  // Temporary cleanup procedure for testing
-  signal(SIGINT, vm_delete_on_sigint);
   int exit_code = 0;
-  vm_init();
-  if (argc == 1) repl();
-  else if (argc == 2)
-    exit_code = run_file(argv[1]);
-  else {
-    fputs("Usage: clox [path]\n", stderr);
+  int profile_hz = 0;
+  if (argc > 1 && !strncmp(argv[1], "--profile", 9)) {
+    profile_hz = argv[1][9] == '=' ? atoi(argv[1] + 10) : PROFILE_HZ;
+    if (profile_hz <= 0) profile_hz = -1;
+    argv++, argc--;
+  }
+  vm_init(&main_vm);
+  heap_watch(&main_vm);
+  interrupt_watch(&main_vm);
+  if (argc == 1 && !profile_hz) repl(&main_vm);
+  else if (argc == 2 && (!profile_hz || profile_start(&main_vm, argv[1], profile_hz))) {
+    exit_code = run_file(&main_vm, argv[1]);
+    profile_stop();
+  } else {
+    fputs("Usage: clox [--profile[=hz]] [path | -]\n", stderr);
     exit_code = 64;
   }
-  vm_delete();
+  vm_delete(&main_vm);
   return exit_code;
 }